@@ -0,0 +1,567 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+#include "smallmap.h"
+#include "smallmap_typed.h"
+#include "tshash.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+static uint64_t pcg32_state = 0x853C49E6748FEA9BULL;
+
+static uint32_t pcg32_rotr32(uint32_t x, uint32_t r)
+{
+    return (x >> r) | (x << ((~r + 1) & 31U));
+}
+
+static uint32_t pcg32_rand()
+{
+    uint64_t x = pcg32_state;
+    uint32_t count = (uint32_t)(x >> 59);
+    pcg32_state = x * 0x5851F42D4C957F2DULL + 0xDA3E39CB94B95BDBULL;
+    x ^= x >> 18;
+    return pcg32_rotr32((uint32_t)(x >> 27), count);
+}
+
+static void pcg32_srand(uint64_t seed)
+{
+    do {
+        pcg32_state = 0xDA3E39CB94B95BDBULL + seed;
+    } while(0 == pcg32_state);
+    pcg32_rand();
+}
+
+/**
+ * @brief monotonic time in nanoseconds
+ */
+static uint64_t bench_now()
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER count;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)((double)count.QuadPart * 1.0e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Keys are uint64_t stored inline, and the key argument carries the key itself
+static bool key_constructor(smallmap* map, void* dst_key, const void* src_key)
+{
+    (void)map;
+    memcpy(dst_key, &src_key, sizeof(uint64_t));
+    return true;
+}
+
+static void key_move(smallmap* map, void* dst_key, const void* src_key)
+{
+    (void)map;
+    memcpy(dst_key, src_key, sizeof(uint64_t));
+}
+
+static bool value_constructor(smallmap* map, void* dst_value, const void* src_value)
+{
+    (void)map;
+    memcpy(dst_value, src_value, sizeof(uint64_t));
+    return true;
+}
+
+static void value_move(smallmap* map, void* dst_value, const void* src_value)
+{
+    (void)map;
+    memcpy(dst_value, src_value, sizeof(uint64_t));
+}
+
+static void destructor(smallmap* map, void* item)
+{
+    (void)map;
+    (void)item;
+}
+
+static uint32_t hasher(const void* key)
+{
+    return tshash32(sizeof(uint64_t), key, TSHASH_DEFUALT_SEED);
+}
+
+static uint64_t hasher64(const void* key)
+{
+    return tshash64(sizeof(uint64_t), key, TSHASH_DEFUALT_SEED);
+}
+
+static bool compare(const void* x0, const void* x1)
+{
+    return 0 == memcmp(x0, x1, sizeof(uint64_t));
+}
+
+#define BENCH_KEY(x) ((const void*)(uintptr_t)(x))
+
+static inline uint32_t u64_hash(uint64_t key)
+{
+    return tshash32(sizeof(uint64_t), &key, TSHASH_DEFUALT_SEED);
+}
+
+static inline bool u64_equal(uint64_t x0, uint64_t x1)
+{
+    return x0 == x1;
+}
+
+SM_DEFINE_MAP(u64map, uint64_t, uint64_t, u64_hash, u64_equal)
+
+/**
+ * @brief a map configuration to be measured
+ */
+typedef struct bench_config_t
+{
+    const char* name;
+    uint32_t flags;
+    float max_load;
+    bool hugepage; //!< tables over 2MB are mapped in huge pages
+} bench_config;
+
+static const bench_config bench_configs[] = {
+    {"linear", 0, 0.0f, false},
+    {"linear_hugepage", 0, 0.0f, true},
+    {"robinhood", SM_FLAG_ROBINHOOD, 0.0f, false},
+    {"robinhood_0.9", SM_FLAG_ROBINHOOD, 0.9f, false},
+    {"incremental", SM_FLAG_INCREMENTAL, 0.0f, false},
+    {"wide", SM_FLAG_WIDE, 0.0f, false},
+};
+
+static smallmap* bench_construct(const bench_config* config)
+{
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(uint64_t);
+    desc.value_size = sizeof(uint64_t);
+    desc.flags = config->flags;
+    desc.max_load = config->max_load;
+    desc.key_constructor = key_constructor;
+    desc.key_move = key_move;
+    desc.key_destructor = destructor;
+    desc.value_constructor = value_constructor;
+    desc.value_move = value_move;
+    desc.value_destructor = destructor;
+    desc.hasher = hasher;
+    desc.hasher64 = hasher64;
+    desc.compare = compare;
+    if(config->hugepage) {
+        desc.allocator = sm_hugepage_allocator(NULL);
+    }
+    return sm_construct_desc(&desc);
+}
+
+/**
+ * @brief generate distinct keys, even keys are inserted and odd keys are used for misses
+ */
+static void bench_keys(uint32_t size, uint64_t* keys, uint64_t tag)
+{
+    for(uint32_t i = 0; i < size; ++i) {
+        uint64_t x = ((uint64_t)pcg32_rand() << 32) | pcg32_rand();
+        keys[i] = (x << 1) | tag | 0x2ULL;
+    }
+}
+
+/**
+ * @brief lookups on a map which has experienced removals, most of them are misses
+ */
+static void bench_miss(const bench_config* config, uint32_t size, uint32_t lookups)
+{
+    uint64_t* keys = (uint64_t*)malloc(sizeof(uint64_t) * size);
+    uint64_t* misses = (uint64_t*)malloc(sizeof(uint64_t) * lookups);
+    if(NULL == keys || NULL == misses) {
+        free(misses);
+        free(keys);
+        return;
+    }
+    pcg32_srand(size);
+    bench_keys(size, keys, 0);
+    bench_keys(lookups, misses, 1);
+
+    smallmap* map = bench_construct(config);
+    for(uint32_t i = 0; i < size; ++i) {
+        sm_add(map, BENCH_KEY(keys[i]), &keys[i]);
+    }
+    // Churn a quarter of the items, so that removed slots are left behind
+    for(uint32_t i = 0; i < size; i += 4) {
+        sm_remove(map, BENCH_KEY(keys[i]));
+    }
+    for(uint32_t i = 0; i < size; i += 4) {
+        sm_add(map, BENCH_KEY(keys[i]), &keys[i]);
+    }
+
+    uint64_t found = 0;
+    uint64_t start = bench_now();
+    for(uint32_t i = 0; i < lookups; ++i) {
+        found += (SM_INVALID != sm_find(map, BENCH_KEY(misses[i])));
+    }
+    uint64_t miss_time = bench_now() - start;
+
+    start = bench_now();
+    for(uint32_t i = 0; i < lookups; ++i) {
+        found += (SM_INVALID != sm_find(map, BENCH_KEY(keys[i % size])));
+    }
+    uint64_t hit_time = bench_now() - start;
+
+    printf("%s,%u,%u,%.2f,%.2f,%llu\n",
+           config->name, size, lookups,
+           (double)miss_time / lookups,
+           (double)hit_time / lookups,
+           (unsigned long long)found);
+    sm_destruct(map);
+    free(misses);
+    free(keys);
+}
+
+/**
+ * @brief random hits one by one, then the same lookups by sm_find_batch
+ */
+static void bench_batch(uint32_t size, uint32_t lookups)
+{
+    uint64_t* keys = (uint64_t*)malloc(sizeof(uint64_t) * size);
+    const void** queries = (const void**)malloc(sizeof(const void*) * lookups);
+    uint32_t* positions = (uint32_t*)malloc(sizeof(uint32_t) * lookups);
+    if(NULL == keys || NULL == queries || NULL == positions) {
+        free(positions);
+        free(queries);
+        free(keys);
+        return;
+    }
+    pcg32_srand(size);
+    bench_keys(size, keys, 0);
+    for(uint32_t i = 0; i < lookups; ++i) {
+        queries[i] = BENCH_KEY(keys[pcg32_rand() % size]);
+    }
+    smallmap* map = bench_construct(&bench_configs[0]);
+    for(uint32_t i = 0; i < size; ++i) {
+        sm_add(map, BENCH_KEY(keys[i]), &keys[i]);
+    }
+
+    uint64_t found = 0;
+    uint64_t start = bench_now();
+    for(uint32_t i = 0; i < lookups; ++i) {
+        positions[i] = sm_find(map, queries[i]);
+    }
+    uint64_t serial_time = bench_now() - start;
+    for(uint32_t i = 0; i < lookups; ++i) {
+        found += (SM_INVALID != positions[i]);
+    }
+
+    start = bench_now();
+    sm_find_batch(map, queries, lookups, positions);
+    uint64_t batch_time = bench_now() - start;
+    for(uint32_t i = 0; i < lookups; ++i) {
+        found += (SM_INVALID != positions[i]);
+    }
+
+    printf("batch,%u,%u,%.2f,%.2f,%llu\n",
+           size, lookups,
+           (double)serial_time / lookups,
+           (double)batch_time / lookups,
+           (unsigned long long)found);
+    sm_destruct(map);
+    free(positions);
+    free(queries);
+    free(keys);
+}
+
+/**
+ * @brief load distinct items into an empty map by sm_add one by one, then by sm_build
+ */
+static void bench_build(const bench_config* config, uint32_t size)
+{
+    uint64_t* keys = (uint64_t*)malloc(sizeof(uint64_t) * size);
+    const void** items = (const void**)malloc(sizeof(const void*) * size);
+    if(NULL == keys || NULL == items) {
+        free(items);
+        free(keys);
+        return;
+    }
+    pcg32_srand(size);
+    bench_keys(size, keys, 0);
+    for(uint32_t i = 0; i < size; ++i) {
+        items[i] = BENCH_KEY(keys[i]);
+    }
+
+    uint64_t added = 0;
+    smallmap* map = bench_construct(config);
+    uint64_t start = bench_now();
+    for(uint32_t i = 0; i < size; ++i) {
+        added += sm_add(map, items[i], &keys[i]);
+    }
+    uint64_t add_time = bench_now() - start;
+    sm_destruct(map);
+
+    map = bench_construct(config);
+    start = bench_now();
+    added += sm_build(map, items, keys, size);
+    uint64_t build_time = bench_now() - start;
+    sm_destruct(map);
+
+    printf("%s,%u,%.2f,%.2f,%llu\n",
+           config->name, size,
+           (double)add_time / size,
+           (double)build_time / size,
+           (unsigned long long)added);
+    free(items);
+    free(keys);
+}
+
+/**
+ * @brief startup by sm_build against sm_open_mmap of a saved snapshot, then hits on the opened map
+ */
+static void bench_snapshot(uint32_t size, uint32_t lookups)
+{
+    static const char* path = "smallmap_bench_snapshot.bin";
+    uint64_t* keys = (uint64_t*)malloc(sizeof(uint64_t) * size);
+    const void** items = (const void**)malloc(sizeof(const void*) * size);
+    if(NULL == keys || NULL == items) {
+        free(items);
+        free(keys);
+        return;
+    }
+    pcg32_srand(size);
+    bench_keys(size, keys, 0);
+    for(uint32_t i = 0; i < size; ++i) {
+        items[i] = BENCH_KEY(keys[i]);
+    }
+
+    smallmap* map = bench_construct(&bench_configs[0]);
+    uint64_t start = bench_now();
+    sm_build(map, items, keys, size);
+    uint64_t build_time = bench_now() - start;
+    start = bench_now();
+    bool saved = sm_save(map, path, NULL, NULL);
+    uint64_t save_time = bench_now() - start;
+    sm_destruct(map);
+
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(uint64_t);
+    desc.value_size = sizeof(uint64_t);
+    desc.hasher = hasher;
+    desc.compare = compare;
+    start = bench_now();
+    map = saved ? sm_open_mmap(path, &desc) : NULL;
+    uint64_t open_time = bench_now() - start;
+    uint64_t found = 0;
+    start = bench_now();
+    for(uint32_t i = 0; NULL != map && i < lookups; ++i) {
+        found += (SM_INVALID != sm_find(map, items[pcg32_rand() % size]));
+    }
+    uint64_t hit_time = bench_now() - start;
+    sm_destruct(map);
+    remove(path);
+
+    printf("snapshot,%u,%.3f,%.3f,%.3f,%.2f,%llu\n",
+           size,
+           (double)build_time * 1.0e-6,
+           (double)save_time * 1.0e-6,
+           (double)open_time * 1.0e-6,
+           (double)hit_time / lookups,
+           (unsigned long long)found);
+    free(items);
+    free(keys);
+}
+
+/**
+ * @brief add distinct items one by one, and measure the slowest add which includes expanding
+ */
+static void bench_latency(const bench_config* config, uint32_t size)
+{
+    uint64_t* keys = (uint64_t*)malloc(sizeof(uint64_t) * size);
+    if(NULL == keys) {
+        return;
+    }
+    pcg32_srand(size);
+    bench_keys(size, keys, 0);
+
+    uint64_t added = 0;
+    uint64_t max_time = 0;
+    smallmap* map = bench_construct(config);
+    uint64_t start = bench_now();
+    for(uint32_t i = 0; i < size; ++i) {
+        uint64_t add_start = bench_now();
+        added += sm_add(map, BENCH_KEY(keys[i]), &keys[i]);
+        uint64_t add_time = bench_now() - add_start;
+        max_time = (max_time < add_time) ? add_time : max_time;
+    }
+    uint64_t total_time = bench_now() - start;
+    sm_destruct(map);
+
+    printf("%s,%u,%.2f,%.2f,%llu\n",
+           config->name, size,
+           (double)total_time / size,
+           (double)max_time * 1.0e-3,
+           (unsigned long long)added);
+    free(keys);
+}
+
+/**
+ * @brief the same workload as bench_miss with a map specialized by SM_DEFINE_MAP
+ */
+static void bench_typed_miss(uint32_t size, uint32_t lookups)
+{
+    uint64_t* keys = (uint64_t*)malloc(sizeof(uint64_t) * size);
+    uint64_t* misses = (uint64_t*)malloc(sizeof(uint64_t) * lookups);
+    if(NULL == keys || NULL == misses) {
+        free(misses);
+        free(keys);
+        return;
+    }
+    pcg32_srand(size);
+    bench_keys(size, keys, 0);
+    bench_keys(lookups, misses, 1);
+
+    u64map map;
+    u64map_construct(&map);
+    for(uint32_t i = 0; i < size; ++i) {
+        u64map_add(&map, keys[i], keys[i]);
+    }
+    for(uint32_t i = 0; i < size; i += 4) {
+        u64map_remove(&map, keys[i]);
+    }
+    for(uint32_t i = 0; i < size; i += 4) {
+        u64map_add(&map, keys[i], keys[i]);
+    }
+
+    uint64_t found = 0;
+    uint64_t start = bench_now();
+    for(uint32_t i = 0; i < lookups; ++i) {
+        found += (SM_INVALID != u64map_find(&map, misses[i]));
+    }
+    uint64_t miss_time = bench_now() - start;
+
+    start = bench_now();
+    for(uint32_t i = 0; i < lookups; ++i) {
+        found += (SM_INVALID != u64map_find(&map, keys[i % size]));
+    }
+    uint64_t hit_time = bench_now() - start;
+
+    printf("typed,%u,%u,%.2f,%.2f,%llu\n",
+           size, lookups,
+           (double)miss_time / lookups,
+           (double)hit_time / lookups,
+           (unsigned long long)found);
+    u64map_destruct(&map);
+    free(misses);
+    free(keys);
+}
+
+/**
+ * @brief hash keys of a length one by one by tshash64, then by tshash64_batch in chunks
+ */
+static void bench_hash(uint32_t length, uint32_t count)
+{
+    const uint32_t chunk = 64;
+    uint8_t* data = (uint8_t*)malloc((size_t)length * count + 1);
+    const void** ptrs = (const void**)malloc(sizeof(const void*) * count);
+    size_t* sizes = (size_t*)malloc(sizeof(size_t) * count);
+    uint64_t* hashes = (uint64_t*)malloc(sizeof(uint64_t) * count);
+    if(NULL == data || NULL == ptrs || NULL == sizes || NULL == hashes) {
+        free(hashes);
+        free(sizes);
+        free(ptrs);
+        free(data);
+        return;
+    }
+    pcg32_srand(length);
+    for(size_t i = 0; i < (size_t)length * count; ++i) {
+        data[i] = (uint8_t)pcg32_rand();
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        ptrs[i] = data + (size_t)length * i;
+        // Lengths vary around the given one, as keys of a real set do
+        sizes[i] = (length < 4) ? length : length - (pcg32_rand() & 0x3U);
+    }
+
+    uint64_t checksum = 0;
+    uint64_t start = bench_now();
+    for(uint32_t i = 0; i < count; ++i) {
+        hashes[i] = tshash64(sizes[i], ptrs[i], TSHASH_DEFUALT_SEED);
+    }
+    uint64_t serial_time = bench_now() - start;
+    for(uint32_t i = 0; i < count; ++i) {
+        checksum += hashes[i];
+    }
+
+    start = bench_now();
+    for(uint32_t i = 0; i < count; i += chunk) {
+        uint32_t n = (count - i < chunk) ? count - i : chunk;
+        tshash64_batch(n, sizes + i, ptrs + i, hashes + i, TSHASH_DEFUALT_SEED);
+    }
+    uint64_t batch_time = bench_now() - start;
+    for(uint32_t i = 0; i < count; ++i) {
+        checksum -= hashes[i];
+    }
+
+    printf("hash,%u,%u,%.2f,%.2f,%llu\n",
+           length, count,
+           (double)serial_time / count,
+           (double)batch_time / count,
+           (unsigned long long)checksum);
+    free(hashes);
+    free(sizes);
+    free(ptrs);
+    free(data);
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t max_size = 0x1UL << 20U;
+    uint32_t lookups = 0x1UL << 18U;
+    if(1 < argc) {
+        max_size = (uint32_t)strtoul(argv[1], NULL, 0);
+    }
+    if(2 < argc) {
+        lookups = (uint32_t)strtoul(argv[2], NULL, 0);
+    }
+    printf("config,length,keys,serial_ns,batch_ns,difference\n");
+    for(uint32_t length = 4; length <= 64; length <<= 1) {
+        bench_hash(length, lookups);
+    }
+
+    printf("config,size,lookups,miss_ns,hit_ns,found\n");
+    for(size_t i = 0; i < sizeof(bench_configs) / sizeof(bench_configs[0]); ++i) {
+        for(uint32_t size = 0x1UL << 10U; size <= max_size; size <<= 2) {
+            bench_miss(&bench_configs[i], size, lookups);
+        }
+    }
+    for(uint32_t size = 0x1UL << 10U; size <= max_size; size <<= 2) {
+        bench_typed_miss(size, lookups);
+    }
+
+    printf("config,size,lookups,serial_ns,batch_ns,found\n");
+    for(uint32_t size = 0x1UL << 10U; size <= (max_size << 2); size <<= 2) {
+        bench_batch(size, lookups);
+    }
+
+    printf("config,size,add_ns,build_ns,added\n");
+    for(size_t i = 0; i < sizeof(bench_configs) / sizeof(bench_configs[0]); ++i) {
+        for(uint32_t size = 0x1UL << 10U; size <= (max_size << 2); size <<= 2) {
+            bench_build(&bench_configs[i], size);
+        }
+    }
+
+    printf("config,size,mean_add_ns,max_add_us,added\n");
+    for(size_t i = 0; i < sizeof(bench_configs) / sizeof(bench_configs[0]); ++i) {
+        for(uint32_t size = 0x1UL << 10U; size <= (max_size << 2); size <<= 2) {
+            bench_latency(&bench_configs[i], size);
+        }
+    }
+
+    printf("config,size,build_ms,save_ms,open_ms,hit_ns,found\n");
+    for(uint32_t size = 0x1UL << 10U; size <= (max_size << 2); size <<= 2) {
+        bench_snapshot(size, lookups);
+    }
+    return 0;
+}
@@ -0,0 +1,403 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "sm_thread.h"
+#include "smallmap.h"
+#include "smallmap_concurrent.h"
+#include "smallmap_sharded.h"
+#include "tshash.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+/**
+ * @brief monotonic time in nanoseconds
+ */
+static uint64_t bench_now()
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER count;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)((double)count.QuadPart * 1.0e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/**
+ * @brief xorshift64, each thread has its own state
+ */
+static uint64_t bench_rand(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+// Keys are uint64_t stored inline, and the key argument carries the key itself
+static uint32_t hasher(const void* key)
+{
+    return tshash32(sizeof(uint64_t), key, TSHASH_DEFUALT_SEED);
+}
+
+static bool compare(const void* x0, const void* x1)
+{
+    return 0 == memcmp(x0, x1, sizeof(uint64_t));
+}
+
+static bool key_constructor(smallmap* map, void* dst_key, const void* src_key)
+{
+    (void)map;
+    memcpy(dst_key, &src_key, sizeof(uint64_t));
+    return true;
+}
+
+static void key_move(smallmap* map, void* dst_key, const void* src_key)
+{
+    (void)map;
+    memcpy(dst_key, src_key, sizeof(uint64_t));
+}
+
+static bool value_constructor(smallmap* map, void* dst_value, const void* src_value)
+{
+    (void)map;
+    memcpy(dst_value, src_value, sizeof(uint64_t));
+    return true;
+}
+
+static void destructor(smallmap* map, void* item)
+{
+    (void)map;
+    (void)item;
+}
+
+static bool concurrent_key_constructor(sm_concurrent* map, void* dst_key, const void* src_key)
+{
+    (void)map;
+    memcpy(dst_key, &src_key, sizeof(uint64_t));
+    return true;
+}
+
+static bool concurrent_value_constructor(sm_concurrent* map, void* dst_value, const void* src_value)
+{
+    (void)map;
+    memcpy(dst_value, src_value, sizeof(uint64_t));
+    return true;
+}
+
+static void concurrent_destructor(sm_concurrent* map, void* item)
+{
+    (void)map;
+    (void)item;
+}
+
+#define BENCH_KEY(x) ((const void*)(uintptr_t)(x))
+#define BENCH_KEY_OF(index) (((uint64_t)(index) * 0x9E3779B97F4A7C15ULL) | 0x1ULL)
+
+/**
+ * @brief a smallmap behind one mutex, which is what callers had to do before sm_concurrent
+ */
+typedef struct bench_locked_t
+{
+    smallmap* map;
+    sm_mutex mutex;
+} bench_locked;
+
+/**
+ * @brief work of a thread, writes update keys which only this thread touches
+ */
+typedef struct bench_worker_t
+{
+    sm_concurrent* concurrent;
+    bench_locked* locked;
+    uint32_t index;
+    uint32_t threads;
+    uint32_t size;
+    uint32_t ops;
+    uint32_t read_percent;
+    uint64_t found;
+} bench_worker;
+
+static void bench_worker_run(void* arg)
+{
+    bench_worker* worker = (bench_worker*)arg;
+    uint64_t state = 0x853C49E6748FEA9BULL + worker->index;
+    uint32_t owned = (worker->threads <= worker->size) ? worker->size / worker->threads : 1;
+    uint64_t found = 0;
+    for(uint32_t i = 0; i < worker->ops; ++i) {
+        uint64_t r = bench_rand(&state);
+        if((uint32_t)(r % 100) < worker->read_percent) {
+            uint64_t key = BENCH_KEY_OF((r >> 8) % worker->size);
+            uint64_t value = 0;
+            if(NULL != worker->concurrent) {
+                found += sm_concurrent_try_get(worker->concurrent, BENCH_KEY(key), &value);
+            } else {
+                sm_mutex_lock(&worker->locked->mutex);
+                found += sm_try_get(worker->locked->map, BENCH_KEY(key), &value);
+                sm_mutex_unlock(&worker->locked->mutex);
+            }
+        } else {
+            // Remove then add back an owned key, so that the size stays the same
+            uint64_t key = BENCH_KEY_OF(((r >> 8) % owned) * worker->threads + worker->index);
+            if(NULL != worker->concurrent) {
+                sm_concurrent_remove(worker->concurrent, BENCH_KEY(key));
+                sm_concurrent_add(worker->concurrent, BENCH_KEY(key), &key);
+            } else {
+                sm_mutex_lock(&worker->locked->mutex);
+                sm_remove(worker->locked->map, BENCH_KEY(key));
+                sm_add(worker->locked->map, BENCH_KEY(key), &key);
+                sm_mutex_unlock(&worker->locked->mutex);
+            }
+        }
+    }
+    worker->found = found;
+}
+
+/**
+ * @brief run the workload with threads, and print throughput
+ */
+static void bench_run(const char* name, sm_concurrent* concurrent, bench_locked* locked, uint32_t threads, uint32_t size, uint32_t ops, uint32_t read_percent)
+{
+    bench_worker workers[64];
+    sm_thread handles[64];
+    uint64_t found = 0;
+    uint64_t start = bench_now();
+    for(uint32_t i = 0; i < threads; ++i) {
+        bench_worker* worker = &workers[i];
+        worker->concurrent = concurrent;
+        worker->locked = locked;
+        worker->index = i;
+        worker->threads = threads;
+        worker->size = size;
+        worker->ops = ops;
+        worker->read_percent = read_percent;
+        worker->found = 0;
+        if(!sm_thread_create(&handles[i], bench_worker_run, worker)) {
+            threads = i;
+            break;
+        }
+    }
+    for(uint32_t i = 0; i < threads; ++i) {
+        sm_thread_join(handles[i]);
+        found += workers[i].found;
+    }
+    uint64_t time = bench_now() - start;
+    if(NULL != concurrent) {
+        sm_concurrent_reclaim(concurrent);
+    }
+    printf("%s,%u,%u,%llu,%.2f,%llu\n",
+           name, threads, read_percent,
+           (unsigned long long)threads * ops,
+           (double)threads * ops * 1.0e3 / (double)time,
+           (unsigned long long)found);
+}
+
+/**
+ * @brief work of a thread which adds its slice of keys to a concurrent map
+ */
+typedef struct bench_ingest_t
+{
+    sm_concurrent* concurrent;
+    const uint64_t* keys;
+    uint32_t begin;
+    uint32_t end;
+} bench_ingest;
+
+static void bench_ingest_run(void* arg)
+{
+    bench_ingest* ingest = (bench_ingest*)arg;
+    for(uint32_t i = ingest->begin; i < ingest->end; ++i) {
+        sm_concurrent_add(ingest->concurrent, BENCH_KEY(ingest->keys[i]), &ingest->keys[i]);
+    }
+}
+
+/**
+ * @brief fill empty maps with size keys, and print throughput
+ * @details a single smallmap by sm_build, a sharded map by sm_sharded_build, and a concurrent map by threads adding slices
+ */
+static void bench_ingest_all(const sm_desc* desc, const sm_concurrent_desc* concurrent_desc, uint32_t threads, uint32_t size)
+{
+    const void** keys = (const void**)malloc(sizeof(void*) * size);
+    uint64_t* values = (uint64_t*)malloc(sizeof(uint64_t) * size);
+    if(NULL == keys || NULL == values) {
+        free(keys);
+        free(values);
+        return;
+    }
+    for(uint32_t i = 0; i < size; ++i) {
+        values[i] = BENCH_KEY_OF(i);
+        keys[i] = BENCH_KEY(values[i]);
+    }
+
+    if(1 == threads) {
+        smallmap* map = sm_construct_desc(desc);
+        uint64_t start = bench_now();
+        uint32_t added = sm_build(map, keys, values, size);
+        uint64_t time = bench_now() - start;
+        printf("build,%u,%u,%.2f,%u\n", threads, size, (double)size * 1.0e3 / (double)time, added);
+        sm_destruct(map);
+    }
+
+    {
+        sm_sharded_desc sharded_desc;
+        memset(&sharded_desc, 0, sizeof(sm_sharded_desc));
+        sharded_desc.desc = *desc;
+        sharded_desc.shards = threads * 4;
+        sm_sharded* map = sm_sharded_construct(&sharded_desc);
+        uint64_t start = bench_now();
+        uint32_t added = sm_sharded_build(map, keys, values, size, threads);
+        uint64_t time = bench_now() - start;
+        printf("sharded,%u,%u,%.2f,%u\n", threads, size, (double)size * 1.0e3 / (double)time, added);
+        sm_sharded_destruct(map);
+    }
+
+    {
+        bench_ingest ingests[64];
+        sm_thread handles[64];
+        sm_concurrent* map = sm_concurrent_construct(concurrent_desc);
+        uint32_t started = threads;
+        uint64_t start = bench_now();
+        for(uint32_t i = 0; i < threads; ++i) {
+            ingests[i].concurrent = map;
+            ingests[i].keys = values;
+            ingests[i].begin = (uint32_t)((uint64_t)size * i / threads);
+            ingests[i].end = (uint32_t)((uint64_t)size * (i + 1) / threads);
+            if(!sm_thread_create(&handles[i], bench_ingest_run, &ingests[i])) {
+                started = i;
+                break;
+            }
+        }
+        for(uint32_t i = 0; i < started; ++i) {
+            sm_thread_join(handles[i]);
+        }
+        for(uint32_t i = started; i < threads; ++i) {
+            bench_ingest_run(&ingests[i]);
+        }
+        uint64_t time = bench_now() - start;
+        printf("concurrent,%u,%u,%.2f,%llu\n", threads, size, (double)size * 1.0e3 / (double)time, (unsigned long long)sm_concurrent_size(map));
+        sm_concurrent_destruct(map);
+    }
+    free(keys);
+    free(values);
+}
+
+/**
+ * @brief time growing a full map with rehashing split into tasks
+ */
+static void bench_rehash(const sm_desc* desc, uint32_t threads, uint32_t size)
+{
+    sm_desc rehash_desc = *desc;
+    rehash_desc.rehash_threads = threads;
+    smallmap* map = sm_construct_desc(&rehash_desc);
+    if(NULL == map || !sm_reserve(map, size)) {
+        sm_destruct(map);
+        return;
+    }
+    for(uint32_t i = 0; i < size; ++i) {
+        uint64_t key = BENCH_KEY_OF(i);
+        sm_add(map, BENCH_KEY(key), &key);
+    }
+    uint64_t start = bench_now();
+    bool result = sm_reserve(map, size * 2);
+    uint64_t time = bench_now() - start;
+    printf("rehash,%u,%u,%.3f,%u\n", threads, size, (double)time * 1.0e-6, result ? (uint32_t)sm_size(map) : 0);
+    sm_destruct(map);
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t size = 0x1UL << 20U;
+    uint32_t ops = 0x1UL << 20U;
+    uint32_t max_threads = sm_thread_hardware_concurrency();
+    if(1 < argc) {
+        size = (uint32_t)strtoul(argv[1], NULL, 0);
+    }
+    if(2 < argc) {
+        ops = (uint32_t)strtoul(argv[2], NULL, 0);
+    }
+    if(3 < argc) {
+        max_threads = (uint32_t)strtoul(argv[3], NULL, 0);
+    }
+    max_threads = (max_threads < 1) ? 1 : (64 < max_threads) ? 64 : max_threads;
+
+    sm_concurrent_desc desc;
+    memset(&desc, 0, sizeof(sm_concurrent_desc));
+    desc.key_size = sizeof(uint64_t);
+    desc.value_size = sizeof(uint64_t);
+    desc.key_constructor = concurrent_key_constructor;
+    desc.key_destructor = concurrent_destructor;
+    desc.value_constructor = concurrent_value_constructor;
+    desc.value_destructor = concurrent_destructor;
+    desc.hasher = hasher;
+    desc.compare = compare;
+    sm_concurrent* concurrent = sm_concurrent_construct(&desc);
+
+    bench_locked locked;
+    locked.map = sm_construct(
+        sizeof(uint64_t),
+        sizeof(uint64_t),
+        key_constructor,
+        key_move,
+        destructor,
+        value_constructor,
+        key_move,
+        destructor,
+        hasher,
+        compare,
+        NULL, NULL);
+    sm_mutex_init(&locked.mutex);
+    if(NULL == concurrent || NULL == locked.map) {
+        return -1;
+    }
+    for(uint32_t i = 0; i < size; ++i) {
+        uint64_t key = BENCH_KEY_OF(i);
+        sm_concurrent_add(concurrent, BENCH_KEY(key), &key);
+        sm_add(locked.map, BENCH_KEY(key), &key);
+    }
+
+    static const uint32_t read_percents[] = {100, 90, 50};
+    printf("map,threads,read_percent,ops,mops,found\n");
+    for(size_t i = 0; i < sizeof(read_percents) / sizeof(read_percents[0]); ++i) {
+        for(uint32_t threads = 1; threads <= max_threads; ++threads) {
+            bench_run("mutex", NULL, &locked, threads, size, ops, read_percents[i]);
+            bench_run("concurrent", concurrent, NULL, threads, size, ops, read_percents[i]);
+        }
+    }
+
+    sm_desc ingest_desc;
+    memset(&ingest_desc, 0, sizeof(sm_desc));
+    ingest_desc.key_size = sizeof(uint64_t);
+    ingest_desc.value_size = sizeof(uint64_t);
+    ingest_desc.key_constructor = key_constructor;
+    ingest_desc.key_move = key_move;
+    ingest_desc.key_destructor = destructor;
+    ingest_desc.value_constructor = value_constructor;
+    ingest_desc.value_move = key_move;
+    ingest_desc.value_destructor = destructor;
+    ingest_desc.hasher = hasher;
+    ingest_desc.compare = compare;
+    printf("map,threads,size,mops,added\n");
+    for(uint32_t threads = 1; threads <= max_threads; ++threads) {
+        bench_ingest_all(&ingest_desc, &desc, threads, size);
+    }
+
+    printf("map,threads,size,rehash_ms,size\n");
+    for(uint32_t threads = 1; threads <= max_threads; ++threads) {
+        bench_rehash(&ingest_desc, threads, size);
+    }
+
+    sm_mutex_term(&locked.mutex);
+    sm_destruct(locked.map);
+    sm_concurrent_destruct(concurrent);
+    return 0;
+}
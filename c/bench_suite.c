@@ -0,0 +1,761 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE // syscall for perf_event_open
+#endif
+/**
+ * Benchmark suite over workloads which a service sees.
+ *
+ * Every row has the same columns, so the output of two versions can be joined on the first five and compared:
+ * workload,keys,distribution,config,size,ops,ns_per_op,p50_ns,p99_ns,bytes_per_entry,cycles_per_op,cache_misses_per_op,checksum
+ * A column which cannot be measured is -1. Hardware counters come from perf_event_open on Linux, where
+ * perf_event_paranoid allows user space counting.
+ *
+ * usage: smallmap_bench_suite [max_size [ops]]
+ */
+#include "smallmap.h"
+#include "tshash.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define SUITE_MIN_SIZE (0x1UL << 8U) //!< 4KB of keys and values, which stays in L1
+#define SUITE_LATENCY_SAMPLES (0x1UL << 16U) //!< operations timed one by one for percentiles
+#define SUITE_ZIPF_THETA (0.99) //!< skew of YCSB
+#define SUITE_STRING_SIZE (20U) //!< bytes of a string key with its terminator
+
+static uint64_t pcg32_state = 0x853C49E6748FEA9BULL;
+
+static uint32_t pcg32_rotr32(uint32_t x, uint32_t r)
+{
+    return (x >> r) | (x << ((~r + 1) & 31U));
+}
+
+static uint32_t pcg32_rand()
+{
+    uint64_t x = pcg32_state;
+    uint32_t count = (uint32_t)(x >> 59);
+    pcg32_state = x * 0x5851F42D4C957F2DULL + 0xDA3E39CB94B95BDBULL;
+    x ^= x >> 18;
+    return pcg32_rotr32((uint32_t)(x >> 27), count);
+}
+
+static void pcg32_srand(uint64_t seed)
+{
+    do {
+        pcg32_state = 0xDA3E39CB94B95BDBULL + seed;
+    } while(0 == pcg32_state);
+    pcg32_rand();
+}
+
+static double pcg32_rand_double()
+{
+    return (double)pcg32_rand() * (1.0 / 4294967296.0);
+}
+
+/**
+ * @brief monotonic time in nanoseconds
+ */
+static uint64_t bench_now()
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER count;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)((double)count.QuadPart * 1.0e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/**
+ * @struct suite_perf
+ * @brief counters of the calling thread, a descriptor is -1 if the counter is not available
+ */
+typedef struct suite_perf_t
+{
+    int cycles;
+    int cache_misses;
+} suite_perf;
+
+/**
+ * @struct suite_perf_result
+ * @brief counts of a measured section, -1 if not available
+ */
+typedef struct suite_perf_result_t
+{
+    int64_t cycles;
+    int64_t cache_misses;
+} suite_perf_result;
+
+#ifdef __linux__
+static int suite_perf_open_counter(uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int64_t suite_perf_read(int fd)
+{
+    uint64_t count = 0;
+    if(fd < 0 || (ssize_t)sizeof(count) != read(fd, &count, sizeof(count))) {
+        return -1;
+    }
+    return (int64_t)count;
+}
+#endif
+
+static void suite_perf_open(suite_perf* perf)
+{
+#ifdef __linux__
+    perf->cycles = suite_perf_open_counter(PERF_COUNT_HW_CPU_CYCLES);
+    perf->cache_misses = suite_perf_open_counter(PERF_COUNT_HW_CACHE_MISSES);
+#else
+    perf->cycles = -1;
+    perf->cache_misses = -1;
+#endif
+}
+
+static void suite_perf_close(suite_perf* perf)
+{
+#ifdef __linux__
+    if(0 <= perf->cycles) {
+        close(perf->cycles);
+    }
+    if(0 <= perf->cache_misses) {
+        close(perf->cache_misses);
+    }
+#endif
+    perf->cycles = -1;
+    perf->cache_misses = -1;
+}
+
+static void suite_perf_start(const suite_perf* perf)
+{
+#ifdef __linux__
+    if(0 <= perf->cycles) {
+        ioctl(perf->cycles, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf->cycles, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    if(0 <= perf->cache_misses) {
+        ioctl(perf->cache_misses, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf->cache_misses, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#else
+    (void)perf;
+#endif
+}
+
+static suite_perf_result suite_perf_stop(const suite_perf* perf)
+{
+    suite_perf_result result = {-1, -1};
+#ifdef __linux__
+    if(0 <= perf->cycles) {
+        ioctl(perf->cycles, PERF_EVENT_IOC_DISABLE, 0);
+        result.cycles = suite_perf_read(perf->cycles);
+    }
+    if(0 <= perf->cache_misses) {
+        ioctl(perf->cache_misses, PERF_EVENT_IOC_DISABLE, 0);
+        result.cache_misses = suite_perf_read(perf->cache_misses);
+    }
+#else
+    (void)perf;
+#endif
+    return result;
+}
+
+static bool key_constructor(smallmap* map, void* dst_key, const void* src_key)
+{
+    (void)map;
+    memcpy(dst_key, &src_key, sizeof(uint64_t));
+    return true;
+}
+
+static void key_move(smallmap* map, void* dst_key, const void* src_key)
+{
+    (void)map;
+    memcpy(dst_key, src_key, sizeof(uint64_t));
+}
+
+static bool value_constructor(smallmap* map, void* dst_value, const void* src_value)
+{
+    (void)map;
+    memcpy(dst_value, src_value, sizeof(uint64_t));
+    return true;
+}
+
+static void value_move(smallmap* map, void* dst_value, const void* src_value)
+{
+    (void)map;
+    memcpy(dst_value, src_value, sizeof(uint64_t));
+}
+
+static void destructor(smallmap* map, void* item)
+{
+    (void)map;
+    (void)item;
+}
+
+static uint32_t hasher(const void* key)
+{
+    return tshash32(sizeof(uint64_t), key, TSHASH_DEFUALT_SEED);
+}
+
+static bool compare(const void* x0, const void* x1)
+{
+    return 0 == memcmp(x0, x1, sizeof(uint64_t));
+}
+
+#define BENCH_KEY(x) ((const void*)(uintptr_t)(x))
+
+/**
+ * @brief a map configuration to be measured
+ */
+typedef struct suite_config_t
+{
+    const char* name;
+    uint32_t flags;
+    bool trivial; //!< no callbacks, the map copies keys and values as plain data
+} suite_config;
+
+static const suite_config suite_configs[] = {
+    {"linear", 0, false},
+    {"robinhood", SM_FLAG_ROBINHOOD, false},
+    {"dense", SM_FLAG_DENSE, false},
+    {"trivial", 0, true},
+};
+
+/**
+ * @brief integer keys are stored inline, string keys are NUL-terminated strings in string mode
+ */
+static smallmap* suite_construct(const suite_config* config, bool string)
+{
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(uint64_t);
+    desc.value_size = sizeof(uint64_t);
+    desc.flags = config->flags | (string ? SM_FLAG_STRING : 0);
+    if(!config->trivial) {
+        desc.key_constructor = key_constructor;
+        desc.key_move = key_move;
+        desc.key_destructor = destructor;
+        desc.value_constructor = value_constructor;
+        desc.value_move = value_move;
+        desc.value_destructor = destructor;
+    }
+    desc.hasher = hasher;
+    desc.compare = compare;
+    return sm_construct_desc(&desc);
+}
+
+/**
+ * @struct suite_keys
+ * @brief key arguments of the items in a map and of absent keys, in the form which the map takes
+ */
+typedef struct suite_keys_t
+{
+    const void** present;
+    const void** absent;
+    uint64_t* values;
+    char* strings; //!< storage of string keys, NULL for integer keys
+} suite_keys;
+
+/**
+ * @brief generate distinct keys, the lowest bit tells present keys from absent ones
+ */
+static bool suite_keys_create(suite_keys* keys, uint32_t size, bool string)
+{
+    memset(keys, 0, sizeof(suite_keys));
+    keys->present = (const void**)malloc(sizeof(const void*) * size);
+    keys->absent = (const void**)malloc(sizeof(const void*) * size);
+    keys->values = (uint64_t*)malloc(sizeof(uint64_t) * size);
+    if(string) {
+        keys->strings = (char*)malloc((size_t)SUITE_STRING_SIZE * size * 2);
+    }
+    if(NULL == keys->present || NULL == keys->absent || NULL == keys->values || (string && NULL == keys->strings)) {
+        return false;
+    }
+    pcg32_srand(size);
+    for(uint32_t i = 0; i < size * 2; ++i) {
+        uint64_t x = ((uint64_t)pcg32_rand() << 32) | pcg32_rand();
+        x = (x << 1) | (i & 0x1U) | 0x2ULL;
+        const void* key = BENCH_KEY(x);
+        if(string) {
+            char* str = keys->strings + (size_t)SUITE_STRING_SIZE * i;
+            snprintf(str, SUITE_STRING_SIZE, "k%016llx", (unsigned long long)x);
+            key = str;
+        }
+        if(0 == (i & 0x1U)) {
+            keys->present[i >> 1] = key;
+            keys->values[i >> 1] = x;
+        } else {
+            keys->absent[i >> 1] = key;
+        }
+    }
+    return true;
+}
+
+static void suite_keys_destroy(suite_keys* keys)
+{
+    free(keys->strings);
+    free(keys->values);
+    free(keys->absent);
+    free(keys->present);
+}
+
+/**
+ * @struct suite_zipf
+ * @brief Zipfian ranks by the method of Gray et al. which YCSB uses
+ */
+typedef struct suite_zipf_t
+{
+    uint32_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} suite_zipf;
+
+static void suite_zipf_init(suite_zipf* zipf, uint32_t n, double theta)
+{
+    double zeta2 = 1.0 + pow(0.5, theta);
+    double zetan = 0.0;
+    for(uint32_t i = 1; i <= n; ++i) {
+        zetan += 1.0 / pow((double)i, theta);
+    }
+    zipf->n = n;
+    zipf->theta = theta;
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->zetan = zetan;
+    zipf->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+}
+
+static uint32_t suite_zipf_next(const suite_zipf* zipf)
+{
+    double u = pcg32_rand_double();
+    double uz = u * zipf->zetan;
+    if(uz < 1.0) {
+        return 0;
+    }
+    if(uz < 1.0 + pow(0.5, zipf->theta)) {
+        return 1;
+    }
+    uint32_t rank = (uint32_t)(zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+    return (rank < zipf->n) ? rank : zipf->n - 1;
+}
+
+/**
+ * @brief scatter ranks over keys, so that hot keys are not neighbors in the key arrays
+ */
+static uint32_t suite_scramble(uint32_t rank, uint32_t n)
+{
+    uint64_t x = rank;
+    return (uint32_t)(tshash64(sizeof(x), &x, TSHASH_DEFUALT_SEED) % n);
+}
+
+typedef enum suite_distribution_t
+{
+    SUITE_UNIFORM,
+    SUITE_ZIPF,
+} suite_distribution;
+
+static const char* suite_distribution_names[] = {"uniform", "zipf"};
+
+typedef enum suite_lookup_t
+{
+    SUITE_HIT,
+    SUITE_MISS,
+    SUITE_MIXED, //!< half hits and half misses
+} suite_lookup;
+
+static const char* suite_lookup_names[] = {"hit", "miss", "mixed"};
+
+/**
+ * @struct suite_plan
+ * @brief indices of keys to look up for each distribution and each kind of lookup
+ * @details indices are precomputed so that generating them is not measured, and shared by maps of the same size.
+ * An index has the highest bit set for an absent key.
+ */
+typedef struct suite_plan_t
+{
+    uint32_t* indices[2][3];
+} suite_plan;
+
+static void suite_plan_fill(uint32_t* indices, uint32_t ops, uint32_t size, suite_distribution distribution, const suite_zipf* zipf, suite_lookup lookup)
+{
+    for(uint32_t i = 0; i < ops; ++i) {
+        uint32_t index = (SUITE_ZIPF == distribution) ? suite_scramble(suite_zipf_next(zipf), size) : pcg32_rand() % size;
+        bool absent = (SUITE_MISS == lookup) || (SUITE_MIXED == lookup && 0 != (pcg32_rand() & 0x1U));
+        indices[i] = index | (absent ? 0x80000000U : 0);
+    }
+}
+
+static inline const void* suite_key(const suite_keys* keys, uint32_t index)
+{
+    return (0 != (index & 0x80000000U)) ? keys->absent[index & 0x7FFFFFFFU] : keys->present[index];
+}
+
+static int suite_compare_u64(const void* x0, const void* x1)
+{
+    uint64_t v0 = *(const uint64_t*)x0;
+    uint64_t v1 = *(const uint64_t*)x1;
+    return (v0 < v1) ? -1 : (v1 < v0);
+}
+
+/**
+ * @struct suite_result
+ * @brief one row of the output
+ */
+typedef struct suite_result_t
+{
+    const char* workload;
+    const char* keys;
+    const char* distribution;
+    const char* config;
+    uint32_t size;
+    uint32_t ops;
+    uint64_t total_ns;
+    int64_t p50_ns;
+    int64_t p99_ns;
+    double bytes_per_entry;
+    suite_perf_result perf;
+    uint64_t checksum;
+} suite_result;
+
+static void suite_print_header()
+{
+    printf("workload,keys,distribution,config,size,ops,ns_per_op,p50_ns,p99_ns,bytes_per_entry,cycles_per_op,cache_misses_per_op,checksum\n");
+}
+
+static void suite_print(const suite_result* result)
+{
+    double ops = (double)result->ops;
+    printf("%s,%s,%s,%s,%u,%u,%.2f,%lld,%lld,%.2f,%.2f,%.4f,%llu\n",
+           result->workload, result->keys, result->distribution, result->config,
+           result->size, result->ops,
+           (double)result->total_ns / ops,
+           (long long)result->p50_ns,
+           (long long)result->p99_ns,
+           result->bytes_per_entry,
+           (0 <= result->perf.cycles) ? (double)result->perf.cycles / ops : -1.0,
+           (0 <= result->perf.cache_misses) ? (double)result->perf.cache_misses / ops : -1.0,
+           (unsigned long long)result->checksum);
+    fflush(stdout);
+}
+
+/**
+ * @brief percentiles of latency samples, less the overhead of reading the clock
+ */
+static void suite_percentiles(suite_result* result, uint64_t* samples, uint32_t count, uint64_t overhead)
+{
+    if(count <= 0) {
+        result->p50_ns = -1;
+        result->p99_ns = -1;
+        return;
+    }
+    qsort(samples, count, sizeof(uint64_t), suite_compare_u64);
+    uint64_t p50 = samples[count / 2];
+    uint64_t p99 = samples[(uint32_t)((uint64_t)count * 99 / 100)];
+    result->p50_ns = (int64_t)((overhead < p50) ? p50 - overhead : 0);
+    result->p99_ns = (int64_t)((overhead < p99) ? p99 - overhead : 0);
+}
+
+/**
+ * @brief the least time between two clock reads
+ */
+static uint64_t suite_clock_overhead()
+{
+    uint64_t overhead = UINT64_MAX;
+    for(uint32_t i = 0; i < 1024; ++i) {
+        uint64_t start = bench_now();
+        uint64_t time = bench_now() - start;
+        overhead = (time < overhead) ? time : overhead;
+    }
+    return overhead;
+}
+
+/**
+ * @brief memory of the buffers of a map per item
+ */
+static double suite_bytes_per_entry(const smallmap* map)
+{
+    sm_statistics stats;
+    sm_stats(map, &stats);
+    if(stats.size <= 0) {
+        return -1.0;
+    }
+    size_t bytes = stats.ctrl_bytes + stats.key_bytes + stats.value_bytes + stats.arena_bytes + stats.old_bytes;
+    return (double)bytes / (double)stats.size;
+}
+
+/**
+ * @brief lookups by sm_try_get, timed as a whole with counters, then one by one for percentiles
+ */
+static void suite_lookup_run(
+    suite_result* result,
+    const smallmap* map,
+    const suite_keys* keys,
+    const uint32_t* indices,
+    uint64_t* samples,
+    const suite_perf* perf,
+    uint64_t overhead)
+{
+    uint64_t checksum = 0;
+    suite_perf_start(perf);
+    uint64_t start = bench_now();
+    for(uint32_t i = 0; i < result->ops; ++i) {
+        uint64_t value = 0;
+        checksum += sm_try_get(map, suite_key(keys, indices[i]), &value) ? value : 1;
+    }
+    result->total_ns = bench_now() - start;
+    result->perf = suite_perf_stop(perf);
+
+    uint32_t count = (SUITE_LATENCY_SAMPLES < result->ops) ? SUITE_LATENCY_SAMPLES : result->ops;
+    for(uint32_t i = 0; i < count; ++i) {
+        uint64_t value = 0;
+        uint64_t op_start = bench_now();
+        checksum += sm_try_get(map, suite_key(keys, indices[i]), &value) ? value : 1;
+        samples[i] = bench_now() - op_start;
+    }
+    suite_percentiles(result, samples, count, overhead);
+    result->checksum = checksum;
+}
+
+/**
+ * @brief a pass over every item by sm_iter_next, timed as a whole with counters
+ */
+static void suite_scan_run(suite_result* result, const smallmap* map, const suite_perf* perf)
+{
+    uint64_t checksum = 0;
+    sm_iter iter;
+    suite_perf_start(perf);
+    uint64_t start = bench_now();
+    sm_iter_begin(map, &iter);
+    while(sm_iter_next(map, &iter)) {
+        checksum += *(const uint64_t*)iter.value;
+    }
+    result->total_ns = bench_now() - start;
+    result->perf = suite_perf_stop(perf);
+    result->p50_ns = -1;
+    result->p99_ns = -1;
+    result->checksum = checksum;
+}
+
+/**
+ * @brief counter updates in place by sm_find_or_insert, timed as a whole with counters, then one by one for percentiles
+ */
+static void suite_upsert_run(suite_result* result, smallmap* map, const suite_keys* keys, const uint32_t* indices, uint64_t* samples, const suite_perf* perf, uint64_t overhead)
+{
+    const uint64_t zero = 0;
+    uint64_t checksum = 0;
+    suite_perf_start(perf);
+    uint64_t start = bench_now();
+    for(uint32_t i = 0; i < result->ops; ++i) {
+        uint64_t* value = (uint64_t*)sm_find_or_insert(map, suite_key(keys, indices[i]), &zero, NULL);
+        checksum += ++*value;
+    }
+    result->total_ns = bench_now() - start;
+    result->perf = suite_perf_stop(perf);
+
+    uint32_t count = (SUITE_LATENCY_SAMPLES < result->ops) ? SUITE_LATENCY_SAMPLES : result->ops;
+    for(uint32_t i = 0; i < count; ++i) {
+        uint64_t op_start = bench_now();
+        uint64_t* value = (uint64_t*)sm_find_or_insert(map, suite_key(keys, indices[i]), &zero, NULL);
+        checksum += ++*value;
+        samples[i] = bench_now() - op_start;
+    }
+    suite_percentiles(result, samples, count, overhead);
+    result->checksum = checksum;
+}
+
+/**
+ * @brief replace the item at index with its absent key, so that the size stays the same
+ * @return 1 if the absent key is added
+ */
+static inline uint64_t suite_churn(smallmap* map, suite_keys* keys, uint32_t index)
+{
+    sm_remove(map, keys->present[index]);
+    uint64_t added = sm_add(map, keys->absent[index], &keys->values[index]);
+    const void* key = keys->present[index];
+    keys->present[index] = keys->absent[index];
+    keys->absent[index] = key;
+    return added;
+}
+
+/**
+ * @brief removals and additions of uniformly chosen items, timed as a whole with counters, then one by one for percentiles
+ */
+static void suite_churn_run(suite_result* result, smallmap* map, suite_keys* keys, const uint32_t* indices, uint64_t* samples, const suite_perf* perf, uint64_t overhead)
+{
+    uint64_t checksum = 0;
+    suite_perf_start(perf);
+    uint64_t start = bench_now();
+    for(uint32_t i = 0; i < result->ops; ++i) {
+        checksum += suite_churn(map, keys, indices[i] & 0x7FFFFFFFU);
+    }
+    result->total_ns = bench_now() - start;
+    result->perf = suite_perf_stop(perf);
+
+    uint32_t count = (SUITE_LATENCY_SAMPLES < result->ops) ? SUITE_LATENCY_SAMPLES : result->ops;
+    for(uint32_t i = 0; i < count; ++i) {
+        uint64_t op_start = bench_now();
+        checksum += suite_churn(map, keys, indices[i] & 0x7FFFFFFFU);
+        samples[i] = bench_now() - op_start;
+    }
+    suite_percentiles(result, samples, count, overhead);
+    result->checksum = checksum;
+    result->bytes_per_entry = suite_bytes_per_entry(map);
+}
+
+/**
+ * @brief every workload on a map of one size and one configuration
+ */
+static void suite_run(
+    const suite_config* config,
+    bool string,
+    uint32_t size,
+    uint32_t ops,
+    const suite_plan* plan,
+    uint64_t* samples,
+    const suite_perf* perf,
+    uint64_t overhead)
+{
+    suite_keys keys;
+    if(!suite_keys_create(&keys, size, string)) {
+        suite_keys_destroy(&keys);
+        return;
+    }
+    smallmap* map = suite_construct(config, string);
+    if(NULL == map) {
+        suite_keys_destroy(&keys);
+        return;
+    }
+    suite_result result;
+    memset(&result, 0, sizeof(suite_result));
+    result.keys = string ? "string" : "int";
+    result.config = config->name;
+    result.size = size;
+
+    // Bulk load
+    result.workload = "bulk";
+    result.distribution = "-";
+    result.ops = size;
+    suite_perf_start(perf);
+    uint64_t start = bench_now();
+    result.checksum = sm_build(map, keys.present, keys.values, size);
+    result.total_ns = bench_now() - start;
+    result.perf = suite_perf_stop(perf);
+    result.p50_ns = -1;
+    result.p99_ns = -1;
+    result.bytes_per_entry = suite_bytes_per_entry(map);
+    suite_print(&result);
+
+    double bytes_per_entry = result.bytes_per_entry;
+    result.ops = ops;
+    for(uint32_t d = 0; d < 2; ++d) {
+        for(uint32_t l = 0; l < 3; ++l) {
+            result.workload = suite_lookup_names[l];
+            result.distribution = suite_distribution_names[d];
+            result.bytes_per_entry = bytes_per_entry;
+            suite_lookup_run(&result, map, &keys, plan->indices[d][l], samples, perf, overhead);
+            suite_print(&result);
+        }
+    }
+
+    result.workload = "scan";
+    result.distribution = "-";
+    result.ops = size;
+    suite_scan_run(&result, map, perf);
+    suite_print(&result);
+
+    result.workload = "upsert";
+    result.distribution = suite_distribution_names[SUITE_UNIFORM];
+    result.ops = ops;
+    suite_upsert_run(&result, map, &keys, plan->indices[SUITE_UNIFORM][SUITE_HIT], samples, perf, overhead);
+    suite_print(&result);
+
+    result.workload = "churn";
+    result.distribution = suite_distribution_names[SUITE_UNIFORM];
+    suite_churn_run(&result, map, &keys, plan->indices[SUITE_UNIFORM][SUITE_HIT], samples, perf, overhead);
+    suite_print(&result);
+
+    sm_destruct(map);
+    suite_keys_destroy(&keys);
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t max_size = 0x1UL << 22U;
+    uint32_t ops = 0x1UL << 20U;
+    if(1 < argc) {
+        max_size = (uint32_t)strtoul(argv[1], NULL, 0);
+    }
+    if(2 < argc) {
+        ops = (uint32_t)strtoul(argv[2], NULL, 0);
+    }
+    if(0x40000000UL < max_size || ops <= 0) {
+        fprintf(stderr, "usage: %s [max_size [ops]]\n", argv[0]);
+        return 1;
+    }
+    suite_plan plan;
+    uint32_t* buffer = (uint32_t*)malloc(sizeof(uint32_t) * ops * 6);
+    uint64_t* samples = (uint64_t*)malloc(sizeof(uint64_t) * SUITE_LATENCY_SAMPLES);
+    if(NULL == buffer || NULL == samples) {
+        free(samples);
+        free(buffer);
+        return 1;
+    }
+    for(uint32_t i = 0; i < 6; ++i) {
+        plan.indices[i / 3][i % 3] = buffer + (size_t)ops * i;
+    }
+    suite_perf perf;
+    suite_perf_open(&perf);
+    uint64_t overhead = suite_clock_overhead();
+    if(perf.cycles < 0 && perf.cache_misses < 0) {
+        fprintf(stderr, "hardware counters are not available\n");
+    }
+
+    suite_print_header();
+    for(uint32_t size = SUITE_MIN_SIZE; size <= max_size; size <<= 2) {
+        suite_zipf zipf;
+        suite_zipf_init(&zipf, size, SUITE_ZIPF_THETA);
+        pcg32_srand(size ^ 0x5A5A5A5AU);
+        for(uint32_t d = 0; d < 2; ++d) {
+            for(uint32_t l = 0; l < 3; ++l) {
+                suite_plan_fill(plan.indices[d][l], ops, size, (suite_distribution)d, &zipf, (suite_lookup)l);
+            }
+        }
+        for(uint32_t s = 0; s < 2; ++s) {
+            for(size_t i = 0; i < sizeof(suite_configs) / sizeof(suite_configs[0]); ++i) {
+                suite_run(&suite_configs[i], 0 != s, size, ops, &plan, samples, &perf, overhead);
+            }
+        }
+    }
+    suite_perf_close(&perf);
+    free(samples);
+    free(buffer);
+    return 0;
+}
@@ -1,4 +1,11 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "sm_thread.h"
 #include "smallmap.h"
+#include "smallmap_concurrent.h"
+#include "smallmap_sharded.h"
+#include "smallmap_typed.h"
 #include "tshash.h"
 #include <stdint.h>
 #include <assert.h>
@@ -123,6 +130,13 @@ static uint32_t hasher(const void* key)
     return tshash32(len, str, TSHASH_DEFUALT_SEED);
 }
 
+static uint64_t hasher64(const void* key)
+{
+    const char* str = *(const char**)(key);
+    size_t len = strlen(str);
+    return tshash64(len, str, TSHASH_DEFUALT_SEED);
+}
+
 static bool compare(const void* x0, const void* x1)
 {
     const char* s0 = *(const char**)x0;
@@ -130,8 +144,1590 @@ static bool compare(const void* x0, const void* x1)
     return 0 == strcmp(s0, s1);
 }
 
+static bool concurrent_key_constructor(sm_concurrent* map, void* dst_key, const void* src_key)
+{
+    const char* src = (const char*)src_key;
+    size_t len = strlen(src);
+    char* dst = (char*)sm_concurrent_allocate(map, (len + 1) * sizeof(char));
+    if(NULL == dst) {
+        return false;
+    }
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+    *((char**)dst_key) = dst;
+    return true;
+}
+
+static void concurrent_key_destructor(sm_concurrent* map, void* key)
+{
+    char** dst = (char**)key;
+    sm_concurrent_deallocate(map, *dst);
+    *dst = NULL;
+}
+
+static bool concurrent_value_constructor(sm_concurrent* map, void* dst_value, const void* src_value)
+{
+    (void)map;
+    memcpy(dst_value, src_value, sizeof(uint32_t));
+    return true;
+}
+
+static void concurrent_value_destructor(sm_concurrent* map, void* value)
+{
+    (void)map;
+    (void)value;
+}
+
+static inline uint32_t u32_hash(uint32_t key)
+{
+    return tshash32(sizeof(uint32_t), &key, TSHASH_DEFUALT_SEED);
+}
+
+static inline bool u32_equal(uint32_t x0, uint32_t x1)
+{
+    return x0 == x1;
+}
+
+SM_DEFINE_MAP(u32map, uint32_t, uint32_t, u32_hash, u32_equal)
+
 #define SAMPLE_NUM (0x1UL<<8U)
 
+static void test_typed(const uint32_t* values)
+{
+    u32map map;
+    bool result = u32map_construct(&map);
+    assert(result);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        result = u32map_add(&map, values[i], i);
+        assert(result);
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        result = u32map_try_get(&map, values[i], &value);
+        assert(result);
+        assert(value == i);
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; i+=2){
+        u32map_remove(&map, values[i]);
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t index = u32map_find(&map, values[i]);
+        assert((index == SM_INVALID) == (0 == (i&1)));
+        (void)index;
+    }
+    (void)result;
+    u32map_destruct(&map);
+}
+
+static void test_incremental(char** keys, const uint32_t* values)
+{
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(char*);
+    desc.value_size = sizeof(uint32_t);
+    desc.flags = SM_FLAG_INCREMENTAL;
+    desc.migrate_slots = 1;
+    desc.key_constructor = key_constructor;
+    desc.key_move = key_move;
+    desc.key_destructor = key_destructor;
+    desc.value_constructor = value_constructor;
+    desc.value_move = value_move;
+    desc.value_destructor = value_destructor;
+    desc.hasher = hasher;
+    desc.compare = compare;
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    // Each add migrates a few slots, so lookups below see items in both buffers
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        bool result = sm_add(map, keys[i], &values[i]);
+        assert(result);
+        for(uint32_t j=0; j<=i; j+=17){
+            uint32_t value;
+            result = sm_try_get(map, keys[j], &value);
+            assert(result);
+            assert(value == values[j]);
+        }
+        (void)result;
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; i+=2){
+        sm_remove(map, keys[i]);
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t index = sm_find(map, keys[i]);
+        assert((index == SM_INVALID) == (0 == (i&1)));
+        (void)index;
+    }
+    while(!sm_migrate(map, 16)){
+    }
+    sm_destruct(map);
+}
+
+static uint64_t concurrent_live_blocks = 0;
+
+static void* concurrent_counting_allocate(size_t size)
+{
+    ++concurrent_live_blocks;
+    return malloc(size);
+}
+
+static void concurrent_counting_deallocate(void* ptr)
+{
+    if(NULL != ptr) {
+        --concurrent_live_blocks;
+    }
+    free(ptr);
+}
+
+static void test_concurrent(char** keys, const uint32_t* values)
+{
+    sm_concurrent_desc desc;
+    memset(&desc, 0, sizeof(sm_concurrent_desc));
+    desc.key_size = sizeof(char*);
+    desc.value_size = sizeof(uint32_t);
+    desc.stripes = 4;
+    desc.key_constructor = concurrent_key_constructor;
+    desc.key_destructor = concurrent_key_destructor;
+    desc.value_constructor = concurrent_value_constructor;
+    desc.value_destructor = concurrent_value_destructor;
+    desc.hasher = hasher;
+    desc.compare = compare;
+    sm_concurrent* map = sm_concurrent_construct(&desc);
+    assert(NULL != map);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        bool result = sm_concurrent_add(map, keys[i], &values[i]);
+        assert(result);
+        result = sm_concurrent_add(map, keys[i], &values[i]);
+        assert(!result);
+        (void)result;
+    }
+    assert(SAMPLE_NUM == sm_concurrent_size(map));
+    // Removed keys are destructed by reclaim, re-adding them fills tombstones until the buffer is purged
+    for(uint32_t round=0; round<4; ++round){
+        for(uint32_t i=0; i<SAMPLE_NUM; i+=2){
+            bool result = sm_concurrent_remove(map, keys[i]);
+            assert(result);
+            (void)result;
+        }
+        for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+            uint32_t value;
+            bool result = sm_concurrent_try_get(map, keys[i], &value);
+            assert(result == (1 == (i&1)));
+            assert(!result || value == values[i]);
+            assert(result == sm_concurrent_contains(map, keys[i]));
+            (void)result;
+        }
+        for(uint32_t i=0; i<SAMPLE_NUM; i+=2){
+            bool result = sm_concurrent_add(map, keys[i], &values[i]);
+            assert(result);
+            (void)result;
+        }
+        sm_concurrent_reclaim(map);
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        bool result = sm_concurrent_try_get(map, keys[i], &value);
+        assert(result);
+        assert(value == values[i]);
+        (void)result;
+    }
+    sm_concurrent_destruct(map);
+
+    // Without reclaim, purging releases the buffers which no reader holds, and the removed keys in them
+    desc.allocate = concurrent_counting_allocate;
+    desc.deallocate = concurrent_counting_deallocate;
+    map = sm_concurrent_construct(&desc);
+    assert(NULL != map);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        sm_concurrent_add(map, keys[i], &values[i]);
+    }
+    uint64_t max_blocks = 0;
+    for(uint32_t round=0; round<32; ++round){
+        for(uint32_t i=0; i<SAMPLE_NUM; i+=2){
+            sm_concurrent_remove(map, keys[i]);
+            sm_concurrent_add(map, keys[i], &values[i]);
+        }
+        max_blocks = (max_blocks < concurrent_live_blocks) ? concurrent_live_blocks : max_blocks;
+    }
+    // Live and removed keys in the current buffer stay under its threshold, retired buffers do not pile up
+    assert(max_blocks < 4 * SAMPLE_NUM);
+    assert(SAMPLE_NUM == sm_concurrent_size(map));
+    (void)max_blocks;
+    sm_concurrent_destruct(map);
+    assert(0 == concurrent_live_blocks);
+}
+
+#define CONCURRENT_WRITERS (2U)
+#define CONCURRENT_READERS (2U)
+#define CONCURRENT_ROUNDS (64U)
+
+/**
+ * @brief work of a thread in test_concurrent_threads
+ */
+typedef struct concurrent_worker_t
+{
+    sm_concurrent* map;
+    char** keys;
+    const uint32_t* values;
+    uint32_t index;
+} concurrent_worker;
+
+/**
+ * @brief remove and add back the even keys which only this writer touches, ending with all of them added
+ */
+static void concurrent_write(void* arg)
+{
+    concurrent_worker* worker = (concurrent_worker*)arg;
+    for(uint32_t round=0; round<CONCURRENT_ROUNDS; ++round){
+        for(uint32_t i=2*worker->index; i<SAMPLE_NUM; i+=2*CONCURRENT_WRITERS){
+            bool result = sm_concurrent_remove(worker->map, worker->keys[i]);
+            assert(result);
+            result = sm_concurrent_add(worker->map, worker->keys[i], &worker->values[i]);
+            assert(result);
+            result = sm_concurrent_add(worker->map, worker->keys[i], &worker->values[i]);
+            assert(!result);
+            (void)result;
+        }
+    }
+}
+
+/**
+ * @brief odd keys are never removed, even keys come and go but never with another value
+ */
+static void concurrent_read(void* arg)
+{
+    concurrent_worker* worker = (concurrent_worker*)arg;
+    for(uint32_t round=0; round<CONCURRENT_ROUNDS; ++round){
+        for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+            uint32_t value = SAMPLE_NUM;
+            bool result = sm_concurrent_try_get(worker->map, worker->keys[i], &value);
+            assert(result || 0 == (i&1));
+            assert(!result || value == worker->values[i]);
+            (void)result;
+            (void)value;
+        }
+        bool found = sm_concurrent_contains(worker->map, "key_missing");
+        assert(!found);
+        (void)found;
+    }
+}
+
+static void test_concurrent_threads(char** keys, const uint32_t* values)
+{
+    sm_concurrent_desc desc;
+    memset(&desc, 0, sizeof(sm_concurrent_desc));
+    desc.key_size = sizeof(char*);
+    desc.value_size = sizeof(uint32_t);
+    desc.stripes = 4;
+    desc.key_constructor = concurrent_key_constructor;
+    desc.key_destructor = concurrent_key_destructor;
+    desc.value_constructor = concurrent_value_constructor;
+    desc.value_destructor = concurrent_value_destructor;
+    desc.hasher = hasher;
+    desc.compare = compare;
+    sm_concurrent* map = sm_concurrent_construct(&desc);
+    assert(NULL != map);
+    // The buffer starts small, so that writers expand and purge it while readers are on it
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        sm_concurrent_add(map, keys[i], &values[i]);
+    }
+    concurrent_worker workers[CONCURRENT_WRITERS + CONCURRENT_READERS];
+    sm_thread handles[CONCURRENT_WRITERS + CONCURRENT_READERS];
+    for(uint32_t i=0; i<CONCURRENT_WRITERS + CONCURRENT_READERS; ++i){
+        workers[i].map = map;
+        workers[i].keys = keys;
+        workers[i].values = values;
+        workers[i].index = (i < CONCURRENT_WRITERS) ? i : i - CONCURRENT_WRITERS;
+        bool started = sm_thread_create(&handles[i], (i < CONCURRENT_WRITERS) ? concurrent_write : concurrent_read, &workers[i]);
+        assert(started);
+        (void)started;
+    }
+    for(uint32_t i=0; i<CONCURRENT_WRITERS + CONCURRENT_READERS; ++i){
+        sm_thread_join(handles[i]);
+    }
+    assert(SAMPLE_NUM == sm_concurrent_size(map));
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        bool result = sm_concurrent_try_get(map, keys[i], &value);
+        assert(result);
+        assert(value == values[i]);
+        (void)result;
+    }
+    sm_concurrent_destruct(map);
+}
+
+static bool count_item(void* ctx, const void* key, const void* value)
+{
+    (void)key;
+    (void)value;
+    ++*(uint32_t*)ctx;
+    return true;
+}
+
+#ifdef SM_STATS_COUNTERS
+typedef struct counting_reader_t
+{
+    const smallmap* map;
+    char** keys;
+} counting_reader;
+
+static void counting_read(void* arg)
+{
+    counting_reader* reader = (counting_reader*)arg;
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint64_t pos = sm_find64(reader->map, reader->keys[i]);
+        assert(SM_INVALID64 != pos);
+        (void)pos;
+    }
+}
+
+static void test_counters_threads(char** keys, const uint32_t* values)
+{
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.value_size = sizeof(uint32_t);
+    desc.flags = SM_FLAG_STRING;
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        bool result = sm_add(map, keys[i], &values[i]);
+        assert(result);
+        (void)result;
+    }
+    // Readers share the const map, and no count is lost
+    sm_statistics before;
+    sm_stats(map, &before);
+    counting_reader reader = {map, keys};
+    sm_thread handles[CONCURRENT_READERS];
+    for(uint32_t i=0; i<CONCURRENT_READERS; ++i){
+        bool started = sm_thread_create(&handles[i], counting_read, &reader);
+        assert(started);
+        (void)started;
+    }
+    for(uint32_t i=0; i<CONCURRENT_READERS; ++i){
+        sm_thread_join(handles[i]);
+    }
+    sm_statistics after;
+    sm_stats(map, &after);
+    assert(before.counters.lookups + CONCURRENT_READERS * SAMPLE_NUM == after.counters.lookups);
+    assert(before.counters.lookup_groups + CONCURRENT_READERS * SAMPLE_NUM <= after.counters.lookup_groups);
+    (void)before;
+    (void)after;
+    sm_destruct(map);
+}
+#endif
+
+static void test_sharded(char** keys, const uint32_t* values)
+{
+    sm_sharded_desc desc;
+    memset(&desc, 0, sizeof(sm_sharded_desc));
+    desc.desc.key_size = sizeof(char*);
+    desc.desc.value_size = sizeof(uint32_t);
+    desc.desc.key_constructor = key_constructor;
+    desc.desc.key_move = key_move;
+    desc.desc.key_destructor = key_destructor;
+    desc.desc.value_constructor = value_constructor;
+    desc.desc.value_move = value_move;
+    desc.desc.value_destructor = value_destructor;
+    desc.desc.hasher = hasher;
+    desc.desc.compare = compare;
+    desc.shards = 3;
+    sm_sharded* map = sm_sharded_construct(&desc);
+    assert(NULL != map);
+    assert(4 == sm_sharded_shard_count(map));
+    // The second build skips the first half, which is already added
+    uint32_t added = sm_sharded_build(map, (const void* const*)keys, values, SAMPLE_NUM/2, 2);
+    assert(SAMPLE_NUM/2 == added);
+    added = sm_sharded_build(map, (const void* const*)keys, values, SAMPLE_NUM, 2);
+    assert(SAMPLE_NUM - SAMPLE_NUM/2 == added);
+    assert(SAMPLE_NUM == sm_sharded_size(map));
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        bool result = sm_sharded_try_get(map, keys[i], &value);
+        assert(result);
+        assert(value == values[i]);
+        uint32_t shard = sm_sharded_route(map, keys[i]);
+        assert(SM_INVALID != sm_find(sm_sharded_shard(map, shard), keys[i]));
+        (void)result;
+        (void)shard;
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; i+=2){
+        sm_sharded_remove(map, keys[i]);
+    }
+    uint32_t count = 0;
+    sm_sharded_for_each(map, count_item, &count);
+    assert(SAMPLE_NUM/2 == count);
+
+    smallmap* merged = sm_construct_desc(&desc.desc);
+    assert(NULL != merged);
+    bool result = sm_add(merged, keys[1], &values[1]);
+    result = result && sm_sharded_merge(map, merged);
+    assert(result);
+    assert(0 == sm_sharded_size(map));
+    assert(SAMPLE_NUM/2 == sm_size(merged));
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        result = sm_try_get(merged, keys[i], &value);
+        assert(result == (1 == (i&1)));
+        assert(!result || value == values[i]);
+    }
+    (void)result;
+    (void)added;
+    (void)count;
+    sm_destruct(merged);
+    sm_sharded_destruct(map);
+}
+
+// A string key is saved as the distance from the key to its characters, which is valid wherever the file is mapped
+static bool key_serialize(void* user, sm_save_context* context, void* dst_key, const void* src_key)
+{
+    (void)user;
+    const char* str = *(const char* const*)src_key;
+    int64_t offset = sm_save_data(context, str, strlen(str) + 1);
+    memcpy(dst_key, &offset, sizeof(int64_t));
+    return true;
+}
+
+static bool snapshot_compare(const void* x0, const void* x1)
+{
+    int64_t offset;
+    memcpy(&offset, x0, sizeof(int64_t));
+    const char* s0 = (const char*)x0 + offset;
+    const char* s1 = *(const char**)x1;
+    return 0 == strcmp(s0, s1);
+}
+
+static void test_snapshot(char** keys, const uint32_t* values, uint32_t flags)
+{
+    static const char* path = "smallmap_snapshot.bin";
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(char*);
+    desc.value_size = sizeof(uint32_t);
+    desc.flags = flags;
+    desc.key_constructor = key_constructor;
+    desc.key_move = key_move;
+    desc.key_destructor = key_destructor;
+    desc.value_constructor = value_constructor;
+    desc.value_move = value_move;
+    desc.value_destructor = value_destructor;
+    desc.hasher = hasher;
+    desc.compare = compare;
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    for(uint32_t i=0; i<SAMPLE_NUM; i+=2){
+        sm_add(map, keys[i], &values[i]);
+    }
+    sm_statistics saved;
+    sm_stats(map, &saved);
+    bool result = sm_save(map, path, key_serialize, NULL);
+    assert(result);
+    sm_destruct(map);
+
+    desc.compare = snapshot_compare;
+    map = sm_open_mmap(path, &desc);
+    assert(NULL != map);
+    assert(SAMPLE_NUM/2 == sm_size(map));
+    // Homes of serialized keys are not hashed again, only Robin Hood distances are stored
+    sm_statistics opened;
+    sm_stats(map, &opened);
+    assert(saved.max_cluster == opened.max_cluster);
+    if(0 != (flags & SM_FLAG_ROBINHOOD)){
+        assert(saved.max_displacement == opened.max_displacement);
+        assert(0 == memcmp(saved.hit_probes, opened.hit_probes, sizeof(saved.hit_probes)));
+    }else{
+        assert(0 == opened.max_displacement);
+    }
+    (void)saved;
+    (void)opened;
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        result = sm_try_get(map, keys[i], &value);
+        assert(result == (0 == (i&1)));
+        assert(!result || value == values[i]);
+    }
+    result = sm_add(map, keys[1], &values[1]);
+    assert(!result);
+    (void)result;
+    sm_destruct(map);
+
+    desc.value_size = sizeof(uint64_t);
+    map = sm_open_mmap(path, &desc);
+    assert(NULL == map);
+
+    // A set has no value bytes to save
+    desc.value_size = 0;
+    desc.value_constructor = NULL;
+    desc.value_move = NULL;
+    desc.value_destructor = NULL;
+    desc.compare = compare;
+    map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    for(uint32_t i=0; i<SAMPLE_NUM; i+=2){
+        sm_add(map, keys[i], &values[i]);
+    }
+    result = sm_save(map, path, key_serialize, NULL);
+    assert(result);
+    sm_destruct(map);
+    desc.compare = snapshot_compare;
+    map = sm_open_mmap(path, &desc);
+    assert(NULL != map);
+    assert(SAMPLE_NUM/2 == sm_size(map));
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        assert((SM_INVALID64 != sm_find64(map, keys[i])) == (0 == (i&1)));
+    }
+    sm_destruct(map);
+    remove(path);
+}
+
+static bool check_string(void* ctx, const void* key, const void* value)
+{
+    const smallmap* map = (const smallmap*)ctx;
+    const char* str = sm_key_string(map, key);
+    uint32_t found;
+    bool result = sm_try_get(map, str, &found);
+    assert(result);
+    assert(found == *(const uint32_t*)value);
+    (void)value;
+    (void)result;
+    (void)found;
+    return true;
+}
+
+static void test_string(char** keys, const uint32_t* values, uint32_t flags)
+{
+    static const char* path = "smallmap_snapshot.bin";
+    static const char* shorts[] = {"", "a", "ab", "abcdefg", "abcdefgh", "abcdefghi"};
+    const uint32_t short_count = sizeof(shorts)/sizeof(shorts[0]);
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.value_size = sizeof(uint32_t);
+    desc.flags = SM_FLAG_STRING | flags;
+    desc.value_constructor = value_constructor;
+    desc.value_move = value_move;
+    desc.value_destructor = value_destructor;
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        bool result = sm_add(map, keys[i], &values[i]);
+        assert(result);
+        (void)result;
+    }
+    for(uint32_t i=0; i<short_count; ++i){
+        bool result = sm_add(map, shorts[i], &values[i]);
+        assert(result);
+        (void)result;
+    }
+    // Removed strings leave garbage in the arena, which is reclaimed while expanding
+    for(uint32_t i=0; i<SAMPLE_NUM; i+=2){
+        sm_remove(map, keys[i]);
+    }
+    smallmap* other = sm_construct_desc(&desc);
+    assert(NULL != other);
+    for(uint32_t i=0; i<SAMPLE_NUM; i+=2){
+        char buffer[64] = {0};
+        strcpy(buffer, keys[i]);
+        bool result = sm_add(other, buffer, &values[i]);
+        assert(result);
+        (void)result;
+    }
+    bool result = sm_merge(map, other);
+    assert(result);
+    assert(0 == sm_size(other));
+    sm_destruct(other);
+    assert(SAMPLE_NUM + short_count == sm_size(map));
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        result = sm_try_get(map, keys[i], &value);
+        assert(result);
+        assert(value == values[i]);
+    }
+    for(uint32_t i=0; i<short_count; ++i){
+        uint32_t value;
+        result = sm_try_get(map, shorts[i], &value);
+        assert(result);
+        assert(value == values[i]);
+    }
+    assert(SM_INVALID == sm_find(map, "abcdefgj"));
+    assert(SM_INVALID == sm_find(map, "key_"));
+    sm_for_each(map, check_string, map);
+
+    result = sm_save(map, path, NULL, NULL);
+    assert(result);
+    sm_destruct(map);
+    map = sm_open_mmap(path, &desc);
+    assert(NULL != map);
+    assert(SAMPLE_NUM + short_count == sm_size(map));
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        result = sm_try_get(map, keys[i], &value);
+        assert(result);
+        assert(value == values[i]);
+    }
+    sm_for_each(map, check_string, map);
+    sm_destruct(map);
+    remove(path);
+
+    // Churn at a steady size never expands, so garbage must be reclaimed by removing
+    map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        sm_add(map, keys[i], &values[i]);
+    }
+    sm_statistics stats;
+    sm_stats(map, &stats);
+    const size_t filled = stats.arena_bytes;
+    for(uint32_t round=0; round<64; ++round){
+        for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+            sm_remove(map, keys[i]);
+            result = sm_add(map, keys[i], &values[i]);
+            assert(result);
+        }
+    }
+    sm_stats(map, &stats);
+    assert(SAMPLE_NUM == stats.size);
+    assert(stats.arena_bytes <= 4 * filled);
+    sm_for_each(map, check_string, map);
+    (void)filled;
+    (void)result;
+    sm_destruct(map);
+}
+
+typedef struct counting_allocator_t
+{
+    size_t threshold;
+    size_t live_bytes;
+    uint32_t live_blocks;
+} counting_allocator;
+
+// Hands blocks to the huge page allocator with a small threshold, so that tables of the tests are mapped
+static void* counting_alloc(void* ctx, size_t size, size_t align)
+{
+    counting_allocator* allocator = (counting_allocator*)ctx;
+    void* ptr = sm_hugepage_alloc(&allocator->threshold, size, align);
+    assert(NULL == ptr || 0 == ((uintptr_t)ptr & (align - 1)));
+    if(NULL != ptr) {
+        allocator->live_bytes += size;
+        ++allocator->live_blocks;
+    }
+    return ptr;
+}
+
+static void counting_dealloc(void* ctx, void* ptr, size_t size)
+{
+    counting_allocator* allocator = (counting_allocator*)ctx;
+    assert(size <= allocator->live_bytes && 0 < allocator->live_blocks);
+    allocator->live_bytes -= size;
+    --allocator->live_blocks;
+    sm_hugepage_dealloc(&allocator->threshold, ptr, size);
+}
+
+static void test_allocator(char** keys, const uint32_t* values, uint32_t flags)
+{
+    counting_allocator counting = {4096, 0, 0};
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(char*);
+    desc.value_size = sizeof(uint32_t);
+    desc.flags = flags;
+    desc.key_constructor = key_constructor;
+    desc.key_move = key_move;
+    desc.key_destructor = key_destructor;
+    desc.value_constructor = value_constructor;
+    desc.value_move = value_move;
+    desc.value_destructor = value_destructor;
+    desc.hasher = hasher;
+    desc.compare = compare;
+    desc.allocator.ctx = &counting;
+    desc.allocator.alloc = counting_alloc;
+    desc.allocator.dealloc = counting_dealloc;
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        bool result = sm_add(map, keys[i], &values[i]);
+        assert(result);
+        (void)result;
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; i+=2){
+        sm_remove(map, keys[i]);
+    }
+    bool reserved = sm_reserve(map, SAMPLE_NUM*64);
+    assert(reserved);
+    (void)reserved;
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        bool result = sm_try_get(map, keys[i], &value);
+        assert(result == (1 == (i&1)));
+        assert(!result || value == values[i]);
+        (void)result;
+    }
+    // Keys are allocated with sm_allocate, and the table is over the threshold
+    assert(SAMPLE_NUM/2 + 2 <= counting.live_blocks);
+    sm_destruct(map);
+    assert(0 == counting.live_bytes);
+    assert(0 == counting.live_blocks);
+
+    desc.allocator = sm_hugepage_allocator(NULL);
+    map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        sm_add(map, keys[i], &values[i]);
+    }
+    assert(SAMPLE_NUM == sm_size(map));
+    sm_destruct(map);
+}
+
+static void test_shrink(char** keys, const uint32_t* values, uint32_t flags)
+{
+    counting_allocator counting = {4096, 0, 0};
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(char*);
+    desc.value_size = sizeof(uint32_t);
+    desc.flags = flags;
+    desc.key_constructor = key_constructor;
+    desc.key_move = key_move;
+    desc.key_destructor = key_destructor;
+    desc.value_constructor = value_constructor;
+    desc.value_move = value_move;
+    desc.value_destructor = value_destructor;
+    desc.hasher = hasher;
+    desc.compare = compare;
+    desc.allocator.ctx = &counting;
+    desc.allocator.alloc = counting_alloc;
+    desc.allocator.dealloc = counting_dealloc;
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    size_t empty_bytes = counting.live_bytes;
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        sm_add(map, keys[i], &values[i]);
+    }
+    for(uint32_t i=8; i<SAMPLE_NUM; ++i){
+        sm_remove(map, keys[i]);
+    }
+    // Without min_load, only sm_shrink_to_fit gives the peak buffer back
+    size_t peak_bytes = counting.live_bytes;
+    bool result = sm_shrink_to_fit(map);
+    assert(result);
+    assert(counting.live_bytes < peak_bytes);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        result = sm_try_get(map, keys[i], &value);
+        assert(result == (i < 8));
+        assert(!result || value == values[i]);
+    }
+    sm_clear(map, false);
+    assert(0 == sm_size(map));
+    assert(SM_INVALID == sm_find(map, keys[0]));
+    assert(empty_bytes == counting.live_bytes);
+    sm_destruct(map);
+    assert(0 == counting.live_bytes);
+
+    desc.min_load = 0.1f;
+    map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        sm_add(map, keys[i], &values[i]);
+    }
+    sm_statistics stats;
+    sm_stats(map, &stats);
+    uint64_t peak_capacity = stats.capacity;
+    for(uint32_t i=8; i<SAMPLE_NUM; ++i){
+        sm_remove(map, keys[i]);
+    }
+    sm_stats(map, &stats);
+    assert(stats.capacity < peak_capacity);
+    assert(8 == sm_size(map));
+    for(uint32_t i=0; i<8; ++i){
+        uint32_t value;
+        result = sm_try_get(map, keys[i], &value);
+        assert(result);
+        assert(value == values[i]);
+    }
+    // Keeping memory leaves the capacity, and the map is usable again
+    uint64_t capacity = stats.capacity;
+    sm_clear(map, true);
+    sm_stats(map, &stats);
+    assert(0 == sm_size(map) && capacity == stats.capacity);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        result = sm_add(map, keys[i], &values[i]);
+        assert(result);
+    }
+    assert(SAMPLE_NUM == sm_size(map));
+    (void)result;
+    (void)peak_bytes;
+    (void)empty_bytes;
+    (void)peak_capacity;
+    (void)capacity;
+    sm_destruct(map);
+    assert(0 == counting.live_bytes);
+}
+
+static void test_upsert(char** keys, uint32_t flags)
+{
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(char*);
+    desc.value_size = sizeof(uint32_t);
+    desc.flags = flags;
+    desc.migrate_slots = 1;
+    desc.key_constructor = key_constructor;
+    desc.key_move = key_move;
+    desc.key_destructor = key_destructor;
+    desc.value_constructor = value_constructor;
+    desc.value_move = value_move;
+    desc.value_destructor = value_destructor;
+    desc.hasher = hasher;
+    desc.compare = compare;
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    // Counting occurrences, key i occurs i%4+1 times
+    const uint32_t zero = 0;
+    uint32_t inserts = 0;
+    for(uint32_t n=0; n<4; ++n){
+        for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+            if(i%4 < n){
+                continue;
+            }
+            bool inserted = false;
+            uint32_t* count = (uint32_t*)sm_find_or_insert(map, keys[i], &zero, &inserted);
+            assert(NULL != count);
+            assert(inserted == (0 == n));
+            inserts += inserted ? 1 : 0;
+            ++*count;
+        }
+    }
+    assert(SAMPLE_NUM == inserts);
+    assert(SAMPLE_NUM == sm_size(map));
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t* count = (uint32_t*)sm_get_ptr(map, keys[i]);
+        assert(NULL != count && i%4+1 == *count);
+        *count = i;
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        bool result = sm_try_get(map, keys[i], &value);
+        assert(result && i == value);
+        (void)result;
+    }
+    sm_remove(map, keys[0]);
+    assert(NULL == sm_get_ptr(map, keys[0]));
+    uint32_t* count = (uint32_t*)sm_find_or_insert(map, keys[0], &zero, NULL);
+    assert(NULL != count && 0 == *count);
+    assert(SAMPLE_NUM == sm_size(map));
+    (void)inserts;
+    (void)count;
+    sm_destruct(map);
+}
+
+static uint32_t uintptr_hasher(const void* key)
+{
+    return tshash32(sizeof(uintptr_t), key, TSHASH_DEFUALT_SEED);
+}
+
+static bool uintptr_compare(const void* x0, const void* x1)
+{
+    return 0 == memcmp(x0, x1, sizeof(uintptr_t));
+}
+
+#define UINTPTR_KEY(x) ((const void*)(uintptr_t)(x)) //!< the key argument is the key itself, 0 is NULL
+
+static void test_trivial(const uint32_t* values, uint32_t flags)
+{
+    counting_allocator counting = {4096, 0, 0};
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(uintptr_t);
+    desc.value_size = sizeof(uint32_t);
+    desc.flags = flags;
+    desc.migrate_slots = 1;
+    desc.hasher = uintptr_hasher;
+    desc.compare = uintptr_compare;
+    desc.allocator.ctx = &counting;
+    desc.allocator.alloc = counting_alloc;
+    desc.allocator.dealloc = counting_dealloc;
+    // Without callbacks, keys are the bits of the key arguments and values are copied
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        bool result = sm_add(map, UINTPTR_KEY(values[i]), &i);
+        assert(result);
+        (void)result;
+    }
+    // One of the values is 0, whose key argument is NULL
+    assert(SM_INVALID64 != sm_find64(map, NULL));
+    for(uint32_t i=0; i<SAMPLE_NUM; i+=2){
+        sm_remove(map, UINTPTR_KEY(values[i]));
+    }
+    assert(SAMPLE_NUM/2 == sm_size(map));
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        bool result = sm_try_get(map, UINTPTR_KEY(values[i]), &value);
+        assert(result == (1 == (i&1)));
+        assert(!result || value == i);
+        (void)result;
+    }
+    const uint32_t zero = 0;
+    uint32_t* value = (uint32_t*)sm_find_or_insert(map, UINTPTR_KEY(values[0]), &zero, NULL);
+    assert(NULL != value && 0 == *value);
+    bool shrunk = sm_shrink_to_fit(map);
+    assert(shrunk);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        assert((0 == i || 1 == (i&1)) == (NULL != sm_get_ptr(map, UINTPTR_KEY(values[i]))));
+    }
+    // Nothing is allocated per item, only the buffers and the context are live
+    assert(counting.live_blocks <= 4);
+    (void)value;
+    (void)shrunk;
+    sm_destruct(map);
+    assert(0 == counting.live_bytes);
+    assert(0 == counting.live_blocks);
+}
+
+static void test_large_homes(void)
+{
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(uintptr_t);
+    desc.value_size = 0;
+    desc.hasher = uintptr_hasher;
+    desc.compare = uintptr_compare;
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    // 2^26 slots, only control bytes and the slots of added items are touched
+    const uint64_t half = 0x1ULL << 25U;
+    bool reserved = sm_reserve64(map, half);
+    assert(reserved);
+    uint32_t upper = 0;
+    for(uint32_t i=0; i<1024; ++i){
+        bool result = sm_add(map, UINTPTR_KEY(i), &upper);
+        assert(result);
+        uint64_t pos = sm_find64(map, UINTPTR_KEY(i));
+        assert(SM_INVALID64 != pos && pos < 2 * half);
+        upper += (half <= pos) ? 1 : 0;
+        (void)result;
+    }
+    // A 32-bit hash reaches homes above 2^25 slots
+    assert(256 < upper && upper < 768);
+    (void)reserved;
+    (void)upper;
+    sm_destruct(map);
+}
+
+#define GROUP_SIZE (240U)
+#define GROUP_SPACING (512U)
+
+static uint64_t group_hasher64(const void* key)
+{
+    // Every key of a group shares a home, which clusters them like a weak hasher. Homes are far apart in a large buffer
+    uint64_t group = *(const uintptr_t*)key / GROUP_SIZE;
+    return (group * GROUP_SPACING) << 7U;
+}
+
+static void test_shrink_robinhood(float min_load)
+{
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(uintptr_t);
+    desc.value_size = sizeof(uint32_t);
+    desc.flags = SM_FLAG_ROBINHOOD | SM_FLAG_WIDE;
+    desc.max_load = 0.9f;
+    desc.min_load = min_load;
+    desc.hasher64 = group_hasher64;
+    desc.compare = uintptr_compare;
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    const uint32_t count = GROUP_SIZE * 48;
+    bool result = sm_reserve(map, GROUP_SPACING * 48);
+    assert(result);
+    for(uint32_t i=0; i<count; ++i){
+        result = sm_add(map, UINTPTR_KEY(i), &i);
+        assert(result);
+    }
+    // The least capacity puts three groups on each home, whose distances do not fit a byte, so a larger one is taken
+    for(uint32_t i=1; i<count; i+=2){
+        sm_remove(map, UINTPTR_KEY(i));
+    }
+    result = sm_shrink_to_fit(map);
+    assert(result);
+    sm_statistics stats;
+    sm_stats(map, &stats);
+    assert(GROUP_SPACING * 32 == stats.capacity);
+    assert(GROUP_SIZE - 1 == stats.max_displacement);
+    assert(count/2 == sm_size(map));
+    for(uint32_t i=0; i<count; ++i){
+        uint32_t value;
+        result = sm_try_get(map, UINTPTR_KEY(i), &value);
+        assert(result == (0 == (i&1)));
+        assert(!result || value == i);
+    }
+    (void)result;
+    sm_destruct(map);
+}
+
+#define REHASH_TASK_SLOTS (0x1U << 16U) //!< the least slots of a buffer per rehash task
+#define REHASH_TASKS (4U)
+#define REHASH_CLUSTER (16U)
+
+static uint64_t rehash_hasher64(const void* key)
+{
+    // The first keys cluster a few slots before the end of each task range, so their probes cross into the next range
+    uint64_t x = *(const uintptr_t*)key;
+    if(x < REHASH_TASKS * REHASH_CLUSTER) {
+        return ((x / REHASH_CLUSTER + 1) * REHASH_TASK_SLOTS - 4) << 7U;
+    }
+    return x * 0x9E3779B97F4A7C15ULL;
+}
+
+typedef struct rehash_spawner_t
+{
+    uint32_t calls;
+    uint32_t max_count;
+} rehash_spawner;
+
+static void rehash_spawn(void* user, void (*task)(void*, uint32_t), void* arg, uint32_t count)
+{
+    rehash_spawner* spawner = (rehash_spawner*)user;
+    ++spawner->calls;
+    spawner->max_count = (spawner->max_count < count) ? count : spawner->max_count;
+    // Tasks write disjoint ranges, so any order gives the same buffer
+    for(uint32_t i = count; 0 < i; --i) {
+        task(arg, i - 1);
+    }
+}
+
+static void test_rehash_tasks(void)
+{
+    rehash_spawner spawner = {0, 0};
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(uintptr_t);
+    desc.value_size = sizeof(uint32_t);
+    desc.flags = SM_FLAG_WIDE;
+    desc.hasher64 = rehash_hasher64;
+    desc.compare = uintptr_compare;
+    desc.rehash_threads = REHASH_TASKS;
+    desc.rehash_spawn = rehash_spawn;
+    desc.rehash_user = &spawner;
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    // The last expansion splits a buffer of REHASH_TASKS ranges
+    const uint32_t count = REHASH_TASK_SLOTS * REHASH_TASKS;
+    for(uint32_t i=0; i<count; ++i){
+        bool result = sm_add(map, UINTPTR_KEY(i), &i);
+        assert(result);
+        (void)result;
+    }
+    assert(2 <= spawner.calls);
+    assert(REHASH_TASKS == spawner.max_count);
+    sm_statistics stats;
+    sm_stats(map, &stats);
+    assert(REHASH_TASK_SLOTS * REHASH_TASKS < stats.capacity);
+    assert(count == sm_size(map));
+    for(uint32_t i=0; i<count; ++i){
+        uint32_t value;
+        bool result = sm_try_get(map, UINTPTR_KEY(i), &value);
+        assert(result);
+        assert(value == i);
+        (void)result;
+    }
+    for(uint32_t i=count; i<count+1024; ++i){
+        assert(SM_INVALID64 == sm_find64(map, UINTPTR_KEY(i)));
+    }
+    (void)stats;
+    sm_destruct(map);
+}
+
+static void test_hashed(char** keys, const uint32_t* values)
+{
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(char*);
+    desc.value_size = sizeof(uint32_t);
+    desc.key_constructor = key_constructor;
+    desc.key_move = key_move;
+    desc.key_destructor = key_destructor;
+    desc.value_constructor = value_constructor;
+    desc.value_move = value_move;
+    desc.value_destructor = value_destructor;
+    desc.hasher = hasher;
+    desc.compare = compare;
+    smallmap* map0 = sm_construct_desc(&desc);
+    desc.flags = SM_FLAG_ROBINHOOD;
+    smallmap* map1 = sm_construct_desc(&desc);
+    assert(NULL != map0 && NULL != map1);
+    // Hashes are computed once, then shared by maps with the same hasher
+    uint64_t* hashes = (uint64_t*)malloc(sizeof(uint64_t)*SAMPLE_NUM);
+    assert(NULL != hashes);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        hashes[i] = sm_hash(map0, keys[i]);
+        assert(hashes[i] == sm_hash(map1, keys[i]));
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        bool result = sm_add_hashed(map0, hashes[i], keys[i], &values[i]);
+        result = result && sm_add_hashed(map1, hashes[i], keys[i], &values[i]);
+        result = result && !sm_add_hashed(map1, hashes[i], keys[i], &values[i]);
+        assert(result);
+        (void)result;
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; i+=2){
+        sm_remove_hashed(map0, hashes[i], keys[i]);
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        bool result = sm_try_get_hashed(map0, hashes[i], keys[i], &value);
+        assert(result == (1 == (i&1)));
+        assert(result == (SM_INVALID != sm_find(map0, keys[i])));
+        assert(sm_find64(map1, keys[i]) == sm_find_hashed(map1, hashes[i], keys[i]));
+        (void)result;
+    }
+    // A build with the hashes skips the keys which are already added
+    smallmap* map2 = sm_construct_desc(&desc);
+    assert(NULL != map2);
+    uint32_t built = sm_build_hashed(map2, hashes, (const void* const*)keys, values, SAMPLE_NUM/2);
+    built += sm_build_hashed(map2, hashes, (const void* const*)keys, values, SAMPLE_NUM);
+    assert(SAMPLE_NUM == built);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        bool result = sm_try_get_hashed(map2, hashes[i], keys[i], &value);
+        assert(result);
+        assert(value == values[i]);
+        (void)result;
+    }
+    (void)built;
+    sm_destruct(map2);
+    free(hashes);
+    sm_destruct(map1);
+    sm_destruct(map0);
+
+    // The sharded map routes by the same hash which its shards use, which works in string mode too
+    sm_sharded_desc sharded_desc;
+    memset(&sharded_desc, 0, sizeof(sm_sharded_desc));
+    sharded_desc.desc.value_size = sizeof(uint32_t);
+    sharded_desc.desc.flags = SM_FLAG_STRING;
+    sharded_desc.desc.value_constructor = value_constructor;
+    sharded_desc.desc.value_move = value_move;
+    sharded_desc.desc.value_destructor = value_destructor;
+    sharded_desc.shards = 4;
+    sm_sharded* sharded = sm_sharded_construct(&sharded_desc);
+    assert(NULL != sharded);
+    uint32_t added = sm_sharded_build(sharded, (const void* const*)keys, values, SAMPLE_NUM/2, 2);
+    assert(SAMPLE_NUM/2 == added);
+    for(uint32_t i=SAMPLE_NUM/2; i<SAMPLE_NUM; ++i){
+        bool result = sm_sharded_add(sharded, keys[i], &values[i]);
+        assert(result);
+        (void)result;
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        bool result = sm_sharded_try_get(sharded, keys[i], &value);
+        assert(result);
+        assert(value == values[i]);
+        (void)result;
+    }
+    (void)added;
+    sm_sharded_destruct(sharded);
+}
+
+static void test_wide(char** keys, const uint32_t* values, uint32_t flags)
+{
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(char*);
+    desc.value_size = sizeof(uint32_t);
+    desc.flags = SM_FLAG_WIDE | flags;
+    desc.key_constructor = key_constructor;
+    desc.key_move = key_move;
+    desc.key_destructor = key_destructor;
+    desc.value_constructor = value_constructor;
+    desc.value_move = value_move;
+    desc.value_destructor = value_destructor;
+    desc.hasher64 = hasher64;
+    desc.compare = compare;
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        bool result = sm_add(map, keys[i], &values[i]);
+        assert(result);
+        assert(sm_hash(map, keys[i]) == ((0 != (flags & SM_FLAG_STRING)) ? tshash64(strlen(keys[i]), keys[i], TSHASH_DEFUALT_SEED) : hasher64(&keys[i])));
+        (void)result;
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; i+=2){
+        uint64_t pos = sm_find64(map, keys[i]);
+        assert(SM_INVALID64 != pos);
+        assert(pos == sm_find(map, keys[i]));
+        sm_remove_at64(map, pos);
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        bool result = sm_try_get(map, keys[i], &value);
+        assert(result == (1 == (i&1)));
+        assert(!result || value == values[i]);
+        assert(result == (SM_INVALID64 != sm_find64(map, keys[i])));
+        (void)result;
+    }
+    assert(SAMPLE_NUM/2 == sm_size(map));
+    sm_destruct(map);
+}
+
+static uint32_t constant_hasher(const void* key)
+{
+    (void)key;
+    return 0x12345678U;
+}
+
+static uint64_t stats_sum(const uint64_t* buckets)
+{
+    uint64_t sum = 0;
+    for(uint32_t i=0; i<SM_STATS_BUCKETS; ++i){
+        sum += buckets[i];
+    }
+    return sum;
+}
+
+static void test_stats(char** keys, const uint32_t* values, uint32_t flags)
+{
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(char*);
+    desc.value_size = sizeof(uint32_t);
+    desc.flags = flags;
+    desc.key_constructor = key_constructor;
+    desc.key_move = key_move;
+    desc.key_destructor = key_destructor;
+    desc.value_constructor = value_constructor;
+    desc.value_move = value_move;
+    desc.value_destructor = value_destructor;
+    desc.hasher = hasher;
+    desc.compare = compare;
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        bool result = sm_add(map, keys[i], &values[i]);
+        assert(result);
+        (void)result;
+    }
+    for(uint32_t i=0; i<SAMPLE_NUM; i+=4){
+        sm_remove(map, keys[i]);
+    }
+    sm_statistics stats;
+    sm_stats(map, &stats);
+    assert(SAMPLE_NUM - SAMPLE_NUM/4 == stats.size);
+    assert(stats.size - stats.old_size == stats_sum(stats.hit_probes));
+    assert(stats.capacity == stats_sum(stats.miss_probes));
+    assert(0.0f < stats.load_factor && stats.load_factor <= stats.max_load);
+    assert(0 < stats.resizes);
+    assert(0 < stats.clusters && stats.max_cluster < stats.capacity);
+    assert(stats.max_displacement <= stats.max_cluster);
+    assert(stats.mean_displacement <= (double)stats.max_displacement);
+    assert(0 < stats.ctrl_bytes && 0 < stats.key_bytes && 0 < stats.value_bytes);
+    assert(0 == stats.arena_bytes);
+    assert(0 == (flags & SM_FLAG_ROBINHOOD) || 0 == stats.deleted);
+    (void)stats_sum;
+    sm_destruct(map);
+
+    // A broken hasher puts every item in one cluster which starts at the shared home
+    desc.hasher = constant_hasher;
+    map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    uint32_t count = 64;
+    for(uint32_t i=0; i<count; ++i){
+        bool result = sm_add(map, keys[i], &values[i]);
+        assert(result);
+        (void)result;
+    }
+    sm_migrate(map, UINT32_MAX);
+    sm_stats(map, &stats);
+    assert(1 == stats.clusters);
+    assert(count == stats.max_cluster);
+    assert(count - 1 == stats.max_displacement);
+    assert(1 == stats.hit_probes[0]);
+    sm_destruct(map);
+}
+
+/**
+ * @brief check that runs of a map with char* keys are in the order of homes, which is the invariant of Robin Hood placement
+ */
+static void check_robinhood_order(const smallmap* map)
+{
+    sm_statistics stats;
+    sm_stats(map, &stats);
+    uint64_t mask = stats.capacity - 1;
+    uint64_t count = 0;
+    uint64_t last_position = 0;
+    uint64_t last_displacement = 0;
+    sm_iter iter;
+    sm_iter_begin(map, &iter);
+    while(sm_iter_next(map, &iter)){
+        uint64_t home = (sm_hash(map, *(char* const*)iter.key) >> 7U) & mask;
+        uint64_t displacement = (iter.position - home) & mask;
+        assert(displacement <= stats.max_displacement);
+        // An item next to another is at most one further from home, or it would have displaced it
+        assert(0 == count || last_position + 1 != iter.position || displacement <= last_displacement + 1);
+        last_position = iter.position;
+        last_displacement = displacement;
+        ++count;
+    }
+    assert(sm_size(map) == count);
+    (void)last_position;
+    (void)last_displacement;
+    (void)count;
+}
+
+static void test_robinhood(char** keys, const uint32_t* values)
+{
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(char*);
+    desc.value_size = sizeof(uint32_t);
+    desc.flags = SM_FLAG_ROBINHOOD;
+    desc.max_load = 0.9f;
+    desc.key_constructor = key_constructor;
+    desc.key_move = key_move;
+    desc.key_destructor = key_destructor;
+    desc.value_constructor = value_constructor;
+    desc.value_move = value_move;
+    desc.value_destructor = value_destructor;
+    desc.hasher = hasher;
+    desc.compare = compare;
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    bool result = sm_reserve(map, SAMPLE_NUM/2);
+    assert(result);
+    // Fill up to the threshold of 0.9, which does not expand
+    sm_statistics stats;
+    sm_stats(map, &stats);
+    uint64_t capacity = stats.capacity;
+    uint32_t count = (uint32_t)(capacity * 0.9f);
+    assert(count <= SAMPLE_NUM);
+    for(uint32_t i=0; i<count; ++i){
+        result = sm_add(map, keys[i], &values[i]);
+        assert(result);
+    }
+    sm_stats(map, &stats);
+    assert(capacity == stats.capacity);
+    assert(0.85f < stats.load_factor);
+    check_robinhood_order(map);
+
+    // Removal shifts later items back, leaving neither tombstones nor holes in runs
+    for(uint32_t i=0; i<count; i+=3){
+        sm_remove(map, keys[i]);
+    }
+    sm_stats(map, &stats);
+    assert(0 == stats.deleted);
+    check_robinhood_order(map);
+    for(uint32_t i=0; i<count; ++i){
+        uint32_t value;
+        result = sm_try_get(map, keys[i], &value);
+        assert(result == (0 != (i%3)));
+        assert(!result || value == values[i]);
+    }
+    sm_destruct(map);
+
+    // Keys sharing a home grow the maximum distance by one each, up to the limit of a byte
+    desc.hasher = constant_hasher;
+    map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    uint32_t added = 0;
+    while(added < SAMPLE_NUM && sm_add(map, keys[added], &values[added])){
+        sm_stats(map, &stats);
+        assert(added == stats.max_displacement);
+        ++added;
+    }
+    assert(added < SAMPLE_NUM);
+    assert(added == sm_size(map));
+    check_robinhood_order(map);
+    for(uint32_t i=0; i<added; ++i){
+        uint32_t value;
+        result = sm_try_get(map, keys[i], &value);
+        assert(result);
+        assert(value == values[i]);
+    }
+    result = sm_add(map, keys[added], &values[added]);
+    assert(!result);
+    uint32_t built = sm_build(map, (const void* const*)&keys[added], &values[added], 1);
+    assert(0 == built);
+    assert(SM_INVALID == sm_find(map, keys[added]));
+
+    // Removing from the cluster shifts the rest back, and the freed distance can be used again
+    sm_remove(map, keys[0]);
+    result = sm_add(map, keys[added], &values[added]);
+    assert(result);
+    assert(added == sm_size(map));
+    check_robinhood_order(map);
+    (void)result;
+    (void)capacity;
+    (void)built;
+    sm_destruct(map);
+}
+
+static void test_iter(char** keys, const uint32_t* values, uint32_t flags)
+{
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(char*);
+    desc.value_size = sizeof(uint32_t);
+    desc.flags = flags;
+    desc.migrate_slots = 1;
+    desc.key_constructor = key_constructor;
+    desc.key_move = key_move;
+    desc.key_destructor = key_destructor;
+    desc.value_constructor = value_constructor;
+    desc.value_move = value_move;
+    desc.value_destructor = value_destructor;
+    desc.hasher = hasher;
+    desc.compare = compare;
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    sm_iter iter;
+    sm_iter_begin(map, &iter);
+    assert(!sm_iter_next(map, &iter));
+    // Removals come before the last adds, so the last migration is not done yet in incremental mode
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        bool result = sm_add(map, keys[i], &values[i]);
+        assert(result);
+        (void)result;
+        if(i == SAMPLE_NUM/2){
+            for(uint32_t j=0; j<i; j+=3){
+                sm_remove(map, keys[j]);
+            }
+        }
+    }
+    uint64_t size = sm_size(map);
+    uint64_t total = 0;
+    uint64_t last = 0;
+    sm_iter_begin(map, &iter);
+    while(sm_iter_next(map, &iter)){
+        // Items come in slot order unless dense, and each value is the index in the name of its key
+        char buffer[64] = {0};
+        sprintf(buffer, "key_%010d", *(const uint32_t*)iter.value);
+        assert(0 == strcmp(buffer, *(char* const*)iter.key));
+        assert(0 == total || last < iter.position || 0 != (flags & SM_FLAG_DENSE));
+        last = iter.position;
+        ++total;
+    }
+    (void)last;
+    assert(size == total);
+    assert(!sm_iter_next(map, &iter));
+
+    // Disjoint ranges of uneven lengths cover every item once, in both buffers while migrating
+    uint64_t slots = sm_slot_count(map);
+    sm_statistics stats;
+    sm_stats(map, &stats);
+    assert(0 == (flags & SM_FLAG_INCREMENTAL) || stats.capacity < slots);
+    uint64_t bounds[] = {0, 1, 7, slots/3, slots/2 + 5, slots - 1, slots + 100};
+    total = 0;
+    for(uint32_t i=0; i+1<sizeof(bounds)/sizeof(bounds[0]); ++i){
+        sm_iter_range(map, &iter, bounds[i], bounds[i+1]);
+        while(sm_iter_next(map, &iter)){
+            assert((bounds[i] <= iter.position && iter.position < bounds[i+1]) || 0 != (flags & SM_FLAG_DENSE));
+            ++total;
+        }
+    }
+    assert(size == total);
+    uint32_t count = 0;
+    bool result = sm_for_each(map, count_item, &count);
+    assert(result);
+    assert(size == count);
+    (void)result;
+    (void)size;
+    (void)count;
+    sm_destruct(map);
+}
+
+static void test_dense(char** keys, const uint32_t* values)
+{
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = sizeof(char*);
+    desc.value_size = sizeof(uint32_t);
+    desc.flags = SM_FLAG_DENSE;
+    desc.key_constructor = key_constructor;
+    desc.key_move = key_move;
+    desc.key_destructor = key_destructor;
+    desc.value_constructor = value_constructor;
+    desc.value_move = value_move;
+    desc.value_destructor = value_destructor;
+    desc.hasher = hasher;
+    desc.compare = compare;
+    smallmap* map = sm_construct_desc(&desc);
+    assert(NULL != map);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        bool result = sm_add(map, keys[i], &values[i]);
+        assert(result);
+        (void)result;
+    }
+    // Items come in insertion order
+    sm_iter iter;
+    sm_iter_begin(map, &iter);
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        bool result = sm_iter_next(map, &iter);
+        assert(result);
+        assert(values[i] == *(const uint32_t*)iter.value);
+        assert(iter.position == sm_find64(map, keys[i]));
+        (void)result;
+    }
+    assert(!sm_iter_next(map, &iter));
+
+    // A removal moves the last item into its place
+    sm_remove(map, keys[0]);
+    sm_iter_begin(map, &iter);
+    bool result = sm_iter_next(map, &iter);
+    assert(result);
+    assert(values[SAMPLE_NUM-1] == *(const uint32_t*)iter.value);
+    for(uint32_t i=3; i<SAMPLE_NUM; i+=3){
+        sm_remove(map, keys[i]);
+    }
+    uint64_t count = 0;
+    sm_iter_begin(map, &iter);
+    while(sm_iter_next(map, &iter)){
+        const char* key = *(char* const*)iter.key;
+        assert(iter.position == sm_find64(map, key));
+        (void)key;
+        ++count;
+    }
+    assert(count == sm_size(map));
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        uint32_t value;
+        result = sm_try_get(map, keys[i], &value);
+        assert(result == (0 != (i%3)));
+        assert(!result || value == values[i]);
+    }
+
+    // Keys and values take only as many slots as the load allows
+    sm_statistics stats;
+    sm_stats(map, &stats);
+    assert(stats.value_bytes < stats.capacity * sizeof(uint32_t));
+    (void)result;
+    (void)count;
+    sm_destruct(map);
+}
+
+static void test_tshash_state(char** keys)
+{
+    // A composite key hashed in fragments has the hash of its concatenation
+    char buffer[256];
+    for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+        const char* fragments[3] = {keys[i], "/tenant/path/which/is/longer/than/a/block/of/forty/eight/bytes/", keys[(i+1)%SAMPLE_NUM]};
+        size_t sizes[3] = {strlen(fragments[0]), (size_t)(i%65), strlen(fragments[2])};
+        size_t total = 0;
+        tshash_state state;
+        tshash_init(&state, TSHASH_DEFUALT_SEED);
+        for(uint32_t j=0; j<3; ++j){
+            tshash_update(&state, sizes[j], fragments[j]);
+            memcpy(buffer+total, fragments[j], sizes[j]);
+            total += sizes[j];
+        }
+        assert(tshash64_final(&state) == tshash64(total, buffer, TSHASH_DEFUALT_SEED));
+        assert(tshash32_final(&state) == tshash32(total, buffer, TSHASH_DEFUALT_SEED));
+        for(size_t j=0; j<=total && j<20; ++j){
+            tshash_init(&state, i);
+            tshash_update(&state, j, buffer);
+            tshash_update(&state, total-j, buffer+j);
+            assert(tshash64_final(&state) == tshash64(total, buffer, i));
+        }
+    }
+}
+
 int main(void)
 {
     pcg32_srand(12345);
@@ -177,6 +1773,20 @@ int main(void)
         assert(result);
         assert(value == values[i]);
     }
+    {
+        uint32_t positions[SAMPLE_NUM];
+        uint32_t batch_values[SAMPLE_NUM];
+        bool found[SAMPLE_NUM];
+        sm_find_batch(map, (const void* const*)keys, SAMPLE_NUM, positions);
+        uint32_t count = sm_try_get_batch(map, (const void* const*)keys, SAMPLE_NUM, batch_values, found);
+        assert(SAMPLE_NUM == count);
+        for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+            assert(positions[i] == sm_find(map, keys[i]));
+            assert(found[i]);
+            assert(batch_values[i] == values[i]);
+        }
+        (void)count;
+    }
     for(uint32_t i=0; i<SAMPLE_NUM; ++i){
         sm_remove(map, keys[i]);
     }
@@ -184,9 +1794,75 @@ int main(void)
         uint32_t index = sm_find(map, keys[i]);
         assert(index == SM_INVALID);
     }
+    {
+        // The second build skips the first half, which is already added
+        bool reserved = sm_reserve(map, SAMPLE_NUM);
+        assert(reserved);
+        uint32_t added = sm_build(map, (const void* const*)keys, values, SAMPLE_NUM/2);
+        assert(SAMPLE_NUM/2 == added);
+        added = sm_build(map, (const void* const*)keys, values, SAMPLE_NUM);
+        assert(SAMPLE_NUM - SAMPLE_NUM/2 == added);
+        for(uint32_t i=0; i<SAMPLE_NUM; ++i){
+            uint32_t value;
+            bool result = sm_try_get(map, keys[i], &value);
+            assert(result);
+            assert(value == values[i]);
+            (void)result;
+        }
+        (void)reserved;
+        (void)added;
+    }
     sm_destruct(map);
     map = NULL;
 
+    test_typed(values);
+    test_incremental(keys, values);
+    test_concurrent(keys, values);
+    test_concurrent_threads(keys, values);
+#ifdef SM_STATS_COUNTERS
+    test_counters_threads(keys, values);
+#endif
+    test_sharded(keys, values);
+    test_snapshot(keys, values, 0);
+    test_snapshot(keys, values, SM_FLAG_ROBINHOOD);
+    test_snapshot(keys, values, SM_FLAG_DENSE);
+    test_string(keys, values, 0);
+    test_string(keys, values, SM_FLAG_DENSE);
+    test_allocator(keys, values, 0);
+    test_allocator(keys, values, SM_FLAG_INCREMENTAL);
+    test_allocator(keys, values, SM_FLAG_ROBINHOOD);
+    test_shrink(keys, values, 0);
+    test_shrink(keys, values, SM_FLAG_ROBINHOOD);
+    test_shrink(keys, values, SM_FLAG_INCREMENTAL);
+    test_shrink(keys, values, SM_FLAG_DENSE);
+    test_upsert(keys, 0);
+    test_upsert(keys, SM_FLAG_ROBINHOOD);
+    test_upsert(keys, SM_FLAG_INCREMENTAL);
+    test_upsert(keys, SM_FLAG_DENSE);
+    test_trivial(values, 0);
+    test_trivial(values, SM_FLAG_ROBINHOOD);
+    test_trivial(values, SM_FLAG_INCREMENTAL);
+    test_trivial(values, SM_FLAG_DENSE);
+    test_large_homes();
+    test_shrink_robinhood(0.0f);
+    test_shrink_robinhood(0.2f);
+    test_rehash_tasks();
+    test_hashed(keys, values);
+    test_wide(keys, values, 0);
+    test_wide(keys, values, SM_FLAG_ROBINHOOD);
+    test_wide(keys, values, SM_FLAG_INCREMENTAL);
+    test_wide(keys, values, SM_FLAG_STRING);
+    test_tshash_state(keys);
+    test_iter(keys, values, 0);
+    test_iter(keys, values, SM_FLAG_ROBINHOOD);
+    test_iter(keys, values, SM_FLAG_INCREMENTAL);
+    test_iter(keys, values, SM_FLAG_DENSE);
+    test_dense(keys, values);
+    test_stats(keys, values, 0);
+    test_stats(keys, values, SM_FLAG_ROBINHOOD);
+    test_stats(keys, values, SM_FLAG_INCREMENTAL);
+    test_robinhood(keys, values);
+
     for(uint32_t i=0; i<SAMPLE_NUM; ++i){
         free(keys[i]);
     }
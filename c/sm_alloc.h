@@ -0,0 +1,66 @@
+#ifndef INC_SM_ALLOC_H_
+#define INC_SM_ALLOC_H_
+/**
+ * Allocator plumbing shared by smallmap.c and smallmap_sharded.c.
+ * The legacy allocate/deallocate pair of sm_desc is adapted to sm_allocator, so that the maps call a single interface.
+ */
+#include "smallmap.h"
+#include <assert.h>
+
+#define SM_ALLOC_ALIGN (16U) //!< alignment of small blocks, the same as SM_ALIGN
+#define SM_BUFFER_ALIGN (64U) //!< alignment of table buffers, so that a group starts on a cache line as often as it can
+
+/**
+ * @struct sm_legacy_allocator
+ * @brief the allocate/deallocate pair of sm_desc, the context of an adapted allocator
+ */
+typedef struct sm_legacy_allocator_t
+{
+    void* (*allocate)(size_t);
+    void (*deallocate)(void*);
+} sm_legacy_allocator;
+
+/**
+ * @brief alloc of an adapted allocator, which has malloc's alignment whatever align is
+ */
+static inline void* sm_legacy_alloc(void* ctx, size_t size, size_t align)
+{
+    (void)align;
+    return ((const sm_legacy_allocator*)ctx)->allocate(size);
+}
+
+static inline void sm_legacy_dealloc(void* ctx, void* ptr, size_t size)
+{
+    (void)size;
+    ((const sm_legacy_allocator*)ctx)->deallocate(ptr);
+}
+
+/**
+ * @brief pick the allocator of a desc, the allocate/deallocate pair is adapted with legacy as the context
+ * @details legacy must outlive the allocator, an owner copies legacy into itself and calls sm_allocator_rebind
+ */
+static inline sm_allocator sm_allocator_resolve(const sm_desc* desc, sm_legacy_allocator* legacy)
+{
+    if(NULL != desc->allocator.alloc) {
+        assert(NULL != desc->allocator.dealloc);
+        return desc->allocator;
+    }
+    legacy->allocate = (NULL != desc->allocate) ? desc->allocate : malloc;
+    legacy->deallocate = (NULL != desc->deallocate) ? desc->deallocate : free;
+    sm_allocator allocator;
+    allocator.ctx = legacy;
+    allocator.alloc = sm_legacy_alloc;
+    allocator.dealloc = sm_legacy_dealloc;
+    return allocator;
+}
+
+/**
+ * @brief point an adapted allocator to the copy of its legacy pair
+ */
+static inline void sm_allocator_rebind(sm_allocator* allocator, sm_legacy_allocator* legacy)
+{
+    if(sm_legacy_alloc == allocator->alloc) {
+        allocator->ctx = legacy;
+    }
+}
+#endif //INC_SM_ALLOC_H_
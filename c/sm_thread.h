@@ -0,0 +1,326 @@
+#ifndef INC_SM_THREAD_H_
+#define INC_SM_THREAD_H_
+/**
+ * Minimal atomics, locks and threads for the concurrent parts of smallmap.
+ * On POSIX systems, define _POSIX_C_SOURCE (200809L) before any include, so that rwlocks and sysconf are declared in C99.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#    ifndef WIN32_LEAN_AND_MEAN
+#        define WIN32_LEAN_AND_MEAN
+#    endif
+#    include <windows.h>
+#    include <intrin.h>
+typedef SRWLOCK sm_mutex;
+typedef SRWLOCK sm_rwlock;
+typedef HANDLE sm_thread;
+#else
+#    include <pthread.h>
+#    include <unistd.h>
+typedef pthread_mutex_t sm_mutex;
+typedef pthread_rwlock_t sm_rwlock;
+typedef pthread_t sm_thread;
+#endif
+
+#define SM_CACHELINE (64U) //!< padding to keep independently written data on separate lines
+
+#ifdef _MSC_VER
+#    define SM_THREAD_LOCAL __declspec(thread)
+#else
+#    define SM_THREAD_LOCAL __thread
+#endif
+
+/**
+ * Atomics
+ * Loads acquire and stores release, read-modify-writes and pointer loads are sequentially consistent.
+ * A fence orders earlier stores before later loads, which acquire and release do not.
+ */
+#ifdef _MSC_VER
+static inline uint8_t sm_atomic_load_u8(const uint8_t* ptr)
+{
+    uint8_t value = *(const volatile uint8_t*)ptr;
+    _ReadWriteBarrier();
+    return value;
+}
+
+static inline void sm_atomic_store_u8(uint8_t* ptr, uint8_t value)
+{
+    _ReadWriteBarrier();
+    *(volatile uint8_t*)ptr = value;
+}
+
+static inline bool sm_atomic_cas_u8(uint8_t* ptr, uint8_t expected, uint8_t desired)
+{
+    return (char)expected == _InterlockedCompareExchange8((volatile char*)ptr, (char)desired, (char)expected);
+}
+
+static inline uint64_t sm_atomic_add_u64(uint64_t* ptr, uint64_t value)
+{
+    return (uint64_t)_InterlockedExchangeAdd64((volatile __int64*)ptr, (__int64)value);
+}
+
+static inline void sm_atomic_add_relaxed_u64(uint64_t* ptr, uint64_t value)
+{
+    _InterlockedExchangeAdd64((volatile __int64*)ptr, (__int64)value);
+}
+
+static inline uint64_t sm_atomic_load_u64(const uint64_t* ptr)
+{
+    uint64_t value = *(const volatile uint64_t*)ptr;
+    _ReadWriteBarrier();
+    return value;
+}
+
+static inline void* sm_atomic_load_ptr(void* const* ptr)
+{
+    void* value = *(void* const volatile*)ptr;
+    _ReadWriteBarrier();
+    return value;
+}
+
+static inline void sm_atomic_store_ptr(void** ptr, void* value)
+{
+    _ReadWriteBarrier();
+    *(void* volatile*)ptr = value;
+}
+
+static inline void sm_atomic_fence(void)
+{
+    MemoryBarrier();
+}
+#else
+static inline uint8_t sm_atomic_load_u8(const uint8_t* ptr)
+{
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void sm_atomic_store_u8(uint8_t* ptr, uint8_t value)
+{
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+static inline bool sm_atomic_cas_u8(uint8_t* ptr, uint8_t expected, uint8_t desired)
+{
+    return __atomic_compare_exchange_n(ptr, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t sm_atomic_add_u64(uint64_t* ptr, uint64_t value)
+{
+    return __atomic_fetch_add(ptr, value, __ATOMIC_SEQ_CST);
+}
+
+static inline void sm_atomic_add_relaxed_u64(uint64_t* ptr, uint64_t value)
+{
+    __atomic_fetch_add(ptr, value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t sm_atomic_load_u64(const uint64_t* ptr)
+{
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void* sm_atomic_load_ptr(void* const* ptr)
+{
+    return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+}
+
+static inline void sm_atomic_store_ptr(void** ptr, void* value)
+{
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+static inline void sm_atomic_fence(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+#endif
+
+/**
+ * Locks
+ */
+#ifdef _WIN32
+static inline void sm_mutex_init(sm_mutex* mutex)
+{
+    InitializeSRWLock(mutex);
+}
+
+static inline void sm_mutex_term(sm_mutex* mutex)
+{
+    (void)mutex;
+}
+
+static inline void sm_mutex_lock(sm_mutex* mutex)
+{
+    AcquireSRWLockExclusive(mutex);
+}
+
+static inline void sm_mutex_unlock(sm_mutex* mutex)
+{
+    ReleaseSRWLockExclusive(mutex);
+}
+
+static inline void sm_rwlock_init(sm_rwlock* lock)
+{
+    InitializeSRWLock(lock);
+}
+
+static inline void sm_rwlock_term(sm_rwlock* lock)
+{
+    (void)lock;
+}
+
+static inline void sm_rwlock_lock_shared(sm_rwlock* lock)
+{
+    AcquireSRWLockShared(lock);
+}
+
+static inline void sm_rwlock_unlock_shared(sm_rwlock* lock)
+{
+    ReleaseSRWLockShared(lock);
+}
+
+static inline void sm_rwlock_lock(sm_rwlock* lock)
+{
+    AcquireSRWLockExclusive(lock);
+}
+
+static inline void sm_rwlock_unlock(sm_rwlock* lock)
+{
+    ReleaseSRWLockExclusive(lock);
+}
+#else
+static inline void sm_mutex_init(sm_mutex* mutex)
+{
+    pthread_mutex_init(mutex, NULL);
+}
+
+static inline void sm_mutex_term(sm_mutex* mutex)
+{
+    pthread_mutex_destroy(mutex);
+}
+
+static inline void sm_mutex_lock(sm_mutex* mutex)
+{
+    pthread_mutex_lock(mutex);
+}
+
+static inline void sm_mutex_unlock(sm_mutex* mutex)
+{
+    pthread_mutex_unlock(mutex);
+}
+
+static inline void sm_rwlock_init(sm_rwlock* lock)
+{
+    pthread_rwlock_init(lock, NULL);
+}
+
+static inline void sm_rwlock_term(sm_rwlock* lock)
+{
+    pthread_rwlock_destroy(lock);
+}
+
+static inline void sm_rwlock_lock_shared(sm_rwlock* lock)
+{
+    pthread_rwlock_rdlock(lock);
+}
+
+static inline void sm_rwlock_unlock_shared(sm_rwlock* lock)
+{
+    pthread_rwlock_unlock(lock);
+}
+
+static inline void sm_rwlock_lock(sm_rwlock* lock)
+{
+    pthread_rwlock_wrlock(lock);
+}
+
+static inline void sm_rwlock_unlock(sm_rwlock* lock)
+{
+    pthread_rwlock_unlock(lock);
+}
+#endif
+
+/**
+ * Threads
+ */
+typedef void (*sm_thread_proc)(void*);
+
+/**
+ * @brief a procedure and its argument handed to a new thread
+ */
+typedef struct sm_thread_start_t
+{
+    sm_thread_proc proc;
+    void* arg;
+} sm_thread_start;
+
+#ifdef _WIN32
+static inline DWORD WINAPI sm_thread_entry(LPVOID param)
+#else
+static inline void* sm_thread_entry(void* param)
+#endif
+{
+    sm_thread_start start = *(sm_thread_start*)param;
+    free(param);
+    start.proc(start.arg);
+    return 0;
+}
+
+/**
+ * @brief start a thread which calls proc(arg)
+ * @return false if cannot start
+ */
+static inline bool sm_thread_create(sm_thread* thread, sm_thread_proc proc, void* arg)
+{
+    sm_thread_start* start = (sm_thread_start*)malloc(sizeof(sm_thread_start));
+    if(NULL == start) {
+        return false;
+    }
+    start->proc = proc;
+    start->arg = arg;
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, sm_thread_entry, start, 0, NULL);
+    if(NULL == *thread) {
+        free(start);
+        return false;
+    }
+#else
+    if(0 != pthread_create(thread, NULL, sm_thread_entry, start)) {
+        free(start);
+        return false;
+    }
+#endif
+    return true;
+}
+
+/**
+ * @brief wait for a thread to finish
+ */
+static inline void sm_thread_join(sm_thread thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+/**
+ * @brief number of logical processors
+ */
+static inline uint32_t sm_thread_hardware_concurrency()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (uint32_t)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (0 < count) ? (uint32_t)count : 1;
+#endif
+}
+#endif //INC_SM_THREAD_H_
@@ -1,11 +1,83 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS and madvise for huge pages
+#endif
 #include "smallmap.h"
+#include "smallmap_ctrl.h"
+#include "sm_alloc.h"
+#include "sm_thread.h"
+#include "tshash.h"
 #include <assert.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#else
+#include <malloc.h>
+#endif
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
 
-#define SM_HASH_MASK (0x7FFFFFFFUL)
-#define SM_EXIST_FLAG (0x80000000UL)
-#define SM_ALIGN(x) (((x) + 15UL) & ~15UL)
+#define SM_RH_DIST_LIMIT (254U) //!< a Robin Hood insertion adds at most one to the maximum distance, which must fit in a byte
+#define SM_DEFAULT_MAX_LOAD (0.7f)
+#define SM_MIN_CAPACITY (16U) //!< the capacity of a new map, shrinking stops there
+#define SM_BATCH_SIZE (16U) //!< number of keys in flight in a batch lookup
+#define SM_DEFAULT_MIGRATE_SLOTS (64U) //!< slots migrated per operation in incremental mode
+#define SM_REHASH_TASK_MIN_SLOTS (0x1U << 16U) //!< a smaller buffer is not worth splitting into rehash tasks
+#define SM_REHASH_MAX_TASKS (64U)
+#define SM_WIDE_MAX_CAPACITY (0x1ULL << 57U) //!< a 64-bit hash has 57 bits for the home after the tag
+#define SM_STRING_INLINE (8U) //!< bytes of a string key kept in its slot, a shorter string with its terminator is kept whole
+#define SM_STRING_MOVED (0xFFFFFFFFU) //!< length of a string key which has been moved out, its destruction frees nothing
+#define SM_SNAPSHOT_VERSION (2U) //!< 2 spreads 32-bit hashes, so homes in older snapshots do not match
+#define SM_SNAPSHOT_BYTE_ORDER (0x01020304U) //!< written in native order, a reader on the other order sees it reversed
+#define SM_SNAPSHOT_CLONE (32U) //!< control bytes cloned after the end in a snapshot, enough for every group width
+#define SM_SNAPSHOT_CHUNK (0x1U << 16U) //!< bytes of keys or values copied at once while saving
+#define SM_SNAPSHOT_ALIGN(x) (((x) + 63ULL) & ~63ULL) //!< sections start on cache lines
+
+#if defined(_MSC_VER)
+#    define SM_PREFETCH(ptr) _mm_prefetch((const char*)(ptr), _MM_HINT_T0)
+#elif defined(__GNUC__) || defined(__clang__)
+#    define SM_PREFETCH(ptr) __builtin_prefetch(ptr)
+#else
+#    define SM_PREFETCH(ptr) ((void)(ptr))
+#endif
+
+#ifdef SM_STATS_COUNTERS
+// Lookups take a const map, the counters are the only state which they write, atomically since readers can run at once
+#    define SM_COUNT(map, field, n) sm_atomic_add_relaxed_u64(&((smallmap*)(map))->counters_.field, (n))
+#else
+#    define SM_COUNT(map, field, n) ((void)0)
+#endif
+
+/**
+ * @struct sm_string_key
+ * @brief a stored key in string mode
+ */
+typedef struct sm_string_key_t
+{
+    uint32_t length_; //!< length without the terminator
+    uint32_t offset_; //!< offset of the string with its terminator in the arena, if it is not shorter than SM_STRING_INLINE
+    uint8_t prefix_[SM_STRING_INLINE]; //!< the first bytes, zero padded
+} sm_string_key;
+
+/**
+ * @struct sm_string_query
+ * @brief a key argument in string mode, with its length and prefix computed once
+ */
+typedef struct sm_string_query_t
+{
+    const char* data; //!< the string
+    uint32_t length; //!< length without the terminator
+    uint8_t prefix[SM_STRING_INLINE]; //!< the same as sm_string_key
+} sm_string_query;
 
 /**
  * @struct smallmap
@@ -15,14 +87,56 @@ struct smallmap_t
 {
     uint32_t key_size_; //!< key size in bytes
     uint32_t value_size_; //!< value size in bytes
+    uint32_t flags_; //!< SM_FLAG_*
+    float max_load_; //!< load factor which triggers expanding
+    float min_load_; //!< load factor under which a removal halves the capacity, 0 if never
     uint64_t size_; //!< number of items
+    uint64_t deleted_; //!< number of tombstones
     uint64_t capacity_; //!< maximum number of items
     uint64_t mask_; //!< mask for using instead of division
     uint64_t resize_threshold_; //!< threshold for expanding the buffer
-    uint32_t* hashes_; //!< hash values
+    uint64_t shrink_threshold_; //!< a removal which leaves fewer items halves the buffer
+    uint64_t max_dist_; //!< upper bound of probe distances in Robin Hood mode
+    uint8_t* ctrl_; //!< control bytes, the first SM_GROUP_WIDTH bytes are cloned after the end
+    uint8_t* dist_; //!< probe distance of each item in Robin Hood mode
+    uint8_t* scratch_; //!< two pairs of a key and a value for items in flight in Robin Hood mode
     uint8_t* keys_; //!< buffer for keys
     uint8_t* values_; //!< buffer for values
-    
+    size_t buffer_size_; //!< size of the allocation which holds ctrl_, dist_, keys_ and values_, or ctrl_ and index_ in dense mode
+    uint32_t* index_; //!< entry of each slot in dense mode, keys_ and values_ are NULL
+    uint8_t* entry_keys_; //!< keys in dense mode, packed in insertion order
+    uint8_t* entry_values_; //!< values in dense mode, in the same order
+    uint32_t* entry_slots_; //!< slot of each entry in dense mode, so that the index follows an entry which moves
+    uint64_t entry_capacity_; //!< number of entries which fit in the entry buffer
+    size_t entry_buffer_size_; //!< size of the allocation which holds entry_keys_, entry_values_ and entry_slots_
+
+    uint32_t migrate_slots_; //!< slots migrated per operation in incremental mode
+    uint64_t old_size_; //!< number of items left in the previous buffer
+    uint64_t old_capacity_; //!< capacity of the previous buffer
+    uint64_t migrate_pos_; //!< next slot to migrate in the previous buffer
+    uint8_t* old_ctrl_; //!< control bytes of the previous buffer while migrating, NULL otherwise
+    uint8_t* old_keys_; //!< keys of the previous buffer
+    uint8_t* old_values_; //!< values of the previous buffer
+    size_t old_buffer_size_; //!< size of the allocation which holds the previous buffer
+
+    uint32_t rehash_tasks_; //!< number of tasks which rehashing a large buffer is split into
+    void (*rehash_spawn_)(void*, void (*)(void*, uint32_t), void*, uint32_t);
+    void* rehash_user_;
+
+    uint8_t* arena_; //!< string bytes in string mode
+    uint64_t arena_size_; //!< used bytes of the arena
+    uint64_t arena_capacity_; //!< allocated bytes of the arena
+    uint64_t arena_garbage_; //!< bytes of removed strings, reclaimed by rehashing
+
+    void* mapping_; //!< mapped snapshot which holds the buffers of a read-only map, NULL otherwise
+    size_t mapping_size_; //!< size of the mapped snapshot
+
+    uint64_t resizes_; //!< number of buffers allocated by sm_rehash
+    uint64_t resize_ns_; //!< time spent in sm_rehash in nanoseconds
+#ifdef SM_STATS_COUNTERS
+    sm_counters counters_;
+#endif
+
     bool (*key_constructor_)(struct smallmap_t*, void*, const void*);
     void (*key_move_)(struct smallmap_t*, void*, const void*);
     void (*key_destructor_)(struct smallmap_t*, void*);
@@ -32,262 +146,2677 @@ struct smallmap_t
     void (*value_destructor_)(struct smallmap_t*, void*);
 
     uint32_t (*hasher_)(const void*);
+    uint64_t (*hasher64_)(const void*); //!< hasher in wide mode
     bool (*compare_)(const void*, const void*);
 
-    void* (*allocate_)(size_t);
-    void (*deallocate_)(void*);
+    sm_allocator allocator_;
+    sm_legacy_allocator legacy_; //!< context of allocator_ if it is adapted from allocate and deallocate
+    size_t alloc_size_; //!< size of the allocation which holds this context
 };
 
+static inline void* sm_alloc(const smallmap* map, size_t size, size_t align)
+{
+    return map->allocator_.alloc(map->allocator_.ctx, size, align);
+}
+
+static inline void sm_dealloc(const smallmap* map, void* ptr, size_t size)
+{
+    if(NULL != ptr) {
+        map->allocator_.dealloc(map->allocator_.ctx, ptr, size);
+    }
+}
+
+static inline bool sm_is_robinhood(const smallmap* map)
+{
+    return 0 != (map->flags_ & SM_FLAG_ROBINHOOD);
+}
+
+static inline bool sm_is_dense(const smallmap* map)
+{
+    return 0 != (map->flags_ & SM_FLAG_DENSE);
+}
+
+static inline uint8_t* sm_entry_key(const smallmap* map, uint64_t entry)
+{
+    return map->entry_keys_ + entry * map->key_size_;
+}
+
+static inline uint8_t* sm_entry_value(const smallmap* map, uint64_t entry)
+{
+    return map->entry_values_ + entry * map->value_size_;
+}
+
 /**
- * @brief find an item by the calculated hash
+ * @brief key of a full slot in the current buffer, through the index in dense mode
  */
-static uint32_t sm_find_(const smallmap* map, uint32_t hash, const void* key)
+static inline uint8_t* sm_key_at(const smallmap* map, uint64_t pos)
 {
-    uint32_t start = hash & map->mask_;
-    hash |= SM_EXIST_FLAG;
-    uint32_t pos = start;
-    do {
-        if(map->hashes_[pos] == hash && map->compare_(&map->keys_[pos * map->key_size_], &key)) {
-            return pos;
-        }
-        pos = (pos + 1) & map->mask_;
-    } while(pos != start);
-    return SM_INVALID;
+    if(sm_is_dense(map)) {
+        return sm_entry_key(map, map->index_[pos]);
+    }
+    return map->keys_ + pos * map->key_size_;
+}
+
+static inline uint8_t* sm_value_at(const smallmap* map, uint64_t pos)
+{
+    if(sm_is_dense(map)) {
+        return sm_entry_value(map, map->index_[pos]);
+    }
+    return map->values_ + pos * map->value_size_;
 }
 
 /**
- * @brief add an item by the calculated hash
+ * @brief make a free slot refer to a new entry after the last one, which the caller counts in size_
  */
-static bool sm_add_item(smallmap* map, uint32_t hash, const uint8_t* src_key, const uint8_t* src_value)
-{
-    uint32_t start = hash & map->mask_;
-    uint32_t pos = start;
-    do {
-        if(SM_EXIST_FLAG != (SM_EXIST_FLAG & map->hashes_[pos])) {
-            map->hashes_[pos] = hash | SM_EXIST_FLAG;
-            uint8_t* key = &map->keys_[pos * map->key_size_];
-            uint8_t* value = &map->values_[pos * map->value_size_];
-            if(!map->key_constructor_(map, key, src_key)) {
-                return false;
-            }
-            if(!map->value_constructor_(map, value, src_value)) {
-                return false;
-            }
-            return true;
-        }
-        pos = (pos + 1) & map->mask_;
-    } while(pos != start);
-    return false;
+static inline void sm_dense_append(smallmap* map, uint64_t pos)
+{
+    assert(map->size_ < map->entry_capacity_);
+    map->index_[pos] = (uint32_t)map->size_;
+    map->entry_slots_[map->size_] = (uint32_t)pos;
+}
+
+static inline bool sm_is_incremental(const smallmap* map)
+{
+    return 0 != (map->flags_ & SM_FLAG_INCREMENTAL);
+}
+
+static inline bool sm_is_wide(const smallmap* map)
+{
+    return 0 != (map->flags_ & SM_FLAG_WIDE);
 }
 
 /**
- * @brief move value of an item
+ * @brief number of slots which a map cannot reach
+ * @details in the default mode, positions including those offset into the previous buffer must stay below SM_INVALID
  */
-static void sm_move_item(smallmap* map, uint32_t hash, const uint8_t* src_key, const uint8_t* src_value)
+static inline uint64_t sm_capacity_limit(const smallmap* map)
 {
-    uint32_t start = hash & map->mask_;
-    uint32_t pos = start;
-    do {
-        if(SM_EXIST_FLAG != (SM_EXIST_FLAG & map->hashes_[pos])) {
-            map->hashes_[pos] = hash | SM_EXIST_FLAG;
-            uint8_t* key = &map->keys_[pos * map->key_size_];
-            uint8_t* value = &map->values_[pos * map->value_size_];
-            map->key_move_(map, key, src_key);
-            map->value_move_(map, value, src_value);
-            return;
-        }
-        pos = (pos + 1) & map->mask_;
-    } while(pos != start);
+    return sm_is_wide(map) ? SM_WIDE_MAX_CAPACITY : SM_INVALID;
+}
+
+static inline bool sm_is_string(const smallmap* map)
+{
+    return 0 != (map->flags_ & SM_FLAG_STRING);
 }
 
 /**
- * @brief expand the capacity of a map
+ * @brief bytes of a stored string key
  */
-static bool sm_expand(smallmap* map)
+static inline const char* sm_string_data(const smallmap* map, const sm_string_key* key)
 {
-    uint64_t next_capacity = (map->capacity_ <= 0) ? 16 : map->capacity_ << 1;
-    if(SM_INVALID <= next_capacity) {
-        return false;
+    if(key->length_ < SM_STRING_INLINE) {
+        return (const char*)key->prefix_;
     }
-    size_t hash_size = SM_ALIGN(next_capacity * sizeof(uint32_t));
-    size_t key_size = SM_ALIGN(next_capacity * map->key_size_);
-    size_t value_size = SM_ALIGN(next_capacity * map->value_size_);
-    size_t total_size = hash_size + key_size + value_size;
-    uint8_t* buffer = (uint8_t*)map->allocate_(total_size);
-    if(NULL == buffer) {
-        return false;
+    return (const char*)map->arena_ + key->offset_;
+}
+
+static inline void sm_string_query_set(sm_string_query* query, const char* data, uint32_t length)
+{
+    query->data = data;
+    query->length = length;
+    memset(query->prefix, 0, SM_STRING_INLINE);
+    memcpy(query->prefix, data, (length < SM_STRING_INLINE) ? length : SM_STRING_INLINE);
+}
+
+/**
+ * @brief key in the form which lookups compare with stored keys, from the address of a key argument
+ * @details in string mode, a query is made in query. Otherwise, it is the address itself.
+ */
+static inline const void* sm_probe_arg(const smallmap* map, const void* const* key, sm_string_query* query)
+{
+    if(!sm_is_string(map)) {
+        return key;
     }
-    memset(buffer, 0, total_size);
+    const char* str = (const char*)*key;
+    sm_string_query_set(query, str, (uint32_t)strlen(str));
+    return query;
+}
 
-    uint32_t* prev_hashes = map->hashes_;
-    uint8_t* prev_keys = map->keys_;
-    uint8_t* prev_values = map->values_;
-    uint64_t prev_capacity = map->capacity_;
+/**
+ * @brief key in the form which lookups compare with stored keys, from a stored key of map
+ */
+static inline const void* sm_probe_stored(const smallmap* map, const void* key, sm_string_query* query)
+{
+    if(!sm_is_string(map)) {
+        return key;
+    }
+    const sm_string_key* stored = (const sm_string_key*)key;
+    sm_string_query_set(query, sm_string_data(map, stored), stored->length_);
+    return query;
+}
 
-    map->capacity_ = next_capacity;
-    map->mask_ = next_capacity - 1;
-    map->resize_threshold_ = (uint64_t)(next_capacity * 0.7f);
-    map->hashes_ = (uint32_t*)buffer;
-    map->keys_ = buffer + hash_size;
-    map->values_ = buffer + hash_size + key_size;
+/**
+ * @brief source of a key constructor, the key argument itself or its query in string mode
+ * @details without a key constructor, the bytes of the key argument are copied, as the hasher reads them
+ */
+static inline const void* sm_construct_src(const smallmap* map, const void* key, const void* probe)
+{
+    return (sm_is_string(map) || NULL == map->key_constructor_) ? probe : key;
+}
 
-    for(uint32_t i = 0; i < prev_capacity; ++i) {
-        if(SM_EXIST_FLAG != (prev_hashes[i] & SM_EXIST_FLAG)) {
-            continue;
+/**
+ * @brief whether a key argument can be looked up, a null pointer is the key of zero bits when keys are copied from the argument
+ */
+static inline bool sm_valid_key(const smallmap* map, const void* key)
+{
+    return NULL != key || NULL == map->key_constructor_;
+}
+
+/**
+ * @brief hash of a string, with all 64 bits in wide mode
+ */
+static inline uint64_t sm_hash_string(const smallmap* map, const char* data, uint32_t length)
+{
+    if(sm_is_wide(map)) {
+        return tshash64(length, data, TSHASH_DEFUALT_SEED);
+    }
+    return sm_spread32(tshash32(length, data, TSHASH_DEFUALT_SEED));
+}
+
+/**
+ * @brief hash of a probe, a 32-bit hash is spread over 64 bits so that homes cover tables of any size
+ */
+static inline uint64_t sm_hash_probe(const smallmap* map, const void* probe)
+{
+    if(sm_is_string(map)) {
+        const sm_string_query* query = (const sm_string_query*)probe;
+        return sm_hash_string(map, query->data, query->length);
+    }
+    return sm_is_wide(map) ? map->hasher64_(probe) : sm_spread32(map->hasher_(probe));
+}
+
+/**
+ * @brief hash up to SM_BATCH_SIZE probes, strings are hashed together so that their multiplies overlap
+ */
+static void sm_hash_probes(const smallmap* map, const void* const* probes, uint32_t count, uint64_t* hashes)
+{
+    assert(count <= SM_BATCH_SIZE);
+    if(!sm_is_string(map)) {
+        for(uint32_t i = 0; i < count; ++i) {
+            hashes[i] = sm_hash_probe(map, probes[i]);
+        }
+        return;
+    }
+    size_t sizes[SM_BATCH_SIZE];
+    const void* data[SM_BATCH_SIZE];
+    for(uint32_t i = 0; i < count; ++i) {
+        const sm_string_query* query = (const sm_string_query*)probes[i];
+        sizes[i] = query->length;
+        data[i] = query->data;
+    }
+    tshash64_batch(count, sizes, data, hashes, TSHASH_DEFUALT_SEED);
+    if(!sm_is_wide(map)) {
+        // The same folding as tshash32
+        for(uint32_t i = 0; i < count; ++i) {
+            hashes[i] = sm_spread32((uint32_t)((hashes[i] >> 32) ^ (hashes[i] & 0xFFFFFFFFULL)));
         }
-        uint32_t hash = prev_hashes[i] & SM_HASH_MASK;
-        uint8_t* key = &prev_keys[i * map->key_size_];
-        uint8_t* value = &prev_values[i * map->value_size_];
-        sm_move_item(map, hash, key, value);
-        map->key_destructor_(map, key);
-        map->value_destructor_(map, value);
     }
-    map->deallocate_(prev_hashes);
-    return true;
 }
 
-smallmap* sm_construct(
-    uint32_t key_size,
-    uint32_t value_size,
-    bool (*key_constructor)(smallmap*, void*, const void*),
-    void (*key_move)(smallmap*, void*, const void*),
-    void (*key_destructor)(smallmap*, void*),
-    bool (*value_constructor)(smallmap*, void*, const void*),
-    void (*value_move)(smallmap*, void*, const void*),
-    void (*value_destructor)(smallmap*, void*),
-    uint32_t (*hasher)(const void*),
-    bool (*compare)(const void*, const void*),
-    void* (*allocate)(size_t),
-    void (*deallocate)(void*))
+static inline uint64_t sm_hash_stored(const smallmap* map, const void* key)
 {
-    assert(NULL != key_constructor);
-    assert(NULL != key_move);
-    assert(NULL != key_destructor);
-    assert(NULL != value_constructor);
-    assert(NULL != value_move);
-    assert(NULL != value_destructor);
-    assert(NULL != hasher);
-    assert(NULL != compare);
+    if(sm_is_string(map)) {
+        const sm_string_key* stored = (const sm_string_key*)key;
+        return sm_hash_string(map, sm_string_data(map, stored), stored->length_);
+    }
+    return sm_is_wide(map) ? map->hasher64_(key) : sm_spread32(map->hasher_(key));
+}
 
-    if(NULL == allocate) {
-        allocate = malloc;
+/**
+ * @brief compare a stored key with a probe, in string mode the length and prefix are checked before the arena
+ */
+static inline bool sm_key_equal(const smallmap* map, const void* key, const void* probe)
+{
+    SM_COUNT(map, compares, 1);
+    if(sm_is_string(map)) {
+        const sm_string_key* stored = (const sm_string_key*)key;
+        const sm_string_query* query = (const sm_string_query*)probe;
+        if(stored->length_ != query->length || 0 != memcmp(stored->prefix_, query->prefix, SM_STRING_INLINE)) {
+            return false;
+        }
+        return query->length < SM_STRING_INLINE
+               || 0 == memcmp(map->arena_ + stored->offset_ + SM_STRING_INLINE, query->data + SM_STRING_INLINE, query->length - SM_STRING_INLINE);
     }
-    if(NULL == deallocate) {
-        deallocate = free;
+    return map->compare_(key, probe);
+}
+
+/**
+ * @brief make room for size more bytes in the arena, offsets in the arena are 32 bits
+ */
+static bool sm_arena_reserve(smallmap* map, uint64_t size)
+{
+    uint64_t required = map->arena_size_ + size;
+    if(required <= map->arena_capacity_) {
+        return true;
     }
-    smallmap* map = (smallmap*)allocate(sizeof(smallmap));
-    if(NULL == map) {
-        return NULL;
+    if((uint64_t)UINT32_MAX < required) {
+        return false;
     }
-    memset(map, 0, sizeof(smallmap));
-    map->key_size_ = key_size;
-    map->value_size_ = value_size;
-    map->key_constructor_ = key_constructor;
-    map->key_move_ = key_move;
-    map->key_destructor_ = key_destructor;
-    map->value_constructor_ = value_constructor;
-    map->value_move_ = value_move;
-    map->value_destructor_ = value_destructor;
-    map->hasher_ = hasher;
-    map->compare_ = compare;
-    map->allocate_ = allocate;
-    map->deallocate_ = deallocate;
-    if(!sm_expand(map)) {
-        sm_destruct(map);
-        return NULL;
+    uint64_t capacity = (0 < map->arena_capacity_) ? map->arena_capacity_ : 256;
+    while(capacity < required) {
+        capacity <<= 1;
     }
-    return map;
+    uint8_t* arena = (uint8_t*)sm_alloc(map, capacity, SM_ALLOC_ALIGN);
+    if(NULL == arena) {
+        return false;
+    }
+    if(0 < map->arena_size_) {
+        memcpy(arena, map->arena_, map->arena_size_);
+    }
+    sm_dealloc(map, map->arena_, map->arena_capacity_);
+    map->arena_ = arena;
+    map->arena_capacity_ = capacity;
+    return true;
 }
 
-void sm_destruct(smallmap* map)
+/**
+ * @brief copy a string which does not fit in its slot to the arena, the arena has room
+ */
+static void sm_arena_append(smallmap* map, sm_string_key* key, const char* data)
 {
-    if(NULL == map) {
+    assert(SM_STRING_INLINE <= key->length_);
+    assert(map->arena_size_ + key->length_ + 1 <= map->arena_capacity_);
+    key->offset_ = (uint32_t)map->arena_size_;
+    memcpy(map->arena_ + map->arena_size_, data, key->length_ + 1);
+    map->arena_size_ += key->length_ + 1;
+}
+
+/**
+ * @brief copy live strings to a new arena, so that the space of removed ones is reclaimed
+ * @details it runs only when no previous buffer is left, the current arena is kept if cannot allocate
+ */
+static void sm_arena_compact(smallmap* map)
+{
+    if(!sm_is_string(map) || map->arena_garbage_ <= 0 || NULL != map->old_ctrl_) {
         return;
     }
-    for(uint32_t i = 0; i < map->capacity_; ++i) {
-        if(SM_EXIST_FLAG != (SM_EXIST_FLAG & map->hashes_[i])) {
-            continue;
+    uint64_t live = map->arena_size_ - map->arena_garbage_;
+    uint8_t* arena = NULL;
+    if(0 < live) {
+        arena = (uint8_t*)sm_alloc(map, live, SM_ALLOC_ALIGN);
+        if(NULL == arena) {
+            return;
         }
-        map->key_destructor_(map, &map->keys_[i * map->key_size_]);
-        map->value_destructor_(map, &map->values_[i * map->value_size_]);
     }
-    map->deallocate_(map->hashes_);
-    void (*deallocate)(void*) = map->deallocate_;
-    memset(map, 0, sizeof(smallmap));
-    deallocate(map);
+    uint8_t* prev_arena = map->arena_;
+    uint64_t prev_capacity = map->arena_capacity_;
+    map->arena_ = arena;
+    map->arena_size_ = 0;
+    map->arena_capacity_ = live;
+    map->arena_garbage_ = 0;
+    for(uint64_t i = 0; i < map->capacity_; ++i) {
+        sm_string_key* key = (sm_string_key*)sm_key_at(map, i);
+        if(SM_IS_FULL(map->ctrl_[i]) && SM_STRING_INLINE <= key->length_) {
+            sm_arena_append(map, key, (const char*)prev_arena + key->offset_);
+        }
+    }
+    assert(map->arena_size_ == live);
+    sm_dealloc(map, prev_arena, prev_capacity);
 }
 
-void* sm_allocate(smallmap* map, size_t size)
+/**
+ * @brief key constructor in string mode, the source is a query
+ */
+static bool sm_string_construct(smallmap* map, void* dst_key, const void* src_key)
 {
-    assert(NULL != map);
-    return map->allocate_(size);
+    sm_string_key* key = (sm_string_key*)dst_key;
+    const sm_string_query* query = (const sm_string_query*)src_key;
+    key->length_ = query->length;
+    key->offset_ = 0;
+    memcpy(key->prefix_, query->prefix, SM_STRING_INLINE);
+    if(query->length < SM_STRING_INLINE) {
+        return true;
+    }
+    if(!sm_arena_reserve(map, (uint64_t)query->length + 1)) {
+        return false;
+    }
+    sm_arena_append(map, key, query->data);
+    return true;
 }
 
-void sm_deallocate(smallmap* map, void* ptr)
+/**
+ * @brief key move in string mode, the source is marked so that its destruction does not count its bytes
+ */
+static void sm_string_move(smallmap* map, void* dst_key, const void* src_key)
 {
-    assert(NULL != map);
-    map->deallocate_(ptr);
+    (void)map;
+    memcpy(dst_key, src_key, sizeof(sm_string_key));
+    ((sm_string_key*)src_key)->length_ = SM_STRING_MOVED;
 }
 
-uint32_t sm_find(const smallmap* map, const void* key)
+/**
+ * @brief key destructor in string mode, bytes in the arena are left until reclaimed by rehashing
+ */
+static void sm_string_destruct(smallmap* map, void* key)
 {
-    assert(NULL != map);
-    assert(NULL != key);
-    uint32_t hash = map->hasher_(&key) & SM_HASH_MASK;
-    return sm_find_(map, hash, key);
+    uint32_t length = ((sm_string_key*)key)->length_;
+    if(SM_STRING_INLINE <= length && SM_STRING_MOVED != length) {
+        map->arena_garbage_ += (uint64_t)length + 1;
+    }
 }
 
-bool sm_try_get(const smallmap* map, const void* key, void* value)
+/**
+ * @brief a map opened by sm_open_mmap, whose buffers are in a read-only mapping
+ */
+static inline bool sm_is_readonly(const smallmap* map)
 {
-    assert(NULL != map);
-    assert(NULL != key);
-    assert(NULL != value);
-    uint32_t pos = sm_find(map, key);
-    if(SM_INVALID == pos) {
-        return false;
+    return NULL != map->mapping_;
+}
+
+/**
+ * @brief a position for the 32-bit API, whose positions do not reach SM_INVALID unless the map is wide
+ */
+static inline uint32_t sm_narrow_pos(uint64_t pos)
+{
+    if(SM_INVALID64 == pos) {
+        return SM_INVALID;
     }
-    memcpy(value, &map->values_[pos * map->value_size_], map->value_size_);
-    return true;
+    assert(pos < SM_INVALID);
+    return (uint32_t)pos;
 }
 
-bool sm_add(smallmap* map, const void* key, const void* value)
+/**
+ * @brief key of an item at a public position, positions from capacity_ refer to the previous buffer while migrating
+ */
+static inline uint8_t* sm_item_key(const smallmap* map, uint64_t pos)
 {
-    assert(NULL != map);
-    assert(NULL != key);
-    assert(NULL != value);
-    uint32_t hash = map->hasher_(&key) & SM_HASH_MASK;
-    if(SM_INVALID != sm_find_(map, hash, key)) {
-        return false;
+    if(map->capacity_ <= pos) {
+        return map->old_keys_ + (pos - map->capacity_) * map->key_size_;
     }
-    if(map->resize_threshold_ <= map->size_) {
-        sm_expand(map);
+    return sm_key_at(map, pos);
+}
+
+/**
+ * @brief value of an item at a public position, see sm_item_key
+ */
+static inline uint8_t* sm_item_value(const smallmap* map, uint64_t pos)
+{
+    if(map->capacity_ <= pos) {
+        return map->old_values_ + (pos - map->capacity_) * map->value_size_;
     }
-    if(!sm_add_item(map, hash, key, value)) {
-        return false;
+    return sm_value_at(map, pos);
+}
+
+static inline uint8_t* sm_scratch_key(const smallmap* map, uint32_t index)
+{
+    return map->scratch_ + index * (SM_ALIGN(map->key_size_) + SM_ALIGN(map->value_size_));
+}
+
+static inline uint8_t* sm_scratch_value(const smallmap* map, uint32_t index)
+{
+    return sm_scratch_key(map, index) + SM_ALIGN(map->key_size_);
+}
+
+/**
+ * @brief true if keys and values are relocated bitwise and need no destruction, see sm_desc
+ */
+static inline bool sm_is_trivial(const smallmap* map)
+{
+    return NULL == map->key_move_ && NULL == map->value_move_ && NULL == map->key_destructor_ && NULL == map->value_destructor_;
+}
+
+static inline bool sm_construct_key(smallmap* map, uint8_t* dst_key, const void* src_key)
+{
+    if(NULL == map->key_constructor_) {
+        memcpy(dst_key, src_key, map->key_size_);
+        return true;
     }
-    ++map->size_;
-    return true;
+    return map->key_constructor_(map, dst_key, src_key);
 }
 
-void sm_remove_at(smallmap* map, uint32_t pos)
+static inline bool sm_construct_value(smallmap* map, uint8_t* dst_value, const void* src_value)
 {
-    assert(NULL != map);
-    assert(SM_INVALID != pos);
-    map->hashes_[pos] = 0;
-    uint8_t* key = &map->keys_[pos * map->key_size_];
-    uint8_t* value = &map->values_[pos * map->value_size_];
-    map->key_destructor_(map, key);
-    map->value_destructor_(map, value);
-    --map->size_;
+    if(NULL == map->value_constructor_) {
+        memcpy(dst_value, src_value, map->value_size_);
+        return true;
+    }
+    return map->value_constructor_(map, dst_value, src_value);
 }
 
-void sm_remove(smallmap* map, const void* key)
+static inline void sm_destruct_key(smallmap* map, uint8_t* key)
 {
-    assert(NULL != map);
-    assert(NULL != key);
-    uint32_t pos = sm_find(map, key);
-    if(SM_INVALID == pos) {
-        return;
+    if(NULL != map->key_destructor_) {
+        map->key_destructor_(map, key);
+    }
+}
+
+/**
+ * @brief destruct the key and the value of an item
+ */
+static inline void sm_destruct_item(smallmap* map, uint8_t* key, uint8_t* value)
+{
+    sm_destruct_key(map, key);
+    if(NULL != map->value_destructor_) {
+        map->value_destructor_(map, value);
+    }
+}
+
+/**
+ * @brief move an item, then destruct the source
+ * @details without a move callback, the bytes are copied and the source is left as it is
+ */
+static inline void sm_relocate(smallmap* map, uint8_t* dst_key, uint8_t* dst_value, uint8_t* src_key, uint8_t* src_value)
+{
+    if(NULL == map->key_move_) {
+        memcpy(dst_key, src_key, map->key_size_);
+    } else {
+        map->key_move_(map, dst_key, src_key);
+        sm_destruct_key(map, src_key);
     }
-    sm_remove_at(map, pos);
+    if(NULL == map->value_move_) {
+        memcpy(dst_value, src_value, map->value_size_);
+    } else {
+        map->value_move_(map, dst_value, src_value);
+        if(NULL != map->value_destructor_) {
+            map->value_destructor_(map, src_value);
+        }
+    }
+}
+
+static inline void sm_set_ctrl(smallmap* map, uint64_t pos, uint8_t ctrl)
+{
+    sm_ctrl_set(map->ctrl_, map->capacity_, pos, ctrl);
+}
+
+/**
+ * @brief number of slots which a lookup has to check at most
+ */
+static inline uint64_t sm_probe_limit(const smallmap* map)
+{
+    return sm_is_robinhood(map) ? map->max_dist_ + 1 : map->capacity_;
+}
+
+/**
+ * @brief find an item in the previous buffer while migrating
+ * @return position offset by capacity_, SM_INVALID64 if cannot find
+ */
+static uint64_t sm_find_old_(const smallmap* map, uint64_t hash, const void* key)
+{
+    uint8_t tag = SM_H2(hash);
+    uint64_t mask = map->old_capacity_ - 1;
+    uint64_t pos = SM_H1(hash) & mask;
+    for(uint64_t probed = 0; probed < map->old_capacity_; probed += SM_GROUP_WIDTH) {
+        SM_COUNT(map, lookup_groups, 1);
+        bool last;
+        sm_bitmask match = sm_probe_group(&map->old_ctrl_[pos], tag, map->old_capacity_ - probed, &last);
+        while(0 != match) {
+            uint64_t i = (pos + sm_bitmask_lowest(match)) & mask;
+            if(sm_key_equal(map, map->old_keys_ + i * map->key_size_, key)) {
+                return map->capacity_ + i;
+            }
+            match &= match - 1;
+        }
+        if(last) {
+            break;
+        }
+        pos = (pos + SM_GROUP_WIDTH) & mask;
+    }
+    return SM_INVALID64;
+}
+
+/**
+ * @brief find an item by the calculated hash
+ * @details probing stops at the first never-used slot, so a miss costs the length of the cluster.
+ * Candidates are picked by tags a group at a time, then confirmed with compare.
+ * In Robin Hood mode, no item is further than max_dist_ from its home.
+ * While migrating, a miss in the current buffer is looked up in the previous one.
+ * @param [in] key ... address of a key in the same form as passed to hasher, a stored key or the address of a key argument.
+ * In string mode, a query made by sm_probe_arg or sm_probe_stored.
+ */
+static uint64_t sm_find_(const smallmap* map, uint64_t hash, const void* key)
+{
+    SM_COUNT(map, lookups, 1);
+    uint8_t tag = SM_H2(hash);
+    uint64_t pos = SM_H1(hash) & map->mask_;
+    uint64_t limit = sm_probe_limit(map);
+    for(uint64_t probed = 0; probed < limit; probed += SM_GROUP_WIDTH) {
+        SM_COUNT(map, lookup_groups, 1);
+        bool last;
+        sm_bitmask match = sm_probe_group(&map->ctrl_[pos], tag, limit - probed, &last);
+        while(0 != match) {
+            uint64_t i = (pos + sm_bitmask_lowest(match)) & map->mask_;
+            if(sm_key_equal(map, sm_key_at(map, i), key)) {
+                return i;
+            }
+            match &= match - 1;
+        }
+        if(last) {
+            break;
+        }
+        pos = (pos + SM_GROUP_WIDTH) & map->mask_;
+    }
+    if(NULL != map->old_ctrl_) {
+        return sm_find_old_(map, hash, key);
+    }
+    return SM_INVALID64;
+}
+
+/**
+ * @brief find up to SM_BATCH_SIZE items in stages, so that their cache misses overlap
+ * @details the first stage hashes keys and prefetches home groups, the second matches tags and prefetches
+ * the first candidate of each key, and the last confirms candidates.
+ * Probe sequences which continue past the home group fall back to sm_find_.
+ */
+static void sm_find_batch_(const smallmap* map, const void* const* keys, uint32_t count, uint64_t* positions, bool prefetch_values)
+{
+    assert(count <= SM_BATCH_SIZE);
+    uint64_t hashes[SM_BATCH_SIZE];
+    const void* probes[SM_BATCH_SIZE];
+    sm_string_query queries[SM_BATCH_SIZE];
+    sm_bitmask matches[SM_BATCH_SIZE];
+    bool lasts[SM_BATCH_SIZE];
+    uint64_t limit = sm_probe_limit(map);
+    for(uint32_t i = 0; i < count; ++i) {
+        probes[i] = sm_probe_arg(map, &keys[i], &queries[i]);
+    }
+    sm_hash_probes(map, probes, count, hashes);
+    for(uint32_t i = 0; i < count; ++i) {
+        SM_PREFETCH(&map->ctrl_[SM_H1(hashes[i]) & map->mask_]);
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        uint64_t pos = SM_H1(hashes[i]) & map->mask_;
+        matches[i] = sm_probe_group(&map->ctrl_[pos], SM_H2(hashes[i]), limit, &lasts[i]);
+        if(0 != matches[i]) {
+            uint64_t candidate = (pos + sm_bitmask_lowest(matches[i])) & map->mask_;
+            SM_PREFETCH(sm_key_at(map, candidate));
+            if(prefetch_values) {
+                SM_PREFETCH(sm_value_at(map, candidate));
+            }
+        }
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        uint64_t pos = SM_H1(hashes[i]) & map->mask_;
+        uint64_t found = SM_INVALID64;
+        sm_bitmask match = matches[i];
+        while(0 != match) {
+            uint64_t candidate = (pos + sm_bitmask_lowest(match)) & map->mask_;
+            if(sm_key_equal(map, sm_key_at(map, candidate), probes[i])) {
+                found = candidate;
+                break;
+            }
+            match &= match - 1;
+        }
+        if(SM_INVALID64 == found && (!lasts[i] || NULL != map->old_ctrl_)) {
+            found = sm_find_(map, hashes[i], probes[i]);
+        } else {
+            SM_COUNT(map, lookups, 1);
+            SM_COUNT(map, lookup_groups, 1);
+        }
+        positions[i] = found;
+    }
+}
+
+/**
+ * @brief find the first empty or deleted slot for the calculated hash in the current buffer
+ * @details there is always a free slot, because the load is kept under the resize threshold
+ */
+static uint64_t sm_find_free(const smallmap* map, uint64_t hash)
+{
+    uint64_t pos = SM_H1(hash) & map->mask_;
+    for(;;) {
+        sm_bitmask free = sm_group_match_free(&map->ctrl_[pos]);
+        if(0 != free) {
+            return (pos + sm_bitmask_lowest(free)) & map->mask_;
+        }
+        pos = (pos + SM_GROUP_WIDTH) & map->mask_;
+    }
+}
+
+/**
+ * @brief find an item, or the first free slot to add it in default mode
+ * @details a single probe serves both the duplicate check and the insertion.
+ * The load is kept under the resize threshold, so an empty slot always ends the probe.
+ * @param [out] found ... true if the item exists
+ * @return position of the found item, or the free slot
+ */
+static uint64_t sm_find_or_free(const smallmap* map, uint64_t hash, const void* key, bool* found)
+{
+    assert(!sm_is_robinhood(map));
+    uint8_t tag = SM_H2(hash);
+    uint64_t pos = SM_H1(hash) & map->mask_;
+    uint64_t vacant = UINT64_MAX;
+    SM_COUNT(map, lookups, 1);
+    for(uint64_t probed = 0; probed < map->capacity_; probed += SM_GROUP_WIDTH) {
+        SM_COUNT(map, lookup_groups, 1);
+        bool last;
+        sm_bitmask match = sm_probe_group(&map->ctrl_[pos], tag, map->capacity_ - probed, &last);
+        while(0 != match) {
+            uint64_t i = (pos + sm_bitmask_lowest(match)) & map->mask_;
+            if(sm_key_equal(map, sm_key_at(map, i), key)) {
+                *found = true;
+                return i;
+            }
+            match &= match - 1;
+        }
+        if(UINT64_MAX == vacant) {
+            sm_bitmask free = sm_group_match_free(&map->ctrl_[pos]);
+            if(0 != free) {
+                vacant = (pos + sm_bitmask_lowest(free)) & map->mask_;
+            }
+        }
+        if(last) {
+            break;
+        }
+        pos = (pos + SM_GROUP_WIDTH) & map->mask_;
+    }
+    assert(UINT64_MAX != vacant);
+    *found = false;
+    return vacant;
+}
+
+static inline void sm_set_dist(smallmap* map, uint64_t pos, uint64_t dist)
+{
+    assert(dist <= 0xFFU);
+    map->dist_[pos] = (uint8_t)dist;
+    if(map->max_dist_ < dist) {
+        map->max_dist_ = dist;
+    }
+}
+
+/**
+ * @brief place an item in Robin Hood order, starting at pos with the distance
+ * @details an item closer to its home than the carried one is swapped out and carried further.
+ * The carried item is relocated, so its source is left destructed.
+ */
+static void sm_place_robinhood(smallmap* map, uint64_t pos, uint64_t dist, uint8_t tag, uint8_t* key, uint8_t* value)
+{
+    for(;;) {
+        uint8_t* slot_key = sm_key_at(map, pos);
+        uint8_t* slot_value = sm_value_at(map, pos);
+        if(!SM_IS_FULL(map->ctrl_[pos])) {
+            sm_relocate(map, slot_key, slot_value, key, value);
+            sm_set_ctrl(map, pos, tag);
+            sm_set_dist(map, pos, dist);
+            return;
+        }
+        if(map->dist_[pos] < dist) {
+            uint32_t index = (key == sm_scratch_key(map, 0)) ? 1 : 0;
+            uint8_t* tmp_key = sm_scratch_key(map, index);
+            uint8_t* tmp_value = sm_scratch_value(map, index);
+            sm_relocate(map, tmp_key, tmp_value, slot_key, slot_value);
+            sm_relocate(map, slot_key, slot_value, key, value);
+            uint8_t tmp_tag = map->ctrl_[pos];
+            uint64_t tmp_dist = map->dist_[pos];
+            sm_set_ctrl(map, pos, tag);
+            sm_set_dist(map, pos, dist);
+            key = tmp_key;
+            value = tmp_value;
+            tag = tmp_tag;
+            dist = tmp_dist;
+        }
+        pos = (pos + 1) & map->mask_;
+        ++dist;
+    }
+}
+
+/**
+ * @brief add an item by the calculated hash in Robin Hood mode
+ * @return position of the added item, which later placements do not move, SM_INVALID64 if cannot construct
+ */
+static uint64_t sm_add_item_robinhood(smallmap* map, uint64_t hash, const uint8_t* src_key, const uint8_t* src_value)
+{
+    uint64_t pos = SM_H1(hash) & map->mask_;
+    uint64_t dist = 0;
+    while(SM_IS_FULL(map->ctrl_[pos]) && dist <= map->dist_[pos]) {
+        pos = (pos + 1) & map->mask_;
+        ++dist;
+    }
+    uint8_t* key = sm_key_at(map, pos);
+    uint8_t* value = sm_value_at(map, pos);
+    bool displaced = SM_IS_FULL(map->ctrl_[pos]);
+    uint8_t* carry_key = sm_scratch_key(map, 0);
+    uint8_t* carry_value = sm_scratch_value(map, 0);
+    if(displaced) {
+        sm_relocate(map, carry_key, carry_value, key, value);
+    }
+    if(!sm_construct_key(map, key, src_key)) {
+        if(displaced) {
+            sm_relocate(map, key, value, carry_key, carry_value);
+        }
+        return SM_INVALID64;
+    }
+    if(!sm_construct_value(map, value, src_value)) {
+        sm_destruct_key(map, key);
+        if(displaced) {
+            sm_relocate(map, key, value, carry_key, carry_value);
+        }
+        return SM_INVALID64;
+    }
+    uint8_t carry_tag = map->ctrl_[pos];
+    uint64_t carry_dist = map->dist_[pos];
+    sm_set_ctrl(map, pos, SM_H2(hash));
+    sm_set_dist(map, pos, dist);
+    SM_COUNT(map, inserts, 1);
+    SM_COUNT(map, insert_displacement, dist);
+    if(displaced) {
+        sm_place_robinhood(map, (pos + 1) & map->mask_, carry_dist + 1, carry_tag, carry_key, carry_value);
+    }
+    return pos;
+}
+
+/**
+ * @brief construct an item at a free slot in default mode
+ */
+static bool sm_add_item_at(smallmap* map, uint64_t pos, uint64_t hash, const uint8_t* src_key, const uint8_t* src_value)
+{
+    if(sm_is_dense(map)) {
+        sm_dense_append(map, pos);
+    }
+    uint8_t* key = sm_key_at(map, pos);
+    uint8_t* value = sm_value_at(map, pos);
+    if(!sm_construct_key(map, key, src_key)) {
+        return false;
+    }
+    if(!sm_construct_value(map, value, src_value)) {
+        sm_destruct_key(map, key);
+        return false;
+    }
+    if(SM_CTRL_DELETED == map->ctrl_[pos]) {
+        --map->deleted_;
+    }
+    sm_set_ctrl(map, pos, SM_H2(hash));
+    SM_COUNT(map, inserts, 1);
+    SM_COUNT(map, insert_displacement, (pos - SM_H1(hash)) & map->mask_);
+    return true;
+}
+
+/**
+ * @brief add an item by the calculated hash
+ * @return position of the added item, SM_INVALID64 if cannot construct
+ */
+static uint64_t sm_add_item(smallmap* map, uint64_t hash, const uint8_t* src_key, const uint8_t* src_value)
+{
+    if(sm_is_robinhood(map)) {
+        return sm_add_item_robinhood(map, hash, src_key, src_value);
+    }
+    uint64_t pos = sm_find_free(map, hash);
+    return sm_add_item_at(map, pos, hash, src_key, src_value) ? pos : SM_INVALID64;
+}
+
+/**
+ * @brief relocate an item from the previous buffer, or from another map
+ * @details in dense mode, the item becomes a new entry which the caller counts in size_
+ */
+static void sm_move_item(smallmap* map, uint64_t hash, uint8_t* src_key, uint8_t* src_value)
+{
+    if(sm_is_robinhood(map)) {
+        sm_place_robinhood(map, SM_H1(hash) & map->mask_, 0, SM_H2(hash), src_key, src_value);
+        return;
+    }
+    uint64_t pos = sm_find_free(map, hash);
+    if(SM_CTRL_DELETED == map->ctrl_[pos]) {
+        --map->deleted_;
+    }
+    sm_set_ctrl(map, pos, SM_H2(hash));
+    if(sm_is_dense(map)) {
+        sm_dense_append(map, pos);
+    }
+    sm_relocate(map, sm_key_at(map, pos), sm_value_at(map, pos), src_key, src_value);
+}
+
+/**
+ * @brief relocate all items in a buffer to the current buffer
+ */
+static void sm_move_items(smallmap* map, const uint8_t* ctrl, uint8_t* keys, uint8_t* values, uint64_t capacity)
+{
+    for(uint64_t i = 0; i < capacity; ++i) {
+        if(!SM_IS_FULL(ctrl[i])) {
+            continue;
+        }
+        uint8_t* key = &keys[i * map->key_size_];
+        uint8_t* value = &values[i * map->value_size_];
+        uint64_t hash = sm_hash_stored(map, key);
+        sm_move_item(map, hash, key, value);
+    }
+}
+
+/**
+ * @struct sm_rehash_job
+ * @brief a buffer whose items are relocated by rehash tasks
+ */
+typedef struct sm_rehash_job_t
+{
+    smallmap* map;
+    uint8_t* ctrl; //!< control bytes of the buffer
+    uint8_t* keys; //!< keys of the buffer
+    uint8_t* values; //!< values of the buffer
+    uint64_t capacity; //!< capacity of the buffer, not more than the current one
+    uint32_t tasks; //!< number of tasks
+} sm_rehash_job;
+
+/**
+ * @brief relocate items whose homes are in a range of the buffer
+ * @details the current capacity is a multiple of the buffer's, so a home in the range of the buffer stays in the same range
+ * of each buffer-sized part of the current one. Each task writes only its own ranges, then an item whose probe would cross
+ * the end of the range, or whose home is in another range, is left for the serial pass.
+ */
+static void sm_rehash_task(void* arg, uint32_t index)
+{
+    sm_rehash_job* job = (sm_rehash_job*)arg;
+    smallmap* map = job->map;
+    uint64_t begin = job->capacity * index / job->tasks;
+    uint64_t end = job->capacity * (index + 1) / job->tasks;
+    for(uint64_t i = begin; i < end; ++i) {
+        if(!SM_IS_FULL(job->ctrl[i])) {
+            continue;
+        }
+        uint8_t* key = &job->keys[i * map->key_size_];
+        uint8_t* value = &job->values[i * map->value_size_];
+        uint64_t hash = sm_hash_stored(map, key);
+        uint64_t pos = SM_H1(hash) & map->mask_;
+        uint64_t offset = pos & (job->capacity - 1);
+        if(offset < begin || end <= offset) {
+            continue;
+        }
+        uint64_t limit = pos - offset + end;
+        while(pos < limit && SM_CTRL_EMPTY != map->ctrl_[pos]) {
+            ++pos;
+        }
+        if(limit <= pos) {
+            continue;
+        }
+        // Clones of control bytes are written after all tasks
+        map->ctrl_[pos] = SM_H2(hash);
+        sm_relocate(map, sm_key_at(map, pos), sm_value_at(map, pos), key, value);
+        job->ctrl[i] = SM_CTRL_EMPTY;
+    }
+}
+
+/**
+ * @brief a rehash task on its own thread
+ */
+typedef struct sm_rehash_thread_t
+{
+    void (*task)(void*, uint32_t);
+    void* arg;
+    uint32_t index;
+} sm_rehash_thread;
+
+static void sm_rehash_thread_run(void* arg)
+{
+    sm_rehash_thread* thread = (sm_rehash_thread*)arg;
+    thread->task(thread->arg, thread->index);
+}
+
+/**
+ * @brief run tasks on threads which are started for the call, the caller runs the first one, and the ones which cannot be started
+ */
+static void sm_rehash_spawn_threads(void* user, void (*task)(void*, uint32_t), void* arg, uint32_t count)
+{
+    (void)user;
+    sm_rehash_thread threads[SM_REHASH_MAX_TASKS];
+    sm_thread handles[SM_REHASH_MAX_TASKS];
+    bool started[SM_REHASH_MAX_TASKS];
+    assert(count <= SM_REHASH_MAX_TASKS);
+    for(uint32_t i = 1; i < count; ++i) {
+        threads[i].task = task;
+        threads[i].arg = arg;
+        threads[i].index = i;
+        started[i] = sm_thread_create(&handles[i], sm_rehash_thread_run, &threads[i]);
+    }
+    task(arg, 0);
+    for(uint32_t i = 1; i < count; ++i) {
+        if(started[i]) {
+            sm_thread_join(handles[i]);
+        } else {
+            task(arg, i);
+        }
+    }
+}
+
+/**
+ * @brief relocate all items in a buffer to the current buffer, split into tasks if the buffer is large
+ * @details Robin Hood placement depends on the order of insertion, so it is always serial
+ */
+static void sm_rehash_items(smallmap* map, uint8_t* ctrl, uint8_t* keys, uint8_t* values, uint64_t capacity)
+{
+    uint64_t tasks = capacity / SM_REHASH_TASK_MIN_SLOTS;
+    tasks = (map->rehash_tasks_ < tasks) ? map->rehash_tasks_ : tasks;
+    if(1 < tasks && !sm_is_robinhood(map) && capacity <= map->capacity_) {
+        sm_rehash_job job;
+        job.map = map;
+        job.ctrl = ctrl;
+        job.keys = keys;
+        job.values = values;
+        job.capacity = capacity;
+        job.tasks = (uint32_t)tasks;
+        map->rehash_spawn_(map->rehash_user_, sm_rehash_task, &job, job.tasks);
+        memcpy(map->ctrl_ + map->capacity_, map->ctrl_, SM_GROUP_WIDTH);
+    }
+    sm_move_items(map, ctrl, keys, values, capacity);
+}
+
+/**
+ * @brief reallocate the entry buffer for count entries in dense mode, entries are relocated in order
+ */
+static bool sm_dense_resize(smallmap* map, uint64_t count)
+{
+    assert(map->size_ <= count);
+    if(count == map->entry_capacity_) {
+        return true;
+    }
+    size_t key_size = SM_ALIGN(count * map->key_size_);
+    size_t value_size = SM_ALIGN(count * map->value_size_);
+    size_t slot_size = SM_ALIGN(count * sizeof(uint32_t));
+    size_t total_size = key_size + value_size + slot_size;
+    uint8_t* buffer = (uint8_t*)sm_alloc(map, total_size, SM_BUFFER_ALIGN);
+    if(NULL == buffer) {
+        return false;
+    }
+    uint8_t* keys = buffer;
+    uint8_t* values = buffer + key_size;
+    uint32_t* slots = (uint32_t*)(buffer + key_size + value_size);
+    if(sm_is_trivial(map)) {
+        if(0 < map->size_) {
+            memcpy(keys, map->entry_keys_, map->size_ * map->key_size_);
+            memcpy(values, map->entry_values_, map->size_ * map->value_size_);
+        }
+    } else {
+        for(uint64_t i = 0; i < map->size_; ++i) {
+            sm_relocate(map, keys + i * map->key_size_, values + i * map->value_size_, sm_entry_key(map, i), sm_entry_value(map, i));
+        }
+    }
+    if(0 < map->size_) {
+        memcpy(slots, map->entry_slots_, map->size_ * sizeof(uint32_t));
+    }
+    sm_dealloc(map, map->entry_keys_, map->entry_buffer_size_);
+    map->entry_keys_ = keys;
+    map->entry_values_ = values;
+    map->entry_slots_ = slots;
+    map->entry_capacity_ = count;
+    map->entry_buffer_size_ = total_size;
+    return true;
+}
+
+/**
+ * @brief put every entry in the empty current buffer in dense mode
+ * @details entries stay where they are, only their indices are placed, reading the keys as one stream
+ */
+static void sm_dense_reindex(smallmap* map)
+{
+    for(uint64_t i = 0; i < map->size_; ++i) {
+        uint64_t hash = sm_hash_stored(map, sm_entry_key(map, i));
+        uint64_t pos = sm_find_free(map, hash);
+        sm_set_ctrl(map, pos, SM_H2(hash));
+        map->index_[pos] = (uint32_t)i;
+        map->entry_slots_[i] = (uint32_t)pos;
+    }
+}
+
+/**
+ * @brief release the previous buffer after migration
+ */
+static void sm_release_old(smallmap* map)
+{
+    sm_dealloc(map, map->old_ctrl_, map->old_buffer_size_);
+    map->old_buffer_size_ = 0;
+    map->old_size_ = 0;
+    map->old_capacity_ = 0;
+    map->migrate_pos_ = 0;
+    map->old_ctrl_ = NULL;
+    map->old_keys_ = NULL;
+    map->old_values_ = NULL;
+}
+
+/**
+ * @brief relocate up to slots slots of the previous buffer to the current buffer
+ * @details migrated slots are marked as deleted, so that probe sequences in the previous buffer stay intact.
+ * The previous buffer is released when no item is left.
+ */
+static void sm_migrate_(smallmap* map, uint64_t slots)
+{
+    assert(NULL != map->old_ctrl_);
+    uint64_t end = (map->old_capacity_ - map->migrate_pos_ < slots) ? map->old_capacity_ : map->migrate_pos_ + slots;
+    for(uint64_t i = map->migrate_pos_; i < end && 0 < map->old_size_; ++i) {
+        if(!SM_IS_FULL(map->old_ctrl_[i])) {
+            continue;
+        }
+        uint8_t* key = map->old_keys_ + i * map->key_size_;
+        uint8_t* value = map->old_values_ + i * map->value_size_;
+        sm_move_item(map, sm_hash_stored(map, key), key, value);
+        sm_ctrl_set(map->old_ctrl_, map->old_capacity_, i, SM_CTRL_DELETED);
+        --map->old_size_;
+    }
+    map->migrate_pos_ = end;
+    if(map->old_capacity_ <= end || 0 == map->old_size_) {
+        sm_release_old(map);
+        sm_arena_compact(map);
+    }
+}
+
+/**
+ * @brief monotonic time in nanoseconds
+ */
+static uint64_t sm_now_ns(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER count;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)((double)count.QuadPart * 1.0e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline void sm_count_resize(smallmap* map, uint64_t start)
+{
+    ++map->resizes_;
+    map->resize_ns_ += sm_now_ns() - start;
+}
+
+/**
+ * @brief check that Robin Hood placement of all items in a smaller capacity keeps distances within the limit
+ * @details a run holds its items in the order of their homes whichever order they come in, so the last item of each home
+ * ends the longest distance from it. Growing never lengthens a run of homes, only shrinking merges them.
+ * @param [in] counts ... capacity bytes, zeroed, which count items by home and saturate
+ */
+static bool sm_robinhood_fits(const smallmap* map, uint8_t* counts, uint64_t capacity)
+{
+    uint64_t mask = capacity - 1;
+    for(uint64_t i = 0; i < map->capacity_; ++i) {
+        if(!SM_IS_FULL(map->ctrl_[i])) {
+            continue;
+        }
+        uint8_t* count = &counts[SM_H1(sm_hash_stored(map, sm_key_at(map, i))) & mask];
+        *count += (*count < 0xFFU) ? 1 : 0;
+    }
+    // The second lap starts with the run which wraps around the end
+    uint64_t next = 0;
+    for(uint64_t i = 0; i < 2 * capacity; ++i) {
+        uint8_t count = counts[i & mask];
+        if(count <= 0) {
+            continue;
+        }
+        if(0xFFU <= count) {
+            return false;
+        }
+        next = ((next < i) ? i : next) + count;
+        if(capacity <= i && SM_RH_DIST_LIMIT < next - 1 - i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief rebuild a map with the capacity, tombstones are dropped
+ * @details hashes are not stored, so every item is hashed again from its stored key.
+ * An incremental rehash keeps the current buffer as the previous one, and items are migrated by later operations.
+ * @param [in] incremental ... true to defer migration, ignored while the previous migration is unfinished
+ */
+static bool sm_rehash(smallmap* map, uint64_t next_capacity, bool incremental)
+{
+    uint64_t limit = sm_capacity_limit(map);
+    if(limit <= next_capacity) {
+        return false;
+    }
+    // Positions in the previous buffer are offset by the capacity, and must not reach the limit
+    incremental = incremental && NULL == map->old_ctrl_ && 0 < map->size_ && map->capacity_ + next_capacity < limit;
+    uint64_t start = sm_now_ns();
+    bool dense = sm_is_dense(map);
+    // Entries grow first and shrink last, so that a failure leaves an entry buffer which holds the threshold
+    uint64_t entries = (uint64_t)(next_capacity * map->max_load_);
+    if(dense && map->entry_capacity_ < entries && !sm_dense_resize(map, entries)) {
+        return false;
+    }
+    size_t ctrl_size = SM_ALIGN(next_capacity + SM_GROUP_WIDTH);
+    size_t dist_size = sm_is_robinhood(map) ? SM_ALIGN(next_capacity) : 0;
+    size_t key_size = SM_ALIGN(next_capacity * (dense ? sizeof(uint32_t) : map->key_size_));
+    size_t value_size = dense ? 0 : SM_ALIGN(next_capacity * map->value_size_);
+    size_t total_size = ctrl_size + dist_size + key_size + value_size;
+    uint8_t* buffer = (uint8_t*)sm_alloc(map, total_size, SM_BUFFER_ALIGN);
+    if(NULL == buffer) {
+        return false;
+    }
+    // Keys and values are left uninitialized, only slots marked in ctrl are ever read
+    memset(buffer, SM_CTRL_EMPTY, ctrl_size);
+    memset(buffer + ctrl_size, 0, dist_size);
+    if(sm_is_robinhood(map) && next_capacity < map->capacity_) {
+        // Distances are bytes, so a shrink which would merge too many homes keeps the current buffer
+        bool fits = sm_robinhood_fits(map, buffer + ctrl_size, next_capacity);
+        memset(buffer + ctrl_size, 0, dist_size);
+        if(!fits) {
+            sm_dealloc(map, buffer, total_size);
+            return false;
+        }
+    }
+
+    uint8_t* prev_ctrl = map->ctrl_;
+    uint8_t* prev_keys = map->keys_;
+    uint8_t* prev_values = map->values_;
+    uint64_t prev_capacity = map->capacity_;
+    size_t prev_buffer_size = map->buffer_size_;
+
+    map->deleted_ = 0;
+    map->capacity_ = next_capacity;
+    map->mask_ = next_capacity - 1;
+    map->resize_threshold_ = (uint64_t)(next_capacity * map->max_load_);
+    map->shrink_threshold_ = (uint64_t)(next_capacity * map->min_load_);
+    map->max_dist_ = 0;
+    map->ctrl_ = buffer;
+    map->dist_ = (0 < dist_size) ? buffer + ctrl_size : NULL;
+    map->keys_ = dense ? NULL : buffer + ctrl_size + dist_size;
+    map->values_ = dense ? NULL : buffer + ctrl_size + dist_size + key_size;
+    map->index_ = dense ? (uint32_t*)(buffer + ctrl_size + dist_size) : NULL;
+    map->buffer_size_ = total_size;
+
+    if(incremental) {
+        map->old_size_ = map->size_;
+        map->old_capacity_ = prev_capacity;
+        map->migrate_pos_ = 0;
+        map->old_ctrl_ = prev_ctrl;
+        map->old_keys_ = prev_keys;
+        map->old_values_ = prev_values;
+        map->old_buffer_size_ = prev_buffer_size;
+        sm_count_resize(map, start);
+        return true;
+    }
+    if(dense) {
+        sm_dense_reindex(map);
+        if(entries < map->entry_capacity_) {
+            sm_dense_resize(map, entries);
+        }
+    } else {
+        sm_rehash_items(map, prev_ctrl, prev_keys, prev_values, prev_capacity);
+    }
+    sm_dealloc(map, prev_ctrl, prev_buffer_size);
+    if(NULL != map->old_ctrl_) {
+        sm_move_items(map, map->old_ctrl_, map->old_keys_, map->old_values_, map->old_capacity_);
+        sm_release_old(map);
+    }
+    sm_arena_compact(map);
+    sm_count_resize(map, start);
+    return true;
+}
+
+/**
+ * @brief make room for one more item
+ * @details if tombstones occupy much of the buffer, they are purged without growing
+ */
+static bool sm_expand(smallmap* map)
+{
+    if(map->capacity_ <= 0) {
+        return sm_rehash(map, SM_MIN_CAPACITY, false);
+    }
+    if(0 < map->deleted_ && map->size_ < (map->resize_threshold_ >> 1)) {
+        return sm_rehash(map, map->capacity_, sm_is_incremental(map));
+    }
+    return sm_rehash(map, map->capacity_ << 1, sm_is_incremental(map));
+}
+
+smallmap* sm_construct(
+    uint32_t key_size,
+    uint32_t value_size,
+    bool (*key_constructor)(smallmap*, void*, const void*),
+    void (*key_move)(smallmap*, void*, const void*),
+    void (*key_destructor)(smallmap*, void*),
+    bool (*value_constructor)(smallmap*, void*, const void*),
+    void (*value_move)(smallmap*, void*, const void*),
+    void (*value_destructor)(smallmap*, void*),
+    uint32_t (*hasher)(const void*),
+    bool (*compare)(const void*, const void*),
+    void* (*allocate)(size_t),
+    void (*deallocate)(void*))
+{
+    sm_desc desc;
+    memset(&desc, 0, sizeof(sm_desc));
+    desc.key_size = key_size;
+    desc.value_size = value_size;
+    desc.key_constructor = key_constructor;
+    desc.key_move = key_move;
+    desc.key_destructor = key_destructor;
+    desc.value_constructor = value_constructor;
+    desc.value_move = value_move;
+    desc.value_destructor = value_destructor;
+    desc.hasher = hasher;
+    desc.compare = compare;
+    desc.allocate = allocate;
+    desc.deallocate = deallocate;
+    return sm_construct_desc(&desc);
+}
+
+smallmap* sm_construct_desc(const sm_desc* desc)
+{
+    assert(NULL != desc);
+    bool string = 0 != (desc->flags & SM_FLAG_STRING);
+    // Without a key constructor, the key is copied from the address of the key argument
+    assert(string || NULL != desc->key_constructor || desc->key_size <= sizeof(void*));
+    if(!string && NULL == desc->key_constructor && sizeof(void*) < desc->key_size) {
+        return NULL;
+    }
+    bool wide = 0 != (desc->flags & SM_FLAG_WIDE);
+    assert(string || wide || NULL != desc->hasher);
+    assert(string || !wide || NULL != desc->hasher64);
+    (void)wide;
+    assert(string || NULL != desc->compare);
+    assert(0.0f <= desc->max_load && desc->max_load < 1.0f);
+    assert(0 == (desc->flags & SM_FLAG_ROBINHOOD) || 0 == (desc->flags & SM_FLAG_INCREMENTAL));
+    if(0 != (desc->flags & SM_FLAG_ROBINHOOD) && 0 != (desc->flags & SM_FLAG_INCREMENTAL)) {
+        return NULL;
+    }
+    uint32_t sparse_only = SM_FLAG_ROBINHOOD | SM_FLAG_INCREMENTAL | SM_FLAG_WIDE;
+    assert(0 == (desc->flags & SM_FLAG_DENSE) || 0 == (desc->flags & sparse_only));
+    if(0 != (desc->flags & SM_FLAG_DENSE) && 0 != (desc->flags & sparse_only)) {
+        return NULL;
+    }
+
+    sm_legacy_allocator legacy;
+    sm_allocator allocator = sm_allocator_resolve(desc, &legacy);
+    uint32_t key_size = string ? (uint32_t)sizeof(sm_string_key) : desc->key_size;
+    size_t scratch_size = 0;
+    if(0 != (desc->flags & SM_FLAG_ROBINHOOD)) {
+        scratch_size = 2 * (SM_ALIGN(key_size) + SM_ALIGN(desc->value_size));
+    }
+    size_t alloc_size = SM_ALIGN(sizeof(smallmap)) + scratch_size;
+    smallmap* map = (smallmap*)allocator.alloc(allocator.ctx, alloc_size, SM_ALLOC_ALIGN);
+    if(NULL == map) {
+        return NULL;
+    }
+    memset(map, 0, sizeof(smallmap));
+    map->allocator_ = allocator;
+    map->legacy_ = legacy;
+    sm_allocator_rebind(&map->allocator_, &map->legacy_);
+    map->alloc_size_ = alloc_size;
+    map->key_size_ = key_size;
+    map->value_size_ = desc->value_size;
+    map->flags_ = desc->flags;
+    map->max_load_ = (0.0f < desc->max_load) ? desc->max_load : SM_DEFAULT_MAX_LOAD;
+    // Halving from under a quarter of the maximum load leaves the load under half of it, far from expanding again
+    assert(0.0f <= desc->min_load && desc->min_load <= map->max_load_ * 0.25f);
+    map->min_load_ = (desc->min_load < map->max_load_ * 0.25f) ? desc->min_load : map->max_load_ * 0.25f;
+    // The previous buffer must be drained before the current one reaches the threshold, even when growing from half full
+    uint32_t min_migrate_slots = (uint32_t)(2.0f / map->max_load_) + 1;
+    map->migrate_slots_ = (0 < desc->migrate_slots) ? desc->migrate_slots : SM_DEFAULT_MIGRATE_SLOTS;
+    if(map->migrate_slots_ < min_migrate_slots) {
+        map->migrate_slots_ = min_migrate_slots;
+    }
+    map->rehash_tasks_ = (SM_REHASH_MAX_TASKS < desc->rehash_threads) ? SM_REHASH_MAX_TASKS : desc->rehash_threads;
+    map->rehash_spawn_ = (NULL != desc->rehash_spawn) ? desc->rehash_spawn : sm_rehash_spawn_threads;
+    map->rehash_user_ = desc->rehash_user;
+    map->scratch_ = (0 < scratch_size) ? (uint8_t*)map + SM_ALIGN(sizeof(smallmap)) : NULL;
+    map->key_constructor_ = string ? sm_string_construct : desc->key_constructor;
+    map->key_move_ = string ? sm_string_move : desc->key_move;
+    map->key_destructor_ = string ? sm_string_destruct : desc->key_destructor;
+    map->value_constructor_ = desc->value_constructor;
+    map->value_move_ = desc->value_move;
+    map->value_destructor_ = desc->value_destructor;
+    map->hasher_ = desc->hasher;
+    map->hasher64_ = desc->hasher64;
+    map->compare_ = desc->compare;
+    if(!sm_expand(map)) {
+        sm_destruct(map);
+        return NULL;
+    }
+    return map;
+}
+
+static void sm_unmap_file(void* base, size_t size);
+
+/**
+ * @brief release the allocation which holds a map context
+ * @details the allocator is copied out first, since an adapted one has its context in the map
+ */
+static void sm_release_context(smallmap* map)
+{
+    sm_legacy_allocator legacy = map->legacy_;
+    sm_allocator allocator = map->allocator_;
+    sm_allocator_rebind(&allocator, &legacy);
+    size_t alloc_size = map->alloc_size_;
+    memset(map, 0, sizeof(smallmap));
+    allocator.dealloc(allocator.ctx, map, alloc_size);
+}
+
+/**
+ * @brief destruct every item in both buffers, their slots are left as they are
+ */
+static void sm_destruct_items(smallmap* map)
+{
+    if(NULL == map->key_destructor_ && NULL == map->value_destructor_) {
+        return;
+    }
+    for(uint64_t i = 0; i < map->capacity_; ++i) {
+        if(!SM_IS_FULL(map->ctrl_[i])) {
+            continue;
+        }
+        sm_destruct_item(map, sm_key_at(map, i), sm_value_at(map, i));
+    }
+    for(uint64_t i = 0; i < map->old_capacity_; ++i) {
+        if(!SM_IS_FULL(map->old_ctrl_[i])) {
+            continue;
+        }
+        sm_destruct_item(map, map->old_keys_ + i * map->key_size_, map->old_values_ + i * map->value_size_);
+    }
+}
+
+/**
+ * @brief mark every slot of the current buffer empty after its items have been moved or destructed
+ * @details the buffers are kept for reuse, and so is the arena
+ */
+static void sm_reset(smallmap* map)
+{
+    memset(map->ctrl_, SM_CTRL_EMPTY, map->capacity_ + SM_GROUP_WIDTH);
+    if(NULL != map->dist_) {
+        memset(map->dist_, 0, map->capacity_);
+    }
+    map->size_ = 0;
+    map->deleted_ = 0;
+    map->max_dist_ = 0;
+    map->arena_size_ = 0;
+    map->arena_garbage_ = 0;
+}
+
+void sm_destruct(smallmap* map)
+{
+    if(NULL == map) {
+        return;
+    }
+    if(sm_is_readonly(map)) {
+        // Items in a snapshot are bytes of the file, nothing to destruct
+        sm_unmap_file(map->mapping_, map->mapping_size_);
+        sm_release_context(map);
+        return;
+    }
+    sm_destruct_items(map);
+    sm_dealloc(map, map->old_ctrl_, map->old_buffer_size_);
+    sm_dealloc(map, map->ctrl_, map->buffer_size_);
+    sm_dealloc(map, map->entry_keys_, map->entry_buffer_size_);
+    sm_dealloc(map, map->arena_, map->arena_capacity_);
+    sm_release_context(map);
+}
+
+void* sm_allocate(smallmap* map, size_t size)
+{
+    assert(NULL != map);
+    if(sm_legacy_alloc == map->allocator_.alloc) {
+        return map->legacy_.allocate(size);
+    }
+    // sm_deallocate is not given the size, so it is kept in front of the block
+    if(SIZE_MAX - SM_ALLOC_ALIGN < size) {
+        return NULL;
+    }
+    uint8_t* block = (uint8_t*)sm_alloc(map, SM_ALLOC_ALIGN + size, SM_ALLOC_ALIGN);
+    if(NULL == block) {
+        return NULL;
+    }
+    memcpy(block, &size, sizeof(size_t));
+    return block + SM_ALLOC_ALIGN;
+}
+
+void sm_deallocate(smallmap* map, void* ptr)
+{
+    assert(NULL != map);
+    if(sm_legacy_alloc == map->allocator_.alloc) {
+        map->legacy_.deallocate(ptr);
+        return;
+    }
+    if(NULL == ptr) {
+        return;
+    }
+    uint8_t* block = (uint8_t*)ptr - SM_ALLOC_ALIGN;
+    size_t size;
+    memcpy(&size, block, sizeof(size_t));
+    sm_dealloc(map, block, SM_ALLOC_ALIGN + size);
+}
+
+uint64_t sm_size(const smallmap* map)
+{
+    assert(NULL != map);
+    return map->size_;
+}
+
+uint64_t sm_hash(const smallmap* map, const void* key)
+{
+    assert(NULL != map);
+    assert(sm_valid_key(map, key));
+    sm_string_query query;
+    return sm_hash_probe(map, sm_probe_arg(map, &key, &query));
+}
+
+uint32_t sm_find(const smallmap* map, const void* key)
+{
+    return sm_narrow_pos(sm_find64(map, key));
+}
+
+uint64_t sm_find64(const smallmap* map, const void* key)
+{
+    assert(NULL != map);
+    assert(sm_valid_key(map, key));
+    sm_string_query query;
+    const void* probe = sm_probe_arg(map, &key, &query);
+    return sm_find_(map, sm_hash_probe(map, probe), probe);
+}
+
+uint64_t sm_find_hashed(const smallmap* map, uint64_t hash, const void* key)
+{
+    assert(NULL != map);
+    assert(sm_valid_key(map, key));
+    sm_string_query query;
+    return sm_find_(map, hash, sm_probe_arg(map, &key, &query));
+}
+
+bool sm_try_get(const smallmap* map, const void* key, void* value)
+{
+    assert(NULL != map);
+    assert(sm_valid_key(map, key));
+    assert(NULL != value);
+    uint64_t pos = sm_find64(map, key);
+    if(SM_INVALID64 == pos) {
+        return false;
+    }
+    memcpy(value, sm_item_value(map, pos), map->value_size_);
+    return true;
+}
+
+bool sm_try_get_hashed(const smallmap* map, uint64_t hash, const void* key, void* value)
+{
+    assert(NULL != map);
+    assert(sm_valid_key(map, key));
+    assert(NULL != value);
+    uint64_t pos = sm_find_hashed(map, hash, key);
+    if(SM_INVALID64 == pos) {
+        return false;
+    }
+    memcpy(value, sm_item_value(map, pos), map->value_size_);
+    return true;
+}
+
+void sm_find_batch(const smallmap* map, const void* const* keys, uint32_t count, uint32_t* positions)
+{
+    assert(NULL != map);
+    assert(NULL != keys || count <= 0);
+    assert(NULL != positions || count <= 0);
+    uint64_t wide_positions[SM_BATCH_SIZE];
+    for(uint32_t i = 0; i < count; i += SM_BATCH_SIZE) {
+        uint32_t n = (SM_BATCH_SIZE < (count - i)) ? SM_BATCH_SIZE : (count - i);
+        sm_find_batch_(map, keys + i, n, wide_positions, false);
+        for(uint32_t j = 0; j < n; ++j) {
+            positions[i + j] = sm_narrow_pos(wide_positions[j]);
+        }
+    }
+}
+
+uint32_t sm_try_get_batch(const smallmap* map, const void* const* keys, uint32_t count, void* values, bool* found)
+{
+    assert(NULL != map);
+    assert(NULL != keys || count <= 0);
+    assert(NULL != values || count <= 0);
+    assert(NULL != found || count <= 0);
+    uint64_t positions[SM_BATCH_SIZE];
+    uint32_t result = 0;
+    uint8_t* dst = (uint8_t*)values;
+    for(uint32_t i = 0; i < count; i += SM_BATCH_SIZE) {
+        uint32_t n = (SM_BATCH_SIZE < (count - i)) ? SM_BATCH_SIZE : (count - i);
+        sm_find_batch_(map, keys + i, n, positions, true);
+        for(uint32_t j = 0; j < n; ++j) {
+            found[i + j] = (SM_INVALID64 != positions[j]);
+            if(found[i + j]) {
+                memcpy(dst + (size_t)(i + j) * map->value_size_, sm_item_value(map, positions[j]), map->value_size_);
+                ++result;
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief find an item whose hash and probe are computed, or add it if absent
+ * @details in default mode under the threshold, a single probe finds the item or the free slot to add it.
+ * Otherwise, a lookup comes first since expanding or Robin Hood placement moves items.
+ * @return position of the item, SM_INVALID64 if cannot add
+ * @param [out] inserted ... true if the item is added
+ */
+static uint64_t sm_insert_(smallmap* map, uint64_t hash, const void* key, const void* probe, const void* value, bool* inserted)
+{
+    *inserted = false;
+    if(sm_is_readonly(map)) {
+        return SM_INVALID64;
+    }
+    if(NULL != map->old_ctrl_) {
+        sm_migrate_(map, map->migrate_slots_);
+    }
+    const void* src = sm_construct_src(map, key, probe);
+    bool full = map->resize_threshold_ <= (map->size_ - map->old_size_ + map->deleted_)
+                || (sm_is_robinhood(map) && SM_RH_DIST_LIMIT <= map->max_dist_);
+    uint64_t pos;
+    if(!full && !sm_is_robinhood(map)) {
+        bool found;
+        pos = sm_find_or_free(map, hash, probe, &found);
+        if(found) {
+            return pos;
+        }
+        if(NULL != map->old_ctrl_) {
+            uint64_t old = sm_find_old_(map, hash, probe);
+            if(SM_INVALID64 != old) {
+                return old;
+            }
+        }
+        if(!sm_add_item_at(map, pos, hash, src, value)) {
+            return SM_INVALID64;
+        }
+    } else {
+        pos = sm_find_(map, hash, probe);
+        if(SM_INVALID64 != pos) {
+            return pos;
+        }
+        if(full) {
+            if(!sm_expand(map)) {
+                return SM_INVALID64;
+            }
+            if(sm_is_robinhood(map) && SM_RH_DIST_LIMIT <= map->max_dist_) {
+                // Too many keys share a home, the hasher is broken
+                return SM_INVALID64;
+            }
+        }
+        pos = sm_add_item(map, hash, src, value);
+        if(SM_INVALID64 == pos) {
+            return SM_INVALID64;
+        }
+    }
+    ++map->size_;
+    *inserted = true;
+    return pos;
+}
+
+/**
+ * @brief add an item whose hash and probe are computed
+ */
+static bool sm_add_(smallmap* map, uint64_t hash, const void* key, const void* probe, const void* value)
+{
+    bool inserted;
+    sm_insert_(map, hash, key, probe, value, &inserted);
+    return inserted;
+}
+
+bool sm_add(smallmap* map, const void* key, const void* value)
+{
+    assert(NULL != map);
+    assert(sm_valid_key(map, key));
+    assert(NULL != value);
+    sm_string_query query;
+    const void* probe = sm_probe_arg(map, &key, &query);
+    return sm_add_(map, sm_hash_probe(map, probe), key, probe, value);
+}
+
+bool sm_add_hashed(smallmap* map, uint64_t hash, const void* key, const void* value)
+{
+    assert(NULL != map);
+    assert(sm_valid_key(map, key));
+    assert(NULL != value);
+    sm_string_query query;
+    return sm_add_(map, hash, key, sm_probe_arg(map, &key, &query), value);
+}
+
+void* sm_get_ptr(smallmap* map, const void* key)
+{
+    uint64_t pos = sm_find64(map, key);
+    if(SM_INVALID64 == pos) {
+        return NULL;
+    }
+    return sm_item_value(map, pos);
+}
+
+void* sm_find_or_insert(smallmap* map, const void* key, const void* value, bool* inserted)
+{
+    assert(NULL != map);
+    assert(sm_valid_key(map, key));
+    assert(NULL != value);
+    sm_string_query query;
+    const void* probe = sm_probe_arg(map, &key, &query);
+    bool added;
+    uint64_t pos = sm_insert_(map, sm_hash_probe(map, probe), key, probe, value, &added);
+    if(NULL != inserted) {
+        *inserted = added;
+    }
+    if(SM_INVALID64 == pos) {
+        return NULL;
+    }
+    return sm_item_value(map, pos);
+}
+
+bool sm_reserve(smallmap* map, uint32_t size)
+{
+    return sm_reserve64(map, size);
+}
+
+/**
+ * @brief the least capacity whose threshold holds size items, 0 if it reaches the limit
+ */
+static uint64_t sm_fit_capacity(const smallmap* map, uint64_t size)
+{
+    uint64_t capacity = SM_MIN_CAPACITY;
+    while((uint64_t)(capacity * map->max_load_) < size) {
+        if(sm_capacity_limit(map) <= capacity) {
+            return 0;
+        }
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+bool sm_reserve64(smallmap* map, uint64_t size)
+{
+    assert(NULL != map);
+    if(size + map->deleted_ <= map->resize_threshold_) {
+        return true;
+    }
+    if(sm_is_readonly(map)) {
+        return false;
+    }
+    uint64_t capacity = sm_fit_capacity(map, size);
+    if(capacity <= 0) {
+        return false;
+    }
+    return sm_rehash(map, (map->capacity_ < capacity) ? capacity : map->capacity_, false);
+}
+
+bool sm_shrink_to_fit(smallmap* map)
+{
+    assert(NULL != map);
+    if(sm_is_readonly(map)) {
+        return false;
+    }
+    uint64_t capacity = sm_fit_capacity(map, map->size_);
+    assert(0 < capacity);
+    capacity = (capacity < map->capacity_) ? capacity : map->capacity_;
+    if(capacity == map->capacity_ && map->deleted_ <= 0 && NULL == map->old_ctrl_) {
+        return true;
+    }
+    // Robin Hood distances may not fit the least capacity, then a larger one is tried
+    while(!sm_rehash(map, capacity, false)) {
+        if(map->capacity_ <= capacity) {
+            return false;
+        }
+        capacity <<= 1;
+    }
+    return true;
+}
+
+void sm_clear(smallmap* map, bool keep_memory)
+{
+    assert(NULL != map);
+    if(sm_is_readonly(map)) {
+        return;
+    }
+    sm_destruct_items(map);
+    sm_release_old(map);
+    sm_reset(map);
+    if(keep_memory) {
+        return;
+    }
+    sm_dealloc(map, map->arena_, map->arena_capacity_);
+    map->arena_ = NULL;
+    map->arena_capacity_ = 0;
+    if(SM_MIN_CAPACITY < map->capacity_) {
+        // A failure keeps the empty buffer, which is still valid
+        sm_rehash(map, SM_MIN_CAPACITY, false);
+    }
+}
+
+/**
+ * @brief add many items, hashing the keys unless hashes is given
+ */
+static uint32_t sm_build_(smallmap* map, const uint64_t* hashes, const void* const* keys, const void* values, uint32_t count)
+{
+    if(sm_is_readonly(map) || !sm_reserve64(map, map->size_ + count)) {
+        return 0;
+    }
+    if(NULL != map->old_ctrl_) {
+        // The reserved buffer holds all items, and a single probe checks duplicates only in the current buffer
+        sm_migrate_(map, map->old_capacity_);
+    }
+    const uint8_t* src = (const uint8_t*)values;
+    uint64_t computed[SM_BATCH_SIZE];
+    const void* probes[SM_BATCH_SIZE];
+    sm_string_query queries[SM_BATCH_SIZE];
+    uint32_t added = 0;
+    for(uint32_t i = 0; i < count; i += SM_BATCH_SIZE) {
+        uint32_t n = (count - i < SM_BATCH_SIZE) ? count - i : SM_BATCH_SIZE;
+        for(uint32_t j = 0; j < n; ++j) {
+            probes[j] = sm_probe_arg(map, &keys[i + j], &queries[j]);
+        }
+        const uint64_t* batch = computed;
+        if(NULL != hashes) {
+            batch = hashes + i;
+        } else {
+            sm_hash_probes(map, probes, n, computed);
+        }
+        for(uint32_t j = 0; j < n; ++j) {
+            SM_PREFETCH(&map->ctrl_[SM_H1(batch[j]) & map->mask_]);
+        }
+        for(uint32_t j = 0; j < n; ++j) {
+            const void* key = sm_construct_src(map, keys[i + j], probes[j]);
+            const uint8_t* value = src + (size_t)(i + j) * map->value_size_;
+            if(sm_is_robinhood(map)) {
+                if(SM_INVALID64 != sm_find_(map, batch[j], probes[j])) {
+                    continue;
+                }
+                if(SM_RH_DIST_LIMIT <= map->max_dist_
+                   && (!sm_expand(map) || SM_RH_DIST_LIMIT <= map->max_dist_)) {
+                    return added;
+                }
+                if(SM_INVALID64 == sm_add_item_robinhood(map, batch[j], key, value)) {
+                    return added;
+                }
+            } else {
+                bool found;
+                uint64_t pos = sm_find_or_free(map, batch[j], probes[j], &found);
+                if(found) {
+                    continue;
+                }
+                if(!sm_add_item_at(map, pos, batch[j], key, value)) {
+                    return added;
+                }
+            }
+            ++map->size_;
+            ++added;
+        }
+    }
+    return added;
+}
+
+uint32_t sm_build(smallmap* map, const void* const* keys, const void* values, uint32_t count)
+{
+    assert(NULL != map);
+    assert(0 == count || NULL != keys);
+    assert(0 == count || NULL != values);
+    return sm_build_(map, NULL, keys, values, count);
+}
+
+uint32_t sm_build_hashed(smallmap* map, const uint64_t* hashes, const void* const* keys, const void* values, uint32_t count)
+{
+    assert(NULL != map);
+    assert(0 == count || NULL != hashes);
+    assert(0 == count || NULL != keys);
+    assert(0 == count || NULL != values);
+    return sm_build_(map, hashes, keys, values, count);
+}
+
+bool sm_migrate(smallmap* map, uint32_t slots)
+{
+    assert(NULL != map);
+    if(NULL != map->old_ctrl_) {
+        sm_migrate_(map, slots);
+    }
+    return NULL == map->old_ctrl_;
+}
+
+bool sm_for_each(const smallmap* map, bool (*fn)(void*, const void*, const void*), void* ctx)
+{
+    assert(NULL != map);
+    assert(NULL != fn);
+    sm_iter iter;
+    sm_iter_begin(map, &iter);
+    while(sm_iter_next(map, &iter)) {
+        if(!fn(ctx, iter.key, iter.value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint64_t sm_slot_count(const smallmap* map)
+{
+    assert(NULL != map);
+    if(sm_is_dense(map)) {
+        return map->size_;
+    }
+    return map->capacity_ + map->old_capacity_;
+}
+
+void sm_iter_begin(const smallmap* map, sm_iter* iter)
+{
+    sm_iter_range(map, iter, 0, UINT64_MAX);
+}
+
+void sm_iter_range(const smallmap* map, sm_iter* iter, uint64_t begin, uint64_t end)
+{
+    assert(NULL != map);
+    assert(NULL != iter);
+    uint64_t slots = sm_slot_count(map);
+    iter->key = NULL;
+    iter->value = NULL;
+    iter->position = SM_INVALID64;
+    iter->end_ = end < slots ? end : slots;
+    iter->next_ = begin < iter->end_ ? begin : iter->end_;
+    iter->mask_ = 0;
+    iter->group_ = 0;
+}
+
+bool sm_iter_next(const smallmap* map, sm_iter* iter)
+{
+    assert(NULL != map);
+    assert(NULL != iter);
+    if(sm_is_dense(map)) {
+        // Entries are packed, so the cursor is an entry index and every one is an item
+        if(iter->end_ <= iter->next_) {
+            return false;
+        }
+        uint64_t entry = iter->next_++;
+        iter->position = map->entry_slots_[entry];
+        iter->key = sm_entry_key(map, entry);
+        iter->value = sm_entry_value(map, entry);
+        return true;
+    }
+    // Whole groups of control bytes are tested at once, so empty regions cost one load per group.
+    // The control bytes cloned after the end of a buffer keep a load at its last slots in bounds.
+    sm_bitmask full = (sm_bitmask)iter->mask_;
+    while(0 == full) {
+        uint64_t next = iter->next_;
+        if(iter->end_ <= next) {
+            iter->mask_ = 0;
+            return false;
+        }
+        const uint8_t* ctrl = map->ctrl_;
+        uint64_t base = 0;
+        uint64_t limit = map->capacity_;
+        if(map->capacity_ <= next) {
+            ctrl = map->old_ctrl_;
+            base = map->capacity_;
+            limit = map->capacity_ + map->old_capacity_;
+        }
+        if(iter->end_ < limit) {
+            limit = iter->end_;
+        }
+        full = sm_group_match_full(&ctrl[next - base]);
+        if((limit - next) < SM_GROUP_WIDTH) {
+            full &= sm_bitmask_first(limit - next);
+            iter->next_ = limit;
+        } else {
+            iter->next_ = next + SM_GROUP_WIDTH;
+        }
+        iter->group_ = next;
+    }
+    uint64_t position = iter->group_ + sm_bitmask_lowest(full);
+    iter->mask_ = full & (full - 1);
+    iter->position = position;
+    if(position < map->capacity_) {
+        iter->key = sm_key_at(map, position);
+        iter->value = sm_value_at(map, position);
+    } else {
+        uint64_t i = position - map->capacity_;
+        iter->key = map->old_keys_ + i * map->key_size_;
+        iter->value = map->old_values_ + i * map->value_size_;
+    }
+    return true;
+}
+
+const char* sm_key_string(const smallmap* map, const void* key)
+{
+    assert(NULL != map);
+    assert(NULL != key);
+    assert(sm_is_string(map));
+    return sm_string_data(map, (const sm_string_key*)key);
+}
+
+/**
+ * @brief histogram bucket of a probe length, see SM_STATS_BUCKETS
+ */
+static inline uint32_t sm_stats_bucket(uint64_t length)
+{
+    uint32_t bucket = 0;
+    while(0 < length && bucket < SM_STATS_BUCKETS - 1) {
+        length >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+void sm_stats(const smallmap* map, sm_statistics* stats)
+{
+    assert(NULL != map);
+    assert(NULL != stats);
+    memset(stats, 0, sizeof(sm_statistics));
+    uint64_t capacity = map->capacity_;
+    stats->size = map->size_;
+    stats->capacity = capacity;
+    stats->deleted = map->deleted_;
+    stats->load_factor = (0 < capacity) ? (float)((double)(map->size_ - map->old_size_) / (double)capacity) : 0.0f;
+    stats->max_load = map->max_load_;
+    stats->resizes = map->resizes_;
+    stats->resize_ns = map->resize_ns_;
+    if(sm_is_dense(map)) {
+        stats->ctrl_bytes = map->buffer_size_ + SM_ALIGN(map->entry_capacity_ * sizeof(uint32_t));
+        stats->key_bytes = SM_ALIGN(map->entry_capacity_ * map->key_size_);
+        stats->value_bytes = SM_ALIGN(map->entry_capacity_ * map->value_size_);
+    } else if(0 < capacity) {
+        stats->ctrl_bytes = SM_ALIGN(capacity + SM_GROUP_WIDTH) + (sm_is_robinhood(map) ? SM_ALIGN(capacity) : 0);
+        stats->key_bytes = SM_ALIGN(capacity * map->key_size_);
+        stats->value_bytes = SM_ALIGN(capacity * map->value_size_);
+    }
+    stats->arena_bytes = (size_t)map->arena_capacity_;
+    stats->old_bytes = map->old_buffer_size_;
+    stats->old_size = map->old_size_;
+#ifdef SM_STATS_COUNTERS
+    stats->counters.lookups = sm_atomic_load_u64(&map->counters_.lookups);
+    stats->counters.lookup_groups = sm_atomic_load_u64(&map->counters_.lookup_groups);
+    stats->counters.compares = sm_atomic_load_u64(&map->counters_.compares);
+    stats->counters.inserts = sm_atomic_load_u64(&map->counters_.inserts);
+    stats->counters.insert_displacement = sm_atomic_load_u64(&map->counters_.insert_displacement);
+#endif
+    if(capacity <= 0) {
+        return;
+    }
+
+    uint64_t items = 0;
+    uint64_t total_displacement = 0;
+    uint64_t empty = capacity;
+    for(uint64_t i = 0; i < capacity; ++i) {
+        uint8_t ctrl = map->ctrl_[i];
+        if(SM_CTRL_EMPTY == ctrl) {
+            empty = i;
+            continue;
+        }
+        if(!SM_IS_FULL(ctrl)) {
+            continue;
+        }
+        uint64_t displacement;
+        if(NULL != map->dist_) {
+            displacement = map->dist_[i];
+        } else if(sm_is_readonly(map)) {
+            // Keys of a snapshot are serialized, so the hasher cannot find their homes
+            continue;
+        } else {
+            displacement = (i - SM_H1(sm_hash_stored(map, sm_key_at(map, i)))) & map->mask_;
+        }
+        ++stats->hit_probes[sm_stats_bucket(displacement)];
+        if(stats->max_displacement < displacement) {
+            stats->max_displacement = displacement;
+        }
+        total_displacement += displacement;
+        ++items;
+    }
+    stats->mean_displacement = (0 < items) ? (double)total_displacement / (double)items : 0.0;
+    if(capacity <= empty) {
+        // No slot has ever been empty, so every run is the whole buffer
+        stats->miss_probes[sm_stats_bucket(capacity)] = capacity;
+        stats->mean_miss_probe = (double)capacity;
+        stats->clusters = 1;
+        stats->max_cluster = capacity;
+        return;
+    }
+
+    // Walking backward from an empty slot, the run ahead of each slot is known when it is reached
+    uint64_t limit = sm_probe_limit(map);
+    uint64_t run = 0;
+    uint64_t total_miss = 0;
+    for(uint64_t n = 0; n < capacity; ++n) {
+        uint64_t i = (empty + capacity - n) & map->mask_;
+        if(SM_CTRL_EMPTY == map->ctrl_[i]) {
+            if(0 < run) {
+                ++stats->clusters;
+            }
+            run = 0;
+        } else {
+            ++run;
+            if(stats->max_cluster < run) {
+                stats->max_cluster = run;
+            }
+        }
+        uint64_t miss = (limit < run) ? limit : run;
+        ++stats->miss_probes[sm_stats_bucket(miss)];
+        total_miss += miss;
+    }
+    if(0 < run) {
+        ++stats->clusters;
+    }
+    stats->mean_miss_probe = (double)total_miss / (double)capacity;
+}
+
+/**
+ * @brief move an item of another map, it is destructed if its key is already in the map
+ */
+static void sm_merge_item(smallmap* map, smallmap* src, uint8_t* key, uint8_t* value)
+{
+    sm_string_query query;
+    const void* probe = sm_probe_stored(src, key, &query);
+    uint64_t hash = sm_hash_probe(map, probe);
+    if(SM_INVALID64 != sm_find_(map, hash, probe)) {
+        sm_destruct_item(src, key, value);
+        return;
+    }
+    sm_string_key* string_key = (sm_string_key*)key;
+    if(sm_is_string(map) && SM_STRING_INLINE <= string_key->length_) {
+        // The string moves to the arena of the map, then the key is moved as usual
+        sm_arena_append(map, string_key, query.data);
+    }
+    sm_move_item(map, hash, key, value);
+    ++map->size_;
+}
+
+/**
+ * @brief move all items in a buffer of another map, see sm_merge_item
+ */
+static void sm_merge_items(smallmap* map, smallmap* src, const uint8_t* ctrl, uint8_t* keys, uint8_t* values, uint64_t capacity)
+{
+    for(uint64_t i = 0; i < capacity; ++i) {
+        if(SM_IS_FULL(ctrl[i])) {
+            sm_merge_item(map, src, &keys[i * src->key_size_], &values[i * src->value_size_]);
+        }
+    }
+}
+
+bool sm_merge(smallmap* dst, smallmap* src)
+{
+    assert(NULL != dst);
+    assert(NULL != src);
+    assert(dst != src);
+    assert(dst->key_size_ == src->key_size_);
+    assert(dst->value_size_ == src->value_size_);
+    assert(sm_is_string(dst) == sm_is_string(src));
+    if(sm_is_readonly(dst) || sm_is_readonly(src)
+       || !sm_reserve64(dst, dst->size_ + src->size_)
+       || (sm_is_string(dst) && !sm_arena_reserve(dst, src->arena_size_))) {
+        return false;
+    }
+    if(NULL != dst->old_ctrl_) {
+        sm_migrate_(dst, dst->old_capacity_);
+    }
+    if(sm_is_dense(src)) {
+        for(uint64_t i = 0; i < src->size_; ++i) {
+            sm_merge_item(dst, src, sm_entry_key(src, i), sm_entry_value(src, i));
+        }
+    } else {
+        sm_merge_items(dst, src, src->ctrl_, src->keys_, src->values_, src->capacity_);
+    }
+    if(NULL != src->old_ctrl_) {
+        sm_merge_items(dst, src, src->old_ctrl_, src->old_keys_, src->old_values_, src->old_capacity_);
+        sm_release_old(src);
+    }
+    // Every item has been moved or destructed
+    sm_reset(src);
+    return true;
+}
+
+/**
+ * @brief remove an item in Robin Hood mode, following items are shifted back toward their homes
+ */
+static void sm_remove_robinhood(smallmap* map, uint64_t pos)
+{
+    sm_destruct_item(map, sm_key_at(map, pos), sm_value_at(map, pos));
+    uint64_t next = (pos + 1) & map->mask_;
+    while(SM_IS_FULL(map->ctrl_[next]) && 0 < map->dist_[next]) {
+        sm_relocate(map, sm_key_at(map, pos), sm_value_at(map, pos), sm_key_at(map, next), sm_value_at(map, next));
+        sm_set_ctrl(map, pos, map->ctrl_[next]);
+        map->dist_[pos] = map->dist_[next] - 1;
+        pos = next;
+        next = (next + 1) & map->mask_;
+    }
+    sm_set_ctrl(map, pos, SM_CTRL_EMPTY);
+    --map->size_;
+}
+
+/**
+ * @brief remove an item in the previous buffer while migrating
+ * @details the slot becomes a tombstone which is never reused, the buffer is released after migration
+ */
+static void sm_remove_old(smallmap* map, uint64_t pos)
+{
+    assert(SM_IS_FULL(map->old_ctrl_[pos]));
+    sm_ctrl_set(map->old_ctrl_, map->old_capacity_, pos, SM_CTRL_DELETED);
+    sm_destruct_item(map, map->old_keys_ + pos * map->key_size_, map->old_values_ + pos * map->value_size_);
+    --map->old_size_;
+    --map->size_;
+}
+
+/**
+ * @brief destruct the entry of a slot in dense mode, then the last entry moves into its place
+ */
+static void sm_dense_erase(smallmap* map, uint64_t pos)
+{
+    uint64_t entry = map->index_[pos];
+    uint64_t last = map->size_ - 1;
+    sm_destruct_item(map, sm_entry_key(map, entry), sm_entry_value(map, entry));
+    if(entry != last) {
+        sm_relocate(map, sm_entry_key(map, entry), sm_entry_value(map, entry), sm_entry_key(map, last), sm_entry_value(map, last));
+        uint32_t slot = map->entry_slots_[last];
+        map->index_[slot] = (uint32_t)entry;
+        map->entry_slots_[entry] = slot;
+    }
+}
+
+/**
+ * @brief remove an item in default mode
+ */
+static void sm_remove_linear(smallmap* map, uint64_t pos)
+{
+    assert(SM_IS_FULL(map->ctrl_[pos]));
+    if(SM_CTRL_EMPTY == map->ctrl_[(pos + 1) & map->mask_]) {
+        // Nothing probes past the next slot, so this slot and the tombstones just before it can be reused as empty
+        sm_set_ctrl(map, pos, SM_CTRL_EMPTY);
+        uint64_t prev = (pos - 1) & map->mask_;
+        while(SM_CTRL_DELETED == map->ctrl_[prev]) {
+            sm_set_ctrl(map, prev, SM_CTRL_EMPTY);
+            --map->deleted_;
+            prev = (prev - 1) & map->mask_;
+        }
+    } else {
+        sm_set_ctrl(map, pos, SM_CTRL_DELETED);
+        ++map->deleted_;
+    }
+    if(sm_is_dense(map)) {
+        sm_dense_erase(map, pos);
+    } else {
+        sm_destruct_item(map, sm_key_at(map, pos), sm_value_at(map, pos));
+    }
+    --map->size_;
+}
+
+void sm_remove_at(smallmap* map, uint32_t pos)
+{
+    assert(SM_INVALID != pos);
+    sm_remove_at64(map, pos);
+}
+
+void sm_remove_at64(smallmap* map, uint64_t pos)
+{
+    assert(NULL != map);
+    assert(SM_INVALID64 != pos);
+    if(sm_is_readonly(map)) {
+        return;
+    }
+    if(map->capacity_ <= pos) {
+        sm_remove_old(map, pos - map->capacity_);
+    } else if(sm_is_robinhood(map)) {
+        sm_remove_robinhood(map, pos);
+    } else {
+        sm_remove_linear(map, pos);
+    }
+    if(NULL != map->old_ctrl_) {
+        sm_migrate_(map, map->migrate_slots_);
+    }
+    if(map->size_ < map->shrink_threshold_ && SM_MIN_CAPACITY < map->capacity_ && NULL == map->old_ctrl_) {
+        // Shrinking is all at once even in incremental mode, it moves few items.
+        // A failure keeps the current buffer, and the next try waits for half the size
+        if(!sm_rehash(map, map->capacity_ >> 1, false)) {
+            map->shrink_threshold_ >>= 1;
+        }
+    }
+    // Churn at a steady size may never rehash, so removed strings are reclaimed once they outweigh live ones.
+    // Waiting for as many garbage bytes as slots keeps the scan of compaction amortized
+    if(map->capacity_ <= map->arena_garbage_ && map->arena_size_ < 2 * map->arena_garbage_) {
+        sm_arena_compact(map);
+    }
+}
+
+void sm_remove(smallmap* map, const void* key)
+{
+    assert(NULL != map);
+    assert(sm_valid_key(map, key));
+    uint64_t pos = sm_find64(map, key);
+    if(SM_INVALID64 == pos) {
+        return;
+    }
+    sm_remove_at64(map, pos);
+}
+
+void sm_remove_hashed(smallmap* map, uint64_t hash, const void* key)
+{
+    assert(NULL != map);
+    assert(sm_valid_key(map, key));
+    uint64_t pos = sm_find_hashed(map, hash, key);
+    if(SM_INVALID64 == pos) {
+        return;
+    }
+    sm_remove_at64(map, pos);
+}
+
+/**
+ * @struct sm_snapshot_header
+ * @brief the first bytes of a snapshot, offsets are from the beginning of the file
+ */
+typedef struct sm_snapshot_header_t
+{
+    char magic[8]; //!< "SMALLMAP"
+    uint32_t version; //!< SM_SNAPSHOT_VERSION
+    uint32_t byte_order; //!< SM_SNAPSHOT_BYTE_ORDER
+    uint32_t key_size; //!< key size in bytes
+    uint32_t value_size; //!< value size in bytes
+    uint32_t flags; //!< SM_FLAG_*
+    float max_load; //!< load factor of the saved map
+    uint64_t size; //!< number of items
+    uint64_t capacity; //!< number of slots
+    uint64_t max_dist; //!< upper bound of probe distances in Robin Hood mode
+    uint64_t ctrl_offset; //!< capacity control bytes, then SM_SNAPSHOT_CLONE cloned bytes
+    uint64_t dist_offset; //!< capacity probe distances in Robin Hood mode
+    uint64_t keys_offset; //!< capacity keys, empty slots are zero
+    uint64_t values_offset; //!< capacity values, empty slots are zero
+    uint64_t data_offset; //!< data written by sm_save_data
+    uint64_t data_size; //!< size of data
+} sm_snapshot_header;
+
+static const char sm_snapshot_magic[8] = {'S', 'M', 'A', 'L', 'L', 'M', 'A', 'P'};
+
+/**
+ * @struct sm_save_context
+ * @brief data which serialized keys refer to, kept in memory until keys and values are written
+ */
+struct sm_save_context_t
+{
+    smallmap* map;
+    uint8_t* data; //!< buffer of data
+    uint64_t data_size; //!< used bytes of data
+    uint64_t data_capacity; //!< allocated bytes of data
+    uint64_t data_offset; //!< file offset of data
+    uint64_t key_offset; //!< file offset of the key being serialized
+    bool failed; //!< true if cannot allocate
+};
+
+int64_t sm_save_data(sm_save_context* context, const void* data, size_t size)
+{
+    assert(NULL != context);
+    assert(NULL != data || size <= 0);
+    uint64_t begin = (context->data_size + 7) & ~7ULL;
+    if(context->data_capacity < begin + size) {
+        uint64_t capacity = (0 < context->data_capacity) ? context->data_capacity : 4096;
+        while(capacity < begin + size) {
+            capacity <<= 1;
+        }
+        uint8_t* buffer = (uint8_t*)sm_alloc(context->map, capacity, SM_ALLOC_ALIGN);
+        if(NULL == buffer) {
+            context->failed = true;
+            return 0;
+        }
+        if(0 < context->data_size) {
+            memcpy(buffer, context->data, context->data_size);
+        }
+        sm_dealloc(context->map, context->data, context->data_capacity);
+        context->data = buffer;
+        context->data_capacity = capacity;
+    }
+    memset(context->data + context->data_size, 0, begin - context->data_size);
+    if(0 < size) {
+        memcpy(context->data + begin, data, size);
+    }
+    context->data_size = begin + size;
+    return (int64_t)(context->data_offset + begin) - (int64_t)context->key_offset;
+}
+
+/**
+ * @brief write bytes, and advance the file position
+ */
+static bool sm_save_write(FILE* file, uint64_t* position, const void* data, size_t size)
+{
+    *position += size;
+    return size == fwrite(data, 1, size, file);
+}
+
+/**
+ * @brief write zeros up to the offset
+ */
+static bool sm_save_pad(FILE* file, uint64_t* position, uint64_t offset)
+{
+    static const uint8_t zeros[64] = {0};
+    while(*position < offset) {
+        size_t size = (offset - *position < sizeof(zeros)) ? (size_t)(offset - *position) : sizeof(zeros);
+        if(!sm_save_write(file, position, zeros, size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief write keys or values of all slots by chunks, empty slots are zero
+ * @details a dense map is written in the layout of the default mode, gathering its entries through the index
+ * @param [in] keys ... true for keys, false for values
+ * @param [in] context ... serialize keys if not NULL
+ */
+static bool sm_save_items(
+    const smallmap* map,
+    FILE* file,
+    uint64_t* position,
+    uint8_t* chunk,
+    bool keys,
+    bool (*serialize)(void*, sm_save_context*, void*, const void*),
+    void* user,
+    sm_save_context* context)
+{
+    uint32_t item_size = keys ? map->key_size_ : map->value_size_;
+    if(item_size <= 0) {
+        // Zero-size items, such as values of a set, have no bytes to write
+        return true;
+    }
+    uint64_t chunk_slots = (item_size < SM_SNAPSHOT_CHUNK) ? SM_SNAPSHOT_CHUNK / item_size : 1;
+    for(uint64_t i = 0; i < map->capacity_; i += chunk_slots) {
+        uint64_t count = (map->capacity_ - i < chunk_slots) ? map->capacity_ - i : chunk_slots;
+        if(!sm_is_dense(map)) {
+            memcpy(chunk, (keys ? map->keys_ : map->values_) + i * item_size, count * item_size);
+        }
+        for(uint64_t j = 0; j < count; ++j) {
+            uint8_t* item = chunk + j * item_size;
+            if(!SM_IS_FULL(map->ctrl_[i + j])) {
+                memset(item, 0, item_size);
+                continue;
+            }
+            const uint8_t* src = keys ? sm_key_at(map, i + j) : sm_value_at(map, i + j);
+            if(sm_is_dense(map)) {
+                memcpy(item, src, item_size);
+            }
+            if(NULL != serialize) {
+                context->key_offset = *position + j * item_size;
+                if(!serialize(user, context, item, src) || context->failed) {
+                    return false;
+                }
+            }
+        }
+        if(!sm_save_write(file, position, chunk, count * item_size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool sm_save(smallmap* map, const char* path, bool (*key_serialize)(void*, sm_save_context*, void*, const void*), void* user)
+{
+    assert(NULL != map);
+    assert(NULL != path);
+    if(sm_is_readonly(map)) {
+        return false;
+    }
+    if(NULL != map->old_ctrl_) {
+        sm_migrate_(map, map->old_capacity_);
+    }
+    sm_snapshot_header header;
+    memset(&header, 0, sizeof(sm_snapshot_header));
+    memcpy(header.magic, sm_snapshot_magic, sizeof(header.magic));
+    header.version = SM_SNAPSHOT_VERSION;
+    header.byte_order = SM_SNAPSHOT_BYTE_ORDER;
+    header.key_size = map->key_size_;
+    header.value_size = map->value_size_;
+    header.flags = map->flags_ & ~SM_FLAG_DENSE;
+    header.max_load = map->max_load_;
+    header.size = map->size_;
+    header.capacity = map->capacity_;
+    header.max_dist = map->max_dist_;
+    header.ctrl_offset = SM_SNAPSHOT_ALIGN(sizeof(sm_snapshot_header));
+    header.dist_offset = SM_SNAPSHOT_ALIGN(header.ctrl_offset + map->capacity_ + SM_SNAPSHOT_CLONE);
+    header.keys_offset = SM_SNAPSHOT_ALIGN(header.dist_offset + (sm_is_robinhood(map) ? map->capacity_ : 0));
+    header.values_offset = SM_SNAPSHOT_ALIGN(header.keys_offset + map->capacity_ * map->key_size_);
+    header.data_offset = SM_SNAPSHOT_ALIGN(header.values_offset + map->capacity_ * map->value_size_);
+
+    sm_save_context context;
+    memset(&context, 0, sizeof(sm_save_context));
+    context.map = map;
+    context.data_offset = header.data_offset;
+    const void* data = NULL;
+    if(sm_is_string(map)) {
+        // Stored keys refer to the arena by offsets, so they are saved as they are and the arena is the data
+        key_serialize = NULL;
+        data = map->arena_;
+        context.data_size = map->arena_size_;
+    }
+    uint32_t item_size = (map->key_size_ < map->value_size_) ? map->value_size_ : map->key_size_;
+    size_t chunk_size = (item_size < SM_SNAPSHOT_CHUNK) ? SM_SNAPSHOT_CHUNK : item_size;
+    uint8_t* chunk = (uint8_t*)sm_alloc(map, chunk_size, SM_ALLOC_ALIGN);
+    FILE* file = (NULL != chunk) ? fopen(path, "wb") : NULL;
+    if(NULL == file) {
+        sm_dealloc(map, chunk, chunk_size);
+        return false;
+    }
+    uint8_t clone[SM_SNAPSHOT_CLONE];
+    for(uint32_t i = 0; i < SM_SNAPSHOT_CLONE; ++i) {
+        clone[i] = map->ctrl_[i & map->mask_];
+    }
+    // The header is written last, so that a partial file is never taken as a snapshot
+    uint64_t position = 0;
+    bool result = sm_save_pad(file, &position, header.ctrl_offset)
+                  && sm_save_write(file, &position, map->ctrl_, map->capacity_)
+                  && sm_save_write(file, &position, clone, SM_SNAPSHOT_CLONE)
+                  && sm_save_pad(file, &position, header.dist_offset)
+                  && (!sm_is_robinhood(map) || sm_save_write(file, &position, map->dist_, map->capacity_))
+                  && sm_save_pad(file, &position, header.keys_offset)
+                  && sm_save_items(map, file, &position, chunk, true, key_serialize, user, &context)
+                  && sm_save_pad(file, &position, header.values_offset)
+                  && sm_save_items(map, file, &position, chunk, false, NULL, NULL, NULL)
+                  && sm_save_pad(file, &position, header.data_offset)
+                  && (context.data_size <= 0 || sm_save_write(file, &position, (NULL != data) ? data : context.data, context.data_size));
+    header.data_size = context.data_size;
+    result = result && 0 == fseek(file, 0, SEEK_SET) && sm_save_write(file, &position, &header, sizeof(sm_snapshot_header));
+    result = (0 == fclose(file)) && result;
+    sm_dealloc(map, context.data, context.data_capacity);
+    sm_dealloc(map, chunk, chunk_size);
+    if(!result) {
+        remove(path);
+    }
+    return result;
+}
+
+/**
+ * @brief map a whole file read-only
+ * @return NULL if cannot open or map
+ */
+static void* sm_map_file(const char* path, size_t* size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(INVALID_HANDLE_VALUE == file) {
+        return NULL;
+    }
+    LARGE_INTEGER file_size;
+    if(!GetFileSizeEx(file, &file_size) || file_size.QuadPart <= 0) {
+        CloseHandle(file);
+        return NULL;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if(NULL == mapping) {
+        return NULL;
+    }
+    void* base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    *size = (size_t)file_size.QuadPart;
+    return base;
+#else
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if(0 != fstat(fd, &st) || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    void* base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(MAP_FAILED == base) {
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+    return base;
+#endif
+}
+
+static void sm_unmap_file(void* base, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(base);
+#else
+    munmap(base, size);
+#endif
+}
+
+/**
+ * @brief check that a section lies in the file
+ */
+static inline bool sm_snapshot_in(uint64_t offset, uint64_t size, uint64_t file_size)
+{
+    return offset <= file_size && size <= file_size - offset;
+}
+
+/**
+ * @brief check a header before using the sections which it points to
+ */
+static bool sm_snapshot_validate(const sm_snapshot_header* header, const sm_desc* desc, uint64_t file_size)
+{
+    bool string = 0 != (desc->flags & SM_FLAG_STRING);
+    uint32_t key_size = string ? (uint32_t)sizeof(sm_string_key) : desc->key_size;
+    if(0 != memcmp(header->magic, sm_snapshot_magic, sizeof(header->magic))
+       || SM_SNAPSHOT_VERSION != header->version
+       || SM_SNAPSHOT_BYTE_ORDER != header->byte_order
+       || key_size != header->key_size
+       || desc->value_size != header->value_size
+       || string != (0 != (header->flags & SM_FLAG_STRING))
+       || (desc->flags & SM_FLAG_WIDE) != (header->flags & SM_FLAG_WIDE)
+       || 0 != (header->flags & ~(SM_FLAG_ROBINHOOD | SM_FLAG_INCREMENTAL | SM_FLAG_STRING | SM_FLAG_WIDE))
+       || (string && UINT32_MAX < header->data_size)) {
+        return false;
+    }
+    uint64_t capacity = header->capacity;
+    uint64_t limit = (0 != (header->flags & SM_FLAG_WIDE)) ? SM_WIDE_MAX_CAPACITY : SM_INVALID;
+    if(capacity <= 0 || 0 != (capacity & (capacity - 1)) || limit <= capacity || capacity < header->size) {
+        return false;
+    }
+    bool robinhood = 0 != (header->flags & SM_FLAG_ROBINHOOD);
+    if(robinhood && SM_RH_DIST_LIMIT < header->max_dist) {
+        return false;
+    }
+    return sm_snapshot_in(header->ctrl_offset, capacity + SM_SNAPSHOT_CLONE, file_size)
+           && sm_snapshot_in(header->dist_offset, robinhood ? capacity : 0, file_size)
+           && sm_snapshot_in(header->keys_offset, capacity * header->key_size, file_size)
+           && sm_snapshot_in(header->values_offset, capacity * header->value_size, file_size)
+           && sm_snapshot_in(header->data_offset, header->data_size, file_size);
+}
+
+smallmap* sm_open_mmap(const char* path, const sm_desc* desc)
+{
+    assert(NULL != path);
+    assert(NULL != desc);
+    assert(0 != (desc->flags & (SM_FLAG_STRING | SM_FLAG_WIDE)) || NULL != desc->hasher);
+    assert(0 != (desc->flags & SM_FLAG_STRING) || 0 == (desc->flags & SM_FLAG_WIDE) || NULL != desc->hasher64);
+    assert(0 != (desc->flags & SM_FLAG_STRING) || NULL != desc->compare);
+    sm_legacy_allocator legacy;
+    sm_allocator allocator = sm_allocator_resolve(desc, &legacy);
+    size_t size = 0;
+    uint8_t* base = (uint8_t*)sm_map_file(path, &size);
+    if(NULL == base) {
+        return NULL;
+    }
+    const sm_snapshot_header* header = (const sm_snapshot_header*)base;
+    smallmap* map = NULL;
+    if(sizeof(sm_snapshot_header) <= size && sm_snapshot_validate(header, desc, size)) {
+        map = (smallmap*)allocator.alloc(allocator.ctx, sizeof(smallmap), SM_ALLOC_ALIGN);
+    }
+    if(NULL == map) {
+        sm_unmap_file(base, size);
+        return NULL;
+    }
+    memset(map, 0, sizeof(smallmap));
+    map->allocator_ = allocator;
+    map->legacy_ = legacy;
+    sm_allocator_rebind(&map->allocator_, &map->legacy_);
+    map->alloc_size_ = sizeof(smallmap);
+    map->key_size_ = header->key_size;
+    map->value_size_ = header->value_size;
+    map->flags_ = header->flags;
+    map->max_load_ = header->max_load;
+    map->size_ = header->size;
+    map->capacity_ = header->capacity;
+    map->mask_ = header->capacity - 1;
+    map->resize_threshold_ = header->size;
+    map->max_dist_ = header->max_dist;
+    // The mapping is read-only, buffers are never written through these pointers
+    map->ctrl_ = base + header->ctrl_offset;
+    map->dist_ = (0 != (header->flags & SM_FLAG_ROBINHOOD)) ? base + header->dist_offset : NULL;
+    map->keys_ = base + header->keys_offset;
+    map->values_ = base + header->values_offset;
+    if(0 != (header->flags & SM_FLAG_STRING)) {
+        map->arena_ = base + header->data_offset;
+        map->arena_size_ = (uint32_t)header->data_size;
+        map->arena_capacity_ = (uint32_t)header->data_size;
+    }
+    map->hasher_ = desc->hasher;
+    map->hasher64_ = desc->hasher64;
+    map->compare_ = desc->compare;
+    map->mapping_ = base;
+    map->mapping_size_ = size;
+    return map;
+}
+
+static inline size_t sm_hugepage_threshold(const void* ctx)
+{
+    return (NULL != ctx) ? *(const size_t*)ctx : SM_HUGEPAGE_SIZE;
+}
+
+void* sm_hugepage_alloc(void* ctx, size_t size, size_t align)
+{
+    assert(0 < align && 0 == (align & (align - 1)));
+    if(size < sm_hugepage_threshold(ctx)) {
+        align = (align < sizeof(void*)) ? sizeof(void*) : align;
+#ifdef _WIN32
+        return _aligned_malloc(size, align);
+#else
+        void* ptr = NULL;
+        return (0 == posix_memalign(&ptr, align, size)) ? ptr : NULL;
+#endif
+    }
+    assert(align <= SM_HUGEPAGE_SIZE);
+    if(SIZE_MAX - SM_HUGEPAGE_SIZE < size) {
+        return NULL;
+    }
+    size_t length = (size + SM_HUGEPAGE_SIZE - 1) & ~(SM_HUGEPAGE_SIZE - 1);
+#ifdef _WIN32
+    // Large pages need SeLockMemoryPrivilege, normal pages are used without it
+    size_t large = GetLargePageMinimum();
+    void* ptr = NULL;
+    if(0 < large && 0 == (length & (large - 1))) {
+        ptr = VirtualAlloc(NULL, length, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    }
+    if(NULL == ptr) {
+        ptr = VirtualAlloc(NULL, length, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+    return ptr;
+#else
+    // Over-map by a huge page, then trim both ends so that the block starts on a huge page boundary
+    size_t mapped = length + SM_HUGEPAGE_SIZE;
+    uint8_t* base = (uint8_t*)mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(MAP_FAILED == (void*)base) {
+        return NULL;
+    }
+    uint8_t* ptr = (uint8_t*)(((uintptr_t)base + SM_HUGEPAGE_SIZE - 1) & ~(uintptr_t)(SM_HUGEPAGE_SIZE - 1));
+    if(base < ptr) {
+        munmap(base, (size_t)(ptr - base));
+    }
+    if(ptr + length < base + mapped) {
+        munmap(ptr + length, (size_t)(base + mapped - (ptr + length)));
+    }
+#    ifdef MADV_HUGEPAGE
+    madvise(ptr, length, MADV_HUGEPAGE);
+#    endif
+    return ptr;
+#endif
+}
+
+void sm_hugepage_dealloc(void* ctx, void* ptr, size_t size)
+{
+    if(NULL == ptr) {
+        return;
+    }
+    if(size < sm_hugepage_threshold(ctx)) {
+#ifdef _WIN32
+        _aligned_free(ptr);
+#else
+        free(ptr);
+#endif
+        return;
+    }
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, (size + SM_HUGEPAGE_SIZE - 1) & ~(SM_HUGEPAGE_SIZE - 1));
+#endif
+}
+
+sm_allocator sm_hugepage_allocator(const size_t* threshold)
+{
+    sm_allocator allocator;
+    allocator.ctx = (void*)threshold;
+    allocator.alloc = sm_hugepage_alloc;
+    allocator.dealloc = sm_hugepage_dealloc;
+    return allocator;
 }
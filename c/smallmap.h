@@ -6,20 +6,137 @@
 
 struct smallmap_t;
 typedef struct smallmap_t smallmap;
+struct sm_save_context_t;
+typedef struct sm_save_context_t sm_save_context;
 #define SM_INVALID (0xFFFFFFFFUL) //!< Invalid ID
+#define SM_INVALID64 (0xFFFFFFFFFFFFFFFFULL) //!< Invalid ID of the 64-bit API
+
+#define SM_FLAG_ROBINHOOD (0x1U) //!< Robin Hood insertion, removal shifts later items back instead of leaving tombstones
+#define SM_FLAG_INCREMENTAL (0x2U) //!< expanding migrates items a few slots per sm_add/sm_remove instead of all at once, not with SM_FLAG_ROBINHOOD
+#define SM_FLAG_WIDE (0x8U) //!< 64-bit hashes from hasher64, and more than 2^31 slots. Positions can exceed SM_INVALID, use sm_find64 and sm_remove_at64
+#define SM_FLAG_STRING (0x4U) //!< keys are NUL-terminated strings copied into an arena of the map, key arguments are the strings themselves. key_size, the key callbacks, hasher and compare are not used
+#define SM_FLAG_DENSE (0x10U) //!< keys and values packed in insertion order behind an index of slots, a removal moves the last item into its place. Not with SM_FLAG_ROBINHOOD, SM_FLAG_INCREMENTAL or SM_FLAG_WIDE, and rehashing is serial
+
+#define SM_HUGEPAGE_SIZE (0x200000UL) //!< size of a huge page, and the default threshold of sm_hugepage_alloc
+
+/**
+ * @struct sm_allocator
+ * @brief a stateful allocator, a map gives back each block with the size which it asked for
+ */
+typedef struct sm_allocator_t
+{
+    void* ctx; //!< the first argument of alloc and dealloc
+    void* (*alloc)(void*, size_t, size_t); //!< alloc(ctx, size, align) with align a power of two, NULL if cannot allocate
+    void (*dealloc)(void*, void*, size_t); //!< dealloc(ctx, ptr, size) with the size passed to alloc
+} sm_allocator;
+
+#define SM_STATS_BUCKETS (16U) //!< buckets of a probe length histogram, bucket 0 is 0 and bucket i is [2^(i-1), 2^i), the last one takes the rest
+
+/**
+ * @struct sm_counters
+ * @brief hot path counters, which count only if the library is built with SM_STATS_COUNTERS
+ * @details lookups bump them through a const map with relaxed atomic adds, so concurrent readers count exactly, at the cost
+ * of a locked add per count. They are never reset.
+ */
+typedef struct sm_counters_t
+{
+    uint64_t lookups; //!< lookups by key, including the duplicate checks of adding and building
+    uint64_t lookup_groups; //!< groups of control bytes scanned by lookups
+    uint64_t compares; //!< calls to compare, or string comparisons in string mode
+    uint64_t inserts; //!< items constructed in the map
+    uint64_t insert_displacement; //!< total distance from home of inserted items
+} sm_counters;
+
+/**
+ * @struct sm_statistics
+ * @brief a snapshot of the shape of a map, see sm_stats
+ */
+typedef struct sm_statistics_t
+{
+    uint64_t size; //!< number of items
+    uint64_t capacity; //!< number of slots of the current buffer
+    uint64_t deleted; //!< number of tombstones
+    float load_factor; //!< items in the current buffer over capacity
+    float max_load; //!< load factor which triggers expanding
+    uint64_t hit_probes[SM_STATS_BUCKETS]; //!< items by distance from home, which is the probe length of a hit
+    uint64_t miss_probes[SM_STATS_BUCKETS]; //!< homes by occupied slots before the first empty one, which is the probe length of a miss
+    uint64_t max_displacement; //!< the largest distance from home
+    double mean_displacement; //!< mean distance from home of items
+    double mean_miss_probe; //!< mean probe length of a miss over all homes
+    uint64_t clusters; //!< runs of occupied slots, tombstones included
+    uint64_t max_cluster; //!< slots of the longest run
+    uint64_t resizes; //!< buffers allocated by expanding, reserving and purging tombstones
+    uint64_t resize_ns; //!< time spent in them in nanoseconds, migration in incremental mode is not included
+    size_t ctrl_bytes; //!< bytes of control bytes, and of probe distances in Robin Hood mode, or of the index and slots of entries in dense mode
+    size_t key_bytes; //!< bytes of the key buffer
+    size_t value_bytes; //!< bytes of the value buffer
+    size_t arena_bytes; //!< bytes of the string arena
+    size_t old_bytes; //!< bytes of the previous buffer while migrating
+    uint64_t old_size; //!< items left in the previous buffer
+    sm_counters counters; //!< zero unless built with SM_STATS_COUNTERS
+} sm_statistics;
+
+/**
+ * @struct sm_iter
+ * @brief a cursor over the items of a map, see sm_iter_begin and sm_iter_range
+ * @details slots of the previous buffer in incremental mode follow the slots of the current one.
+ * In dense mode, the cursor walks the packed entries instead of slots
+ */
+typedef struct sm_iter_t
+{
+    const void* key; //!< the stored key of the current item, in place
+    const void* value; //!< the value of the current item, in place
+    uint64_t position; //!< the slot of the current item, as returned by sm_find64
+    uint64_t next_; //!< the first slot not scanned yet
+    uint64_t end_; //!< the end of the range of slots
+    uint64_t mask_; //!< full slots of the last scanned group which are not returned yet
+    uint64_t group_; //!< the first slot of the last scanned group
+} sm_iter;
+
+/**
+ * @struct sm_desc
+ * @brief parameters to construct a map, see sm_construct for the callbacks
+ * @details with rehash_threads, key_move, value_move and the destructors are called from several threads at once
+ * on distinct items while rehashing, and so is hasher. Robin Hood mode always rehashes serially.
+ * Plain data needs no callbacks, with all of them NULL rehashing copies bytes and destruction just frees the buffers.
+ */
+typedef struct sm_desc_t
+{
+    uint32_t key_size; //!< size of key in bytes
+    uint32_t value_size; //!< size of value in bytes
+    uint32_t flags; //!< combination of SM_FLAG_*
+    float max_load; //!< load factor which triggers expanding, 0 means the default 0.7
+    float min_load; //!< load factor under which a removal halves the capacity, 0 means never. Up to a quarter of max_load, so that halving and doubling do not alternate
+    uint32_t migrate_slots; //!< slots migrated per sm_add/sm_remove in incremental mode, 0 means the default 64
+    uint32_t rehash_threads; //!< number of tasks which rehashing a large buffer is split into, up to 64. 0 or 1 means serial
+    void (*rehash_spawn)(void*, void (*)(void*, uint32_t), void*, uint32_t); //!< run task(arg, i) for each i < count, and wait for all. NULL means starting threads
+    void* rehash_user; //!< the first argument of rehash_spawn
+    bool (*key_constructor)(smallmap*, void*, const void*);
+    void (*key_move)(smallmap*, void*, const void*);
+    void (*key_destructor)(smallmap*, void*);
+    bool (*value_constructor)(smallmap*, void*, const void*);
+    void (*value_move)(smallmap*, void*, const void*);
+    void (*value_destructor)(smallmap*, void*);
+    uint32_t (*hasher)(const void*);
+    uint64_t (*hasher64)(const void*); //!< hasher in wide mode, which takes the same arguments
+    bool (*compare)(const void*, const void*);
+    void* (*allocate)(size_t); //!< malloc-like, ignored if allocator.alloc is set
+    void (*deallocate)(void*); //!< free-like, ignored if allocator.alloc is set
+    sm_allocator allocator; //!< used instead of allocate and deallocate if alloc is not NULL
+} sm_desc;
 
 /**
  * @brief construct a map context
  * @param [in] key_size ... size of key in bytes
  * @param [in] value_size ... size of value in bytes
- * @param [in] key_constructor ...
- * @param [in] key_move ...
- * @param [in] key_destructor ...
- * @param [in] value_constructor ...
- * @param [in] value_move ...
- * @param [in] value_destructor ...
- * @param [in] hasher ...
- * @param [in] compare ...
+ * @param [in] key_constructor ... NULL copies key_size bytes from the address of the key argument, up to the size of a pointer. The key argument may be NULL then
+ * @param [in] key_move ... NULL copies the bytes, and the moved-from key is not destructed
+ * @param [in] key_destructor ... NULL does nothing
+ * @param [in] value_constructor ... NULL copies value_size bytes from the value argument
+ * @param [in] value_move ... NULL copies the bytes, and the moved-from value is not destructed
+ * @param [in] value_destructor ... NULL does nothing
+ * @param [in] hasher ... hash of a stored key, the map also passes the address of the key argument of sm_find and so on
+ * @param [in] compare ... compare a stored key with the address of a key argument
  * @param [in] allocate ...
  * @param [in] deallocate ...
  */
@@ -37,6 +154,13 @@ smallmap* sm_construct(
         void*(*allocate)(size_t),
         void(*deallocate)(void*));
 
+/**
+ * @brief construct a map context with extra parameters
+ * @return NULL if cannot allocate, or the flags cannot be combined
+ * @param [in] desc ... parameters, Robin Hood mode works well with max_load up to 0.9
+ */
+smallmap* sm_construct_desc(const sm_desc* desc);
+
 /**
  * @brief destruct a map context
  */
@@ -44,6 +168,7 @@ void sm_destruct(smallmap* map);
 
 /**
  * @brief allocate memory with the map's allocator
+ * @details with sm_desc.allocator, the size is kept in front of the block for sm_deallocate
  * @param [in] map ... the owner of allocator
  * @param [in] size ... size of allocation
  */
@@ -56,6 +181,20 @@ void* sm_allocate(smallmap* map, size_t size);
  */
 void sm_deallocate(smallmap* map, void* ptr);
 
+/**
+ * @brief number of items
+ */
+uint64_t sm_size(const smallmap* map);
+
+/**
+ * @brief hash of a key, which the *_hashed functions take instead of hashing the key again
+ * @details the hash depends only on the hasher, or on string mode, so it can be computed on any thread
+ * and passed to any map which is constructed with the same hasher. A 32-bit hash is spread over 64 bits.
+ * @param [in] map ... a map context
+ * @param [in] key ... a target key
+ */
+uint64_t sm_hash(const smallmap* map, const void* key);
+
 /**
  * @brief find an item
  * @return position of the found item, SM_INVALID if cannot find
@@ -64,6 +203,22 @@ void sm_deallocate(smallmap* map, void* ptr);
  */
 uint32_t sm_find(const smallmap* map, const void* key);
 
+/**
+ * @brief find an item, with a position which can exceed SM_INVALID in wide mode
+ * @return position of the found item, SM_INVALID64 if cannot find
+ * @param [in] map ... a map context
+ * @param [in] key ... a target key
+ */
+uint64_t sm_find64(const smallmap* map, const void* key);
+
+/**
+ * @brief find an item with its hash, see sm_find64
+ * @param [in] map ... a map context
+ * @param [in] hash ... sm_hash of the key, a different value is undefined behavior
+ * @param [in] key ... a target key
+ */
+uint64_t sm_find_hashed(const smallmap* map, uint64_t hash, const void* key);
+
 /**
  * @brief find an item
  * @return true if can find
@@ -73,6 +228,31 @@ uint32_t sm_find(const smallmap* map, const void* key);
  */
 bool sm_try_get(const smallmap* map, const void* key, void* value);
 
+/**
+ * @brief find an item with its hash, see sm_try_get and sm_find_hashed
+ */
+bool sm_try_get_hashed(const smallmap* map, uint64_t hash, const void* key, void* value);
+
+/**
+ * @brief find many items, hashing and prefetching keys ahead so that their cache misses overlap
+ * @param [in] map ... a map context
+ * @param [in] keys ... target keys
+ * @param [in] count ... number of keys
+ * @param [out] positions ... position of each item, SM_INVALID if cannot find
+ */
+void sm_find_batch(const smallmap* map, const void* const* keys, uint32_t count, uint32_t* positions);
+
+/**
+ * @brief find many items, and copy their values
+ * @return number of found items
+ * @param [in] map ... a map context
+ * @param [in] keys ... target keys
+ * @param [in] count ... number of keys
+ * @param [out] values ... count values packed by value size, only found ones are written
+ * @param [out] found ... whether each item is found
+ */
+uint32_t sm_try_get_batch(const smallmap* map, const void* const* keys, uint32_t count, void* values, bool* found);
+
 /**
  * @brief add an item to a map
  * @return result of adding
@@ -82,17 +262,240 @@ bool sm_try_get(const smallmap* map, const void* key, void* value);
  */
 bool sm_add(smallmap* map, const void* key, const void* value);
 
+/**
+ * @brief add an item with its hash, see sm_add and sm_find_hashed
+ */
+bool sm_add_hashed(smallmap* map, uint64_t hash, const void* key, const void* value);
+
+/**
+ * @brief find an item, and point its value in place
+ * @details the pointer is valid until the map is modified. Do not write through it for a map opened by sm_open_mmap
+ * @return the value, NULL if cannot find
+ * @param [in] map ... a map context
+ * @param [in] key ... a target key
+ */
+void* sm_get_ptr(smallmap* map, const void* key);
+
+/**
+ * @brief find an item, or add it with the value if absent, then point its value in place
+ * @details a single probe serves both the lookup and the insertion unless the map expands, or in Robin Hood mode.
+ * The pointer is valid until the map is modified, so that an update such as a counter needs no copy and no second lookup
+ * @return the value, NULL if cannot add
+ * @param [in] map ... a map context
+ * @param [in] key ... a target key
+ * @param [in] value ... the initial value of an added item
+ * @param [out] inserted ... true if the item is added, can be NULL
+ */
+void* sm_find_or_insert(smallmap* map, const void* key, const void* value, bool* inserted);
+
+/**
+ * @brief make room so that the map holds size items without expanding
+ * @return false if cannot allocate, the map is unchanged
+ * @param [in] map ... a map context
+ * @param [in] size ... number of items
+ */
+bool sm_reserve(smallmap* map, uint32_t size);
+
+/**
+ * @brief make room for size items, which can exceed 32 bits in wide mode, see sm_reserve
+ */
+bool sm_reserve64(smallmap* map, uint64_t size);
+
+/**
+ * @brief rebuild with the least capacity which holds the items, dropping tombstones and finishing migration
+ * @details in Robin Hood mode, a capacity whose distances would exceed the limit is skipped for a larger one
+ * @return false if cannot allocate, the map is unchanged then
+ * @param [in] map ... a map context
+ */
+bool sm_shrink_to_fit(smallmap* map);
+
+/**
+ * @brief remove all items
+ * @param [in] map ... a map context
+ * @param [in] keep_memory ... true to keep the buffers for reuse, false to go back to the capacity of a new map
+ */
+void sm_clear(smallmap* map, bool keep_memory);
+
+/**
+ * @brief add many items at once
+ * @details the buffer is sized once for all items, then keys are hashed ahead and each item is added by a single probe.
+ * A key which is already in the map, or appears earlier in keys, is skipped.
+ * @return number of added items, adding stops at the first failure
+ * @param [in] map ... a map context
+ * @param [in] keys ... keys to add
+ * @param [in] values ... count values packed by value size
+ * @param [in] count ... number of items
+ */
+uint32_t sm_build(smallmap* map, const void* const* keys, const void* values, uint32_t count);
+
+/**
+ * @brief add many items with their hashes, see sm_build and sm_find_hashed
+ * @param [in] hashes ... sm_hash of each key, a different value is undefined behavior
+ */
+uint32_t sm_build_hashed(smallmap* map, const uint64_t* hashes, const void* const* keys, const void* values, uint32_t count);
+
+/**
+ * @brief migrate items left in the previous buffer in incremental mode, for example while idle
+ * @return true if no migration is left
+ * @param [in] map ... a map context
+ * @param [in] slots ... number of slots to migrate
+ */
+bool sm_migrate(smallmap* map, uint32_t slots);
+
+/**
+ * @brief call fn for each item until it returns false
+ * @details the map must not be modified during the call
+ * @return false if fn stopped
+ * @param [in] map ... a map context
+ * @param [in] fn ... called with ctx, a stored key and its value
+ * @param [in] ctx ... passed to fn
+ */
+bool sm_for_each(const smallmap* map, bool (*fn)(void*, const void*, const void*), void* ctx);
+
+/**
+ * @brief number of slots to iterate, the current buffer and the previous one in incremental mode, or the items in dense mode
+ * @details split [0, sm_slot_count) into disjoint ranges to scan a map from several threads at once
+ * @param [in] map ... a map context
+ */
+uint64_t sm_slot_count(const smallmap* map);
+
+/**
+ * @brief start iterating all items
+ * @param [in] map ... a map context
+ * @param [out] iter ... a cursor
+ */
+void sm_iter_begin(const smallmap* map, sm_iter* iter);
+
+/**
+ * @brief start iterating the items in slots [begin, end)
+ * @details end is clamped to sm_slot_count. The map must not be modified while iterating,
+ * but cursors over the same map can be used from several threads
+ * @param [in] map ... a map context
+ * @param [out] iter ... a cursor
+ * @param [in] begin ... the first slot
+ * @param [in] end ... the end of slots
+ */
+void sm_iter_range(const smallmap* map, sm_iter* iter, uint64_t begin, uint64_t end);
+
+/**
+ * @brief move to the next item, then key, value and position of the cursor point it
+ * @return false if no item is left
+ * @param [in] map ... the map of the cursor
+ * @param [in,out] iter ... a cursor
+ */
+bool sm_iter_next(const smallmap* map, sm_iter* iter);
+
+/**
+ * @brief the string of a stored key in string mode, such as a key passed to the callback of sm_for_each
+ * @details it is valid until the map is modified
+ * @param [in] map ... a map context
+ * @param [in] key ... a stored key
+ */
+const char* sm_key_string(const smallmap* map, const void* key);
+
+/**
+ * @brief measure a map, for spotting a bad hasher or clustering
+ * @details every slot of the current buffer is visited and every item is hashed again, so it costs as much as iterating.
+ * Probe lengths count slots and are measured in the current buffer only.
+ * Keys of a map opened by sm_open_mmap are serialized and not hashed, so only its Robin Hood distances give hit probes.
+ * @param [in] map ... a map context
+ * @param [out] stats ... the result
+ */
+void sm_stats(const smallmap* map, sm_statistics* stats);
+
+/**
+ * @brief move all items of a map to another map, then src is left empty
+ * @details both maps must be constructed with the same sizes, hasher and compare.
+ * Items are relocated with dst's move callbacks, so memory which they own must be releasable by dst.
+ * An item whose key is already in dst is destructed, and dst keeps its own.
+ * @return false if cannot allocate, both maps are unchanged
+ * @param [in] dst ... a map to add items to
+ * @param [in] src ... a map to take items from
+ */
+bool sm_merge(smallmap* dst, smallmap* src);
+
 /**
  * @brief remove an item from a map
+ * @details in Robin Hood mode, positions of other items can change. So can they while migrating in incremental mode.
  * @param [in] map ... a map context
  * @param [in] pos ... the target item's position which can be found by sm_find
  */
 void sm_remove_at(smallmap* map, uint32_t pos);
 
+/**
+ * @brief remove an item at a position found by sm_find64, see sm_remove_at
+ */
+void sm_remove_at64(smallmap* map, uint64_t pos);
+
 /**
  * @brief remove an item from a map
  * @param [in] map ... a map context
  * @param [in] key ... a target key
  */
 void sm_remove(smallmap* map, const void* key);
+
+/**
+ * @brief remove an item with its hash, see sm_remove and sm_find_hashed
+ */
+void sm_remove_hashed(smallmap* map, uint64_t hash, const void* key);
+
+/**
+ * @brief write data which a serialized key refers to, called from the key_serialize callback of sm_save
+ * @details the data is aligned to 8 bytes. The result stays valid wherever the file is mapped,
+ * so a key which stores it finds its data at the address of the key plus the result.
+ * @return the distance in bytes from the serialized key to the written data
+ * @param [in] context ... passed to key_serialize
+ * @param [in] data ... bytes to write
+ * @param [in] size ... size of data
+ */
+int64_t sm_save_data(sm_save_context* context, const void* data, size_t size);
+
+/**
+ * @brief write a map to a snapshot file, which sm_open_mmap maps
+ * @details a snapshot has a versioned header, then the control bytes, keys and values as they are in memory.
+ * The file is in native byte order. Values are written as bytes, keys are too if key_serialize is NULL.
+ * Migration in incremental mode is finished first.
+ * @return false if cannot write, or the map is read-only
+ * @param [in] map ... a map context
+ * @param [in] path ... a file to write
+ * @param [in] key_serialize ... convert a stored key (the last argument) to key_size bytes which do not hold addresses,
+ * for example a string key can write its characters with sm_save_data and store the result
+ * @param [in] user ... the first argument of key_serialize
+ */
+bool sm_save(smallmap* map, const char* path, bool (*key_serialize)(void*, sm_save_context*, void*, const void*), void* user);
+
+/**
+ * @brief open a snapshot as a read-only map, whose buffers are the mapped file
+ * @details nothing is copied, lookups read the page cache directly, and processes which open the same file share its pages.
+ * Adding and removing items are refused. sm_destruct unmaps the file.
+ * @return NULL if cannot map the file, or it is not a snapshot which matches desc
+ * @param [in] path ... a file written by sm_save
+ * @param [in] desc ... key_size and value_size must match the snapshot. hasher must give the same hashes as the saved map,
+ * compare gets serialized keys, and allocate/deallocate are used for the context. The other parameters are ignored.
+ */
+smallmap* sm_open_mmap(const char* path, const sm_desc* desc);
+
+/**
+ * @brief alloc of the built-in allocator for large tables
+ * @details a block of the threshold or larger is mapped in whole huge pages, and the kernel is advised to back it with them.
+ * Smaller blocks come from the aligned heap. Where huge pages are not available, large blocks are mapped in normal pages.
+ * @param [in] ctx ... NULL for the threshold SM_HUGEPAGE_SIZE, or the address of a size_t threshold
+ * @param [in] size ... size of allocation
+ * @param [in] align ... a power of two
+ */
+void* sm_hugepage_alloc(void* ctx, size_t size, size_t align);
+
+/**
+ * @brief dealloc of the built-in allocator for large tables
+ * @param [in] ctx ... the same as passed to sm_hugepage_alloc
+ * @param [in] ptr ... a block allocated by sm_hugepage_alloc, or NULL
+ * @param [in] size ... the size passed to sm_hugepage_alloc
+ */
+void sm_hugepage_dealloc(void* ctx, void* ptr, size_t size);
+
+/**
+ * @brief the built-in allocator for large tables
+ * @param [in] threshold ... NULL, or the address of a size_t threshold which outlives maps
+ */
+sm_allocator sm_hugepage_allocator(const size_t* threshold);
 #endif //INC_SMALLMAP_H_
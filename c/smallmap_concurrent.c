@@ -0,0 +1,582 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "smallmap_concurrent.h"
+#include "sm_thread.h"
+#include "smallmap_ctrl.h"
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+#define SM_CTRL_BUSY (0xFFU) //!< slot claimed by a writer, also the padding after the end. Bit 1 is set so that SWAR does not see it empty
+#define SM_CTRL_VOID (0xFAU) //!< claimed slot whose construction failed, it holds no item
+#define SM_CONCURRENT_DEFAULT_MAX_LOAD (0.7f)
+#define SM_CONCURRENT_DEFAULT_STRIPES (64U)
+#define SM_CONCURRENT_MAX_STRIPES (0x1U << 16U)
+#define SM_CONCURRENT_MAX_READERS (256U)
+#define SM_CONCURRENT_NOT_FOUND (~(uint64_t)0)
+
+#if defined(__SANITIZE_THREAD__)
+#    define SM_CONCURRENT_TSAN
+#elif defined(__has_feature)
+#    if __has_feature(thread_sanitizer)
+#        define SM_CONCURRENT_TSAN
+#    endif
+#endif
+
+/**
+ * @struct sm_ctable
+ * @brief a buffer of a concurrent map
+ * @details unlike smallmap, the first group is not cloned after the end, because a clone cannot be updated together with its slot.
+ * Probing wraps to the first slot at the end instead, and the padding after the end is never empty nor matches.
+ */
+typedef struct sm_ctable_t
+{
+    uint64_t used_; //!< claimed slots including tombstones, updated atomically
+    uint64_t capacity_; //!< number of slots
+    uint64_t mask_; //!< mask for using instead of division
+    uint64_t resize_threshold_; //!< threshold for expanding the buffer
+    uint64_t retire_epoch_; //!< epoch of the map when the buffer was retired
+    struct sm_ctable_t* retired_next_; //!< next retired buffer
+    uint8_t* ctrl_; //!< control bytes
+    uint8_t* keys_; //!< buffer for keys
+    uint8_t* values_; //!< buffer for values
+} sm_ctable;
+
+/**
+ * @struct sm_stripe
+ * @brief a writer lock, each one is on its own cache line
+ */
+typedef struct sm_stripe_t
+{
+    sm_mutex mutex_; //!< serializes writers of keys which hash to this stripe
+    uint64_t size_; //!< number of items which hash to this stripe
+} sm_stripe;
+
+/**
+ * @struct sm_reader
+ * @brief lookups in progress of the threads which share a slot, each one is on its own cache line
+ */
+typedef struct sm_reader_t
+{
+    uint64_t count_[2]; //!< by the parity of the epoch they entered in
+    uint8_t padding_[SM_CACHELINE - 2 * sizeof(uint64_t)];
+} sm_reader;
+
+/**
+ * @struct sm_concurrent
+ * @brief a concurrent map context
+ */
+struct sm_concurrent_t
+{
+    uint32_t key_size_; //!< key size in bytes
+    uint32_t value_size_; //!< value size in bytes
+    uint32_t stripe_mask_; //!< number of stripes minus one
+    uint32_t stripe_stride_; //!< stripe size rounded up to a cache line
+    uint32_t reader_mask_; //!< number of reader slots minus one
+    float max_load_; //!< load factor which triggers expanding
+    sm_ctable* table_; //!< current buffer, replaced atomically by expanding
+    sm_ctable* retired_; //!< buffers replaced by expanding, which readers may still be reading
+    uint64_t epoch_; //!< advanced by expanding once no reader is left from the previous epoch
+    uint8_t* stripes_; //!< writer locks, expanding takes all of them
+    sm_reader* readers_; //!< reader slots, picked by thread and not by key so that lookups of a hot key do not share a line
+
+    bool (*key_constructor_)(struct sm_concurrent_t*, void*, const void*);
+    void (*key_destructor_)(struct sm_concurrent_t*, void*);
+
+    bool (*value_constructor_)(struct sm_concurrent_t*, void*, const void*);
+    void (*value_destructor_)(struct sm_concurrent_t*, void*);
+
+    uint32_t (*hasher_)(const void*);
+    bool (*compare_)(const void*, const void*);
+
+    void* (*allocate_)(size_t);
+    void (*deallocate_)(void*);
+};
+
+/**
+ * @brief result of claiming a slot
+ */
+typedef enum sm_claim_t
+{
+    SM_CLAIM_ADDED,
+    SM_CLAIM_FULL,
+    SM_CLAIM_FAILED,
+} sm_claim;
+
+static inline uint8_t* sm_ctable_key(const sm_concurrent* map, const sm_ctable* table, uint64_t pos)
+{
+    return table->keys_ + pos * map->key_size_;
+}
+
+static inline uint8_t* sm_ctable_value(const sm_concurrent* map, const sm_ctable* table, uint64_t pos)
+{
+    return table->values_ + pos * map->value_size_;
+}
+
+/**
+ * @brief start of the next group in a probe sequence, which wraps at the end
+ */
+static inline uint64_t sm_ctable_next(const sm_ctable* table, uint64_t pos)
+{
+    pos += SM_GROUP_WIDTH;
+    return (table->capacity_ <= pos) ? 0 : pos;
+}
+
+/**
+ * @brief upper bound of slots a probe sequence covers, the groups just before the end and the home can be partial
+ */
+static inline uint64_t sm_ctable_probe_limit(const sm_ctable* table)
+{
+    return table->capacity_ + 2 * SM_GROUP_WIDTH;
+}
+
+static inline sm_stripe* sm_concurrent_stripe_at(const sm_concurrent* map, uint32_t index)
+{
+    return (sm_stripe*)(map->stripes_ + (size_t)index * map->stripe_stride_);
+}
+
+static inline sm_stripe* sm_concurrent_stripe(const sm_concurrent* map, uint64_t hash)
+{
+    // Stripes are picked by upper bits, which homes of tables up to 2^33 slots do not use
+    return sm_concurrent_stripe_at(map, (uint32_t)(hash >> 40) & map->stripe_mask_);
+}
+
+static uint64_t sm_concurrent_threads = 0; //!< number of threads which have looked up any map
+static SM_THREAD_LOCAL uint64_t sm_concurrent_thread = 0; //!< number of this thread plus one, 0 until its first lookup
+
+static inline sm_reader* sm_concurrent_reader(const sm_concurrent* map)
+{
+    uint64_t thread = sm_concurrent_thread;
+    if(thread <= 0) {
+        thread = sm_atomic_add_u64(&sm_concurrent_threads, 1) + 1;
+        sm_concurrent_thread = thread;
+    }
+    // Sequential numbers give threads separate slots, until there are more threads than slots
+    return &map->readers_[(thread - 1) & map->reader_mask_];
+}
+
+static inline const sm_ctable* sm_concurrent_table(const sm_concurrent* map)
+{
+    return (const sm_ctable*)sm_atomic_load_ptr((void* const*)&map->table_);
+}
+
+/**
+ * @brief count a lookup in the parity of the current epoch before it loads the buffer
+ * @details the counter is on the line of the calling thread, which other threads write only when they share its slot
+ * @return the counter to pass to sm_concurrent_leave
+ */
+static inline uint64_t* sm_concurrent_enter(const sm_concurrent* map)
+{
+    uint64_t* readers = &sm_concurrent_reader(map)->count_[sm_atomic_load_u64(&map->epoch_) & 0x1U];
+    // Both this and loading the buffer are sequentially consistent, so the count is visible before the buffer is loaded,
+    // against sm_concurrent_collect which counts after a fence
+    sm_atomic_add_u64(readers, 1);
+    return readers;
+}
+
+static inline void sm_concurrent_leave(uint64_t* readers)
+{
+    sm_atomic_add_u64(readers, ~(uint64_t)0);
+}
+
+/**
+ * @brief allocate an empty buffer
+ */
+static sm_ctable* sm_ctable_create(sm_concurrent* map, uint64_t capacity)
+{
+    size_t table_size = SM_ALIGN(sizeof(sm_ctable));
+    size_t ctrl_size = SM_ALIGN(capacity + SM_GROUP_WIDTH);
+    size_t key_size = SM_ALIGN(capacity * map->key_size_);
+    size_t value_size = SM_ALIGN(capacity * map->value_size_);
+    uint8_t* buffer = (uint8_t*)map->allocate_(table_size + ctrl_size + key_size + value_size);
+    if(NULL == buffer) {
+        return NULL;
+    }
+    sm_ctable* table = (sm_ctable*)buffer;
+    memset(table, 0, sizeof(sm_ctable));
+    table->capacity_ = capacity;
+    table->mask_ = capacity - 1;
+    table->resize_threshold_ = (uint64_t)(capacity * map->max_load_);
+    table->ctrl_ = buffer + table_size;
+    table->keys_ = buffer + table_size + ctrl_size;
+    table->values_ = buffer + table_size + ctrl_size + key_size;
+    memset(table->ctrl_, SM_CTRL_EMPTY, capacity);
+    memset(table->ctrl_ + capacity, SM_CTRL_BUSY, ctrl_size - capacity);
+    return table;
+}
+
+/**
+ * @brief destruct items and release a buffer
+ * @param [in] live ... true to destruct live items too, false if they have been copied to the next buffer
+ */
+static void sm_ctable_destroy(sm_concurrent* map, sm_ctable* table, bool live)
+{
+    for(uint64_t i = 0; i < table->capacity_; ++i) {
+        uint8_t ctrl = table->ctrl_[i];
+        if(SM_CTRL_DELETED == ctrl || (live && SM_IS_FULL(ctrl))) {
+            map->key_destructor_(map, sm_ctable_key(map, table, i));
+            map->value_destructor_(map, sm_ctable_value(map, table, i));
+        }
+    }
+    map->deallocate_(table);
+}
+
+/**
+ * @brief advance the epoch while no reader is left from the previous one, then release buffers which no reader can hold
+ * @details a reader which loaded a buffer had been counted before the buffer was retired. Advancing from the epoch of
+ * retiring waits for the readers of the other parity, and advancing again for those of the same parity, so two epochs later
+ * every such reader has left. Called while all stripes are held.
+ */
+static void sm_concurrent_collect(sm_concurrent* map)
+{
+    sm_atomic_fence();
+    for(uint32_t n = 0; n < 2; ++n) {
+        uint64_t previous = (map->epoch_ + 1) & 0x1U;
+        uint64_t readers = 0;
+        for(uint32_t i = 0; i <= map->reader_mask_; ++i) {
+            readers += sm_atomic_load_u64(&map->readers_[i].count_[previous]);
+        }
+        if(0 < readers) {
+            break;
+        }
+        sm_atomic_add_u64(&map->epoch_, 1);
+    }
+    sm_ctable** link = &map->retired_;
+    while(NULL != *link) {
+        sm_ctable* table = *link;
+        if(map->epoch_ < table->retire_epoch_ + 2) {
+            link = &table->retired_next_;
+            continue;
+        }
+        *link = table->retired_next_;
+        sm_ctable_destroy(map, table, false);
+    }
+}
+
+/**
+ * @brief control bytes of a group in a shared buffer, to be read by vector loads
+ * @details groups are scanned by plain vector loads while writers change single control bytes with atomics, which is the only
+ * race of the map. Each byte is read whole, and in a buffer a byte only goes from empty to claimed, to full or void, to deleted.
+ * A stale byte can hide an item which is being added, which a lookup racing the add may miss anyway, or show a match or an empty
+ * slot which the acquire load or the compare-and-swap then rejects. Under ThreadSanitizer, the group is copied by atomic loads.
+ * @param [in] copy ... SM_GROUP_WIDTH bytes which receive the copy
+ */
+static inline const uint8_t* sm_ctable_group(const uint8_t* ctrl, uint8_t* copy)
+{
+#ifdef SM_CONCURRENT_TSAN
+    for(uint32_t i = 0; i < SM_GROUP_WIDTH; ++i) {
+        copy[i] = sm_atomic_load_u8(&ctrl[i]);
+    }
+    return copy;
+#else
+    (void)copy;
+    return ctrl;
+#endif
+}
+
+/**
+ * @brief find an item without locking
+ * @details a candidate's control byte is loaded again with acquire, so that its key is read after it has been published
+ * @return position of the item, SM_CONCURRENT_NOT_FOUND if cannot find
+ */
+static uint64_t sm_ctable_find(const sm_concurrent* map, const sm_ctable* table, uint64_t hash, const void* key)
+{
+    uint8_t tag = SM_H2(hash);
+    uint64_t pos = SM_H1(hash) & table->mask_;
+    uint64_t limit = sm_ctable_probe_limit(table);
+    for(uint64_t probed = 0; probed < limit; probed += SM_GROUP_WIDTH) {
+        bool last;
+        uint8_t copy[SM_GROUP_WIDTH];
+        sm_bitmask match = sm_probe_group(sm_ctable_group(&table->ctrl_[pos], copy), tag, limit, &last);
+        while(0 != match) {
+            uint64_t i = pos + sm_bitmask_lowest(match);
+            if(tag == sm_atomic_load_u8(&table->ctrl_[i]) && map->compare_(sm_ctable_key(map, table, i), &key)) {
+                return i;
+            }
+            match &= match - 1;
+        }
+        if(last) {
+            break;
+        }
+        pos = sm_ctable_next(table, pos);
+    }
+    return SM_CONCURRENT_NOT_FOUND;
+}
+
+/**
+ * @brief claim the first empty slot of the probe sequence, and construct an item there
+ * @details slots never become empty again until the buffer is replaced, so every slot before the claimed one stays
+ * non-empty and readers reach the item.
+ */
+static sm_claim sm_ctable_add(sm_concurrent* map, sm_ctable* table, uint64_t hash, const void* key, const void* value)
+{
+    if(table->resize_threshold_ <= sm_atomic_add_u64(&table->used_, 1)) {
+        sm_atomic_add_u64(&table->used_, ~(uint64_t)0);
+        return SM_CLAIM_FULL;
+    }
+    uint64_t pos = SM_H1(hash) & table->mask_;
+    uint64_t limit = sm_ctable_probe_limit(table);
+    for(uint64_t probed = 0; probed < limit; probed += SM_GROUP_WIDTH) {
+        uint8_t copy[SM_GROUP_WIDTH];
+        sm_bitmask empty = sm_group_match_empty(sm_ctable_group(&table->ctrl_[pos], copy));
+        while(0 != empty) {
+            uint64_t i = pos + sm_bitmask_lowest(empty);
+            if(!sm_atomic_cas_u8(&table->ctrl_[i], SM_CTRL_EMPTY, SM_CTRL_BUSY)) {
+                empty &= empty - 1;
+                continue;
+            }
+            uint8_t* dst_key = sm_ctable_key(map, table, i);
+            uint8_t* dst_value = sm_ctable_value(map, table, i);
+            if(!map->key_constructor_(map, dst_key, key)) {
+                sm_atomic_store_u8(&table->ctrl_[i], SM_CTRL_VOID);
+                return SM_CLAIM_FAILED;
+            }
+            if(!map->value_constructor_(map, dst_value, value)) {
+                map->key_destructor_(map, dst_key);
+                sm_atomic_store_u8(&table->ctrl_[i], SM_CTRL_VOID);
+                return SM_CLAIM_FAILED;
+            }
+            sm_atomic_store_u8(&table->ctrl_[i], SM_H2(hash));
+            return SM_CLAIM_ADDED;
+        }
+        pos = sm_ctable_next(table, pos);
+    }
+    // Unreachable while the threshold is under the capacity
+    sm_atomic_add_u64(&table->used_, ~(uint64_t)0);
+    return SM_CLAIM_FULL;
+}
+
+/**
+ * @brief replace a full buffer, the previous one is retired
+ * @details writers are excluded by taking all stripes in order, and items are copied by bytes while readers are reading them.
+ * If tombstones occupy much of the buffer, they are purged without growing. A released buffer can be allocated again at the
+ * same address, then a writer which saw it full only expands once more.
+ * @return false if cannot allocate
+ */
+static bool sm_concurrent_expand(sm_concurrent* map, sm_ctable* table)
+{
+    bool result = true;
+    for(uint32_t i = 0; i <= map->stripe_mask_; ++i) {
+        sm_mutex_lock(&sm_concurrent_stripe_at(map, i)->mutex_);
+    }
+    if(table == map->table_) {
+        uint64_t size = sm_concurrent_size(map);
+        uint64_t capacity = (size < (table->resize_threshold_ >> 1)) ? table->capacity_ : table->capacity_ << 1;
+        sm_ctable* next = sm_ctable_create(map, capacity);
+        if(NULL != next) {
+            for(uint64_t i = 0; i < table->capacity_; ++i) {
+                uint8_t ctrl = table->ctrl_[i];
+                if(!SM_IS_FULL(ctrl)) {
+                    continue;
+                }
+                const uint8_t* key = sm_ctable_key(map, table, i);
+                uint64_t hash = sm_spread32(map->hasher_(key));
+                uint64_t pos = SM_H1(hash) & next->mask_;
+                sm_bitmask empty;
+                while(0 == (empty = sm_group_match_empty(&next->ctrl_[pos]))) {
+                    pos = sm_ctable_next(next, pos);
+                }
+                pos += sm_bitmask_lowest(empty);
+                memcpy(sm_ctable_key(map, next, pos), key, map->key_size_);
+                memcpy(sm_ctable_value(map, next, pos), sm_ctable_value(map, table, i), map->value_size_);
+                next->ctrl_[pos] = ctrl;
+                ++next->used_;
+            }
+            table->retire_epoch_ = map->epoch_;
+            table->retired_next_ = map->retired_;
+            map->retired_ = table;
+            sm_atomic_store_ptr((void**)&map->table_, next);
+            sm_concurrent_collect(map);
+        } else {
+            result = false;
+        }
+    }
+    for(uint32_t i = map->stripe_mask_ + 1; 0 < i; --i) {
+        sm_mutex_unlock(&sm_concurrent_stripe_at(map, i - 1)->mutex_);
+    }
+    return result;
+}
+
+sm_concurrent* sm_concurrent_construct(const sm_concurrent_desc* desc)
+{
+    assert(NULL != desc);
+    assert(NULL != desc->key_constructor);
+    assert(NULL != desc->key_destructor);
+    assert(NULL != desc->value_constructor);
+    assert(NULL != desc->value_destructor);
+    assert(NULL != desc->hasher);
+    assert(NULL != desc->compare);
+    assert(0.0f <= desc->max_load && desc->max_load < 1.0f);
+
+    void* (*allocate)(size_t) = (NULL != desc->allocate) ? desc->allocate : malloc;
+    void (*deallocate)(void*) = (NULL != desc->deallocate) ? desc->deallocate : free;
+    uint32_t stripes = 1;
+    uint32_t requested = (0 < desc->stripes) ? desc->stripes : SM_CONCURRENT_DEFAULT_STRIPES;
+    while(stripes < requested && stripes < SM_CONCURRENT_MAX_STRIPES) {
+        stripes <<= 1;
+    }
+    uint32_t readers = 1;
+    uint32_t threads = sm_thread_hardware_concurrency();
+    while(readers < threads && readers < SM_CONCURRENT_MAX_READERS) {
+        readers <<= 1;
+    }
+    uint32_t stripe_stride = (uint32_t)((sizeof(sm_stripe) + SM_CACHELINE - 1) & ~(size_t)(SM_CACHELINE - 1));
+    size_t map_size = SM_ALIGN(sizeof(sm_concurrent));
+    size_t stripes_size = (size_t)stripes * stripe_stride;
+    sm_concurrent* map = (sm_concurrent*)allocate(map_size + stripes_size + (size_t)readers * sizeof(sm_reader) + SM_CACHELINE);
+    if(NULL == map) {
+        return NULL;
+    }
+    memset(map, 0, sizeof(sm_concurrent));
+    map->key_size_ = desc->key_size;
+    map->value_size_ = desc->value_size;
+    map->stripe_mask_ = stripes - 1;
+    map->stripe_stride_ = stripe_stride;
+    map->reader_mask_ = readers - 1;
+    map->max_load_ = (0.0f < desc->max_load) ? desc->max_load : SM_CONCURRENT_DEFAULT_MAX_LOAD;
+    uintptr_t stripes_address = ((uintptr_t)map + map_size + SM_CACHELINE - 1) & ~(uintptr_t)(SM_CACHELINE - 1);
+    map->stripes_ = (uint8_t*)stripes_address;
+    map->readers_ = (sm_reader*)(stripes_address + stripes_size);
+    map->key_constructor_ = desc->key_constructor;
+    map->key_destructor_ = desc->key_destructor;
+    map->value_constructor_ = desc->value_constructor;
+    map->value_destructor_ = desc->value_destructor;
+    map->hasher_ = desc->hasher;
+    map->compare_ = desc->compare;
+    map->allocate_ = allocate;
+    map->deallocate_ = deallocate;
+    map->table_ = sm_ctable_create(map, 16);
+    if(NULL == map->table_) {
+        deallocate(map);
+        return NULL;
+    }
+    for(uint32_t i = 0; i < stripes; ++i) {
+        sm_stripe* stripe = sm_concurrent_stripe_at(map, i);
+        sm_mutex_init(&stripe->mutex_);
+        stripe->size_ = 0;
+    }
+    memset(map->readers_, 0, (size_t)readers * sizeof(sm_reader));
+    return map;
+}
+
+void sm_concurrent_destruct(sm_concurrent* map)
+{
+    if(NULL == map) {
+        return;
+    }
+    sm_concurrent_reclaim(map);
+    sm_ctable_destroy(map, map->table_, true);
+    for(uint32_t i = 0; i <= map->stripe_mask_; ++i) {
+        sm_mutex_term(&sm_concurrent_stripe_at(map, i)->mutex_);
+    }
+    void (*deallocate)(void*) = map->deallocate_;
+    memset(map, 0, sizeof(sm_concurrent));
+    deallocate(map);
+}
+
+void* sm_concurrent_allocate(sm_concurrent* map, size_t size)
+{
+    assert(NULL != map);
+    return map->allocate_(size);
+}
+
+void sm_concurrent_deallocate(sm_concurrent* map, void* ptr)
+{
+    assert(NULL != map);
+    map->deallocate_(ptr);
+}
+
+uint64_t sm_concurrent_size(const sm_concurrent* map)
+{
+    assert(NULL != map);
+    uint64_t size = 0;
+    for(uint32_t i = 0; i <= map->stripe_mask_; ++i) {
+        size += sm_atomic_load_u64(&sm_concurrent_stripe_at(map, i)->size_);
+    }
+    return size;
+}
+
+bool sm_concurrent_contains(const sm_concurrent* map, const void* key)
+{
+    assert(NULL != map);
+    assert(NULL != key);
+    uint64_t hash = sm_spread32(map->hasher_(&key));
+    uint64_t* readers = sm_concurrent_enter(map);
+    bool found = SM_CONCURRENT_NOT_FOUND != sm_ctable_find(map, sm_concurrent_table(map), hash, key);
+    sm_concurrent_leave(readers);
+    return found;
+}
+
+bool sm_concurrent_try_get(const sm_concurrent* map, const void* key, void* value)
+{
+    assert(NULL != map);
+    assert(NULL != key);
+    assert(NULL != value);
+    uint64_t hash = sm_spread32(map->hasher_(&key));
+    uint64_t* readers = sm_concurrent_enter(map);
+    const sm_ctable* table = sm_concurrent_table(map);
+    uint64_t pos = sm_ctable_find(map, table, hash, key);
+    if(SM_CONCURRENT_NOT_FOUND != pos) {
+        // Values are written once before publishing, so the copy is never torn
+        memcpy(value, sm_ctable_value(map, table, pos), map->value_size_);
+    }
+    sm_concurrent_leave(readers);
+    return SM_CONCURRENT_NOT_FOUND != pos;
+}
+
+bool sm_concurrent_add(sm_concurrent* map, const void* key, const void* value)
+{
+    assert(NULL != map);
+    assert(NULL != key);
+    assert(NULL != value);
+    uint64_t hash = sm_spread32(map->hasher_(&key));
+    sm_stripe* stripe = sm_concurrent_stripe(map, hash);
+    for(;;) {
+        // The buffer is replaced only while all stripes are held
+        sm_mutex_lock(&stripe->mutex_);
+        sm_ctable* table = map->table_;
+        sm_claim claim = SM_CLAIM_FAILED;
+        if(SM_CONCURRENT_NOT_FOUND == sm_ctable_find(map, table, hash, key)) {
+            claim = sm_ctable_add(map, table, hash, key, value);
+        }
+        if(SM_CLAIM_ADDED == claim) {
+            sm_atomic_add_u64(&stripe->size_, 1);
+        }
+        sm_mutex_unlock(&stripe->mutex_);
+        if(SM_CLAIM_FULL != claim) {
+            return SM_CLAIM_ADDED == claim;
+        }
+        if(!sm_concurrent_expand(map, table)) {
+            return false;
+        }
+    }
+}
+
+bool sm_concurrent_remove(sm_concurrent* map, const void* key)
+{
+    assert(NULL != map);
+    assert(NULL != key);
+    uint64_t hash = sm_spread32(map->hasher_(&key));
+    sm_stripe* stripe = sm_concurrent_stripe(map, hash);
+    sm_mutex_lock(&stripe->mutex_);
+    sm_ctable* table = map->table_;
+    uint64_t pos = sm_ctable_find(map, table, hash, key);
+    if(SM_CONCURRENT_NOT_FOUND != pos) {
+        // The slot stays a tombstone, readers comparing its key are safe until the buffer is released
+        sm_atomic_store_u8(&table->ctrl_[pos], SM_CTRL_DELETED);
+        sm_atomic_add_u64(&stripe->size_, ~(uint64_t)0);
+    }
+    sm_mutex_unlock(&stripe->mutex_);
+    return SM_CONCURRENT_NOT_FOUND != pos;
+}
+
+void sm_concurrent_reclaim(sm_concurrent* map)
+{
+    assert(NULL != map);
+    while(NULL != map->retired_) {
+        sm_ctable* table = map->retired_;
+        map->retired_ = table->retired_next_;
+        sm_ctable_destroy(map, table, false);
+    }
+}
@@ -0,0 +1,118 @@
+#ifndef INC_SMALLMAP_CONCURRENT_H_
+#define INC_SMALLMAP_CONCURRENT_H_
+/**
+ * A thread-safe variant of smallmap.
+ *
+ * The layout is the same control bytes, keys and values as smallmap's default mode.
+ * Lookups take no lock. Writers take one of the striped locks which is picked by the hash.
+ * Expanding takes all stripes, copies items to a new buffer and publishes it, readers keep going on the previous one.
+ *
+ * A slot is written once. It is claimed from empty by compare-and-swap, constructed, then published by its control byte.
+ * A removed item stays as a tombstone and is destructed only after its buffer is retired and released, so a reader can
+ * still compare a key which is being removed. Lookups count themselves in the current epoch on a cache line of their thread,
+ * so readers of a hot key do not contend, and expanding advances the epoch once no lookup is left from the previous one.
+ * A buffer is released by a later expansion two epochs after it was retired.
+ * Memory is bounded by the current buffer, its tombstones up to the load factor, and the retired buffers which lookups
+ * still in progress may hold. A lookup which stalls delays the release, sm_concurrent_reclaim releases all of them at once.
+ * Keys and values are relocated by copying bytes when expanding, so they must not point into themselves.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+struct sm_concurrent_t;
+typedef struct sm_concurrent_t sm_concurrent;
+
+/**
+ * @struct sm_concurrent_desc
+ * @brief parameters to construct a concurrent map, callbacks are the same as sm_construct without moves
+ */
+typedef struct sm_concurrent_desc_t
+{
+    uint32_t key_size; //!< size of key in bytes
+    uint32_t value_size; //!< size of value in bytes
+    uint32_t stripes; //!< number of writer locks rounded up to a power of two, 0 means the default 64
+    float max_load; //!< load factor which triggers expanding, 0 means the default 0.7
+    bool (*key_constructor)(sm_concurrent*, void*, const void*);
+    void (*key_destructor)(sm_concurrent*, void*);
+    bool (*value_constructor)(sm_concurrent*, void*, const void*);
+    void (*value_destructor)(sm_concurrent*, void*);
+    uint32_t (*hasher)(const void*);
+    bool (*compare)(const void*, const void*);
+    void* (*allocate)(size_t);
+    void (*deallocate)(void*);
+} sm_concurrent_desc;
+
+/**
+ * @brief construct a concurrent map context
+ * @return NULL if cannot allocate
+ * @param [in] desc ... parameters
+ */
+sm_concurrent* sm_concurrent_construct(const sm_concurrent_desc* desc);
+
+/**
+ * @brief destruct a concurrent map context, no other thread can access the map
+ */
+void sm_concurrent_destruct(sm_concurrent* map);
+
+/**
+ * @brief allocate memory with the map's allocator
+ * @param [in] map ... the owner of allocator
+ * @param [in] size ... size of allocation
+ */
+void* sm_concurrent_allocate(sm_concurrent* map, size_t size);
+
+/**
+ * @brief deallocate memory which allocated by the map's allocator
+ * @param [in] map ... the owner of allocator
+ * @param [in] ptr ... the pointer to the allocated memory
+ */
+void sm_concurrent_deallocate(sm_concurrent* map, void* ptr);
+
+/**
+ * @brief number of items, which can be outdated while writers are running
+ */
+uint64_t sm_concurrent_size(const sm_concurrent* map);
+
+/**
+ * @brief find an item without locking
+ * @return true if can find
+ * @param [in] map ... a map context
+ * @param [in] key ... a target key
+ */
+bool sm_concurrent_contains(const sm_concurrent* map, const void* key);
+
+/**
+ * @brief find an item without locking
+ * @return true if can find
+ * @param [in] map ... a map context
+ * @param [in] key ... a target key
+ * @param [out] value ... copy the value, if found
+ */
+bool sm_concurrent_try_get(const sm_concurrent* map, const void* key, void* value);
+
+/**
+ * @brief add an item to a map
+ * @return false if the key exists, or cannot allocate or construct
+ * @param [in] map ... a map context
+ * @param [in] key ... a target key
+ * @param [in] value ... a value
+ */
+bool sm_concurrent_add(sm_concurrent* map, const void* key, const void* value);
+
+/**
+ * @brief remove an item from a map, the item is destructed after its buffer is reclaimed
+ * @return true if removed
+ * @param [in] map ... a map context
+ * @param [in] key ... a target key
+ */
+bool sm_concurrent_remove(sm_concurrent* map, const void* key);
+
+/**
+ * @brief release buffers which have been retired by expanding, and destruct the items removed from them
+ * @details expanding releases them once no lookup can hold them, this releases the rest without waiting.
+ * No other thread can access the map during the call, for example call at a quiescent point between phases
+ * @param [in] map ... a map context
+ */
+void sm_concurrent_reclaim(sm_concurrent* map);
+#endif //INC_SMALLMAP_CONCURRENT_H_
@@ -0,0 +1,210 @@
+#ifndef INC_SMALLMAP_CTRL_H_
+#define INC_SMALLMAP_CTRL_H_
+/**
+ * Control bytes and group matching shared by smallmap.c, smallmap_concurrent.c and smallmap_typed.h.
+ */
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#    include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && 2 <= _M_IX86_FP)
+#    include <emmintrin.h>
+#    define SM_SSE2
+#endif
+#ifdef _MSC_VER
+#    include <intrin.h>
+#endif
+
+#define SM_ALIGN(x) (((x) + 15UL) & ~15UL)
+
+#define SM_CTRL_EMPTY (0x80U) //!< never used slot, probing stops here
+#define SM_CTRL_DELETED (0xFEU) //!< tombstone, keeps probe sequences passing through a removed slot
+#define SM_IS_FULL(ctrl) (0 == ((ctrl) & SM_CTRL_EMPTY))
+#define SM_H1(hash) ((hash) >> 7) //!< home position part of a hash
+#define SM_H2(hash) ((uint8_t)((hash) & 0x7FU)) //!< tag part of a hash, which is stored in the control byte
+
+/**
+ * @brief spread a 32-bit hash over 64 bits before SM_H1 and SM_H2 split it
+ * @details SM_H1 of a 32-bit hash would leave only 2^25 homes. An odd multiplier keeps the low 32 bits a bijection,
+ * so the tag and homes of small tables are as mixed as the hash, while the upper bits reach homes of larger tables.
+ */
+static inline uint64_t sm_spread32(uint32_t hash)
+{
+    return (uint64_t)hash * 0x9E3779B97F4A7C15ULL;
+}
+
+/**
+ * A group is a window of control bytes which is checked at once.
+ * A bitmask has a set bit for each matched slot in a group, SM_GROUP_SHIFT converts a bit index to a slot index.
+ */
+#if defined(__AVX2__)
+#    define SM_GROUP_WIDTH (32U)
+#    define SM_GROUP_SHIFT (0U)
+typedef uint32_t sm_bitmask;
+#elif defined(SM_SSE2)
+#    define SM_GROUP_WIDTH (16U)
+#    define SM_GROUP_SHIFT (0U)
+typedef uint32_t sm_bitmask;
+#else
+#    define SM_GROUP_WIDTH (8U)
+#    define SM_GROUP_SHIFT (3U)
+typedef uint64_t sm_bitmask;
+#endif
+
+#if defined(__AVX2__)
+static inline sm_bitmask sm_group_match(const uint8_t* ctrl, uint8_t tag)
+{
+    __m256i group = _mm256_loadu_si256((const __m256i*)ctrl);
+    return (sm_bitmask)_mm256_movemask_epi8(_mm256_cmpeq_epi8(group, _mm256_set1_epi8((char)tag)));
+}
+
+static inline sm_bitmask sm_group_match_empty(const uint8_t* ctrl)
+{
+    __m256i group = _mm256_loadu_si256((const __m256i*)ctrl);
+    return (sm_bitmask)_mm256_movemask_epi8(_mm256_cmpeq_epi8(group, _mm256_set1_epi8((char)SM_CTRL_EMPTY)));
+}
+
+static inline sm_bitmask sm_group_match_free(const uint8_t* ctrl)
+{
+    __m256i group = _mm256_loadu_si256((const __m256i*)ctrl);
+    return (sm_bitmask)_mm256_movemask_epi8(group);
+}
+
+static inline sm_bitmask sm_group_match_full(const uint8_t* ctrl)
+{
+    return ~sm_group_match_free(ctrl);
+}
+
+#elif defined(SM_SSE2)
+static inline sm_bitmask sm_group_match(const uint8_t* ctrl, uint8_t tag)
+{
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    return (sm_bitmask)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+}
+
+static inline sm_bitmask sm_group_match_empty(const uint8_t* ctrl)
+{
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    return (sm_bitmask)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)SM_CTRL_EMPTY)));
+}
+
+static inline sm_bitmask sm_group_match_free(const uint8_t* ctrl)
+{
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    return (sm_bitmask)_mm_movemask_epi8(group);
+}
+
+static inline sm_bitmask sm_group_match_full(const uint8_t* ctrl)
+{
+    return sm_group_match_free(ctrl) ^ 0xFFFFU;
+}
+
+#else
+#    define SM_LSBS (0x0101010101010101ULL)
+#    define SM_MSBS (0x8080808080808080ULL)
+
+static inline uint64_t sm_group_load(const uint8_t* ctrl)
+{
+    uint64_t group;
+    memcpy(&group, ctrl, sizeof(uint64_t));
+#    if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    group = __builtin_bswap64(group);
+#    endif
+    return group;
+}
+
+/**
+ * @brief match bytes within a word, can report a false positive which is filtered by compare
+ */
+static inline sm_bitmask sm_group_match(const uint8_t* ctrl, uint8_t tag)
+{
+    uint64_t x = sm_group_load(ctrl) ^ (SM_LSBS * tag);
+    return (x - SM_LSBS) & ~x & SM_MSBS;
+}
+
+static inline sm_bitmask sm_group_match_empty(const uint8_t* ctrl)
+{
+    uint64_t group = sm_group_load(ctrl);
+    return group & (~group << 6) & SM_MSBS;
+}
+
+static inline sm_bitmask sm_group_match_free(const uint8_t* ctrl)
+{
+    return sm_group_load(ctrl) & SM_MSBS;
+}
+
+static inline sm_bitmask sm_group_match_full(const uint8_t* ctrl)
+{
+    return ~sm_group_load(ctrl) & SM_MSBS;
+}
+#endif
+
+/**
+ * @brief slot index of the lowest set bit
+ */
+static inline uint32_t sm_bitmask_lowest(sm_bitmask mask)
+{
+    assert(0 != mask);
+#if defined(_MSC_VER)
+    unsigned long index;
+#    if 8 == SM_GROUP_WIDTH
+    _BitScanForward64(&index, mask);
+#    else
+    _BitScanForward(&index, mask);
+#    endif
+    return (uint32_t)index >> SM_GROUP_SHIFT;
+#elif 8 == SM_GROUP_WIDTH
+    return (uint32_t)__builtin_ctzll(mask) >> SM_GROUP_SHIFT;
+#else
+    return (uint32_t)__builtin_ctz(mask) >> SM_GROUP_SHIFT;
+#endif
+}
+
+/**
+ * @brief mask of the first count slots in a group
+ */
+static inline sm_bitmask sm_bitmask_first(uint64_t count)
+{
+    assert(count < SM_GROUP_WIDTH);
+    return ((sm_bitmask)1 << (count << SM_GROUP_SHIFT)) - 1;
+}
+
+/**
+ * @brief tag matches in the group which belong to the probe sequence
+ * @param [in] ctrl ... control bytes from the start of the group
+ * @param [in] remain ... number of slots left to check
+ * @param [out] last ... true if the probe sequence ends in this group
+ */
+static inline sm_bitmask sm_probe_group(const uint8_t* ctrl, uint8_t tag, uint64_t remain, bool* last)
+{
+    sm_bitmask empty = sm_group_match_empty(ctrl);
+    sm_bitmask match = sm_group_match(ctrl, tag);
+    *last = (0 != empty) || (remain <= SM_GROUP_WIDTH);
+    if(remain < SM_GROUP_WIDTH) {
+        match &= sm_bitmask_first(remain);
+    }
+    if(0 != empty) {
+        // Slots after an empty slot do not belong to this probe sequence
+        match &= (empty & (~empty + 1)) - 1;
+    }
+    return match;
+}
+
+/**
+ * @brief set a control byte, and its clone if it is in the first group
+ * @param [in] ctrl ... control bytes which have SM_GROUP_WIDTH cloned bytes after the end
+ */
+static inline void sm_ctrl_set(uint8_t* ctrl, uint64_t capacity, uint64_t pos, uint8_t value)
+{
+    ctrl[pos] = value;
+    if(pos < SM_GROUP_WIDTH) {
+        uint64_t end = capacity + SM_GROUP_WIDTH;
+        for(uint64_t i = pos + capacity; i < end; i += capacity) {
+            ctrl[i] = value;
+        }
+    }
+}
+#endif //INC_SMALLMAP_CTRL_H_
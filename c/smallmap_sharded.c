@@ -0,0 +1,352 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "smallmap_sharded.h"
+#include "sm_alloc.h"
+#include "sm_thread.h"
+#include "smallmap_ctrl.h"
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+#define SM_SHARDED_MAX_SHARDS (0x1U << 12U)
+#define SM_SHARDED_MIN_SLICE (0x1U << 12U) //!< fewer keys per thread are not worth starting a thread
+#define SM_SHARDED_ROUTE_MUL (0x9E3779B1U) //!< remix before taking the high bits, so that they do not select a range of home slots in the shard
+
+/**
+ * @struct sm_sharded
+ * @brief a sharded map context
+ */
+struct sm_sharded_t
+{
+    uint32_t shard_bits_; //!< log2 of number of shards
+    uint32_t value_size_; //!< value size in bytes
+    sm_allocator allocator_;
+    sm_legacy_allocator legacy_; //!< context of allocator_ if it is adapted from allocate and deallocate
+    smallmap* shards_[1]; //!< shards, allocated with the context
+};
+
+/**
+ * @brief shard of a hash
+ */
+static inline uint32_t sm_sharded_route_hash(const sm_sharded* map, uint64_t hash)
+{
+    // Both halves of a 64-bit hash take part, a 32-bit hash has zero in the upper half
+    uint32_t mixed = (uint32_t)(hash ^ (hash >> 32)) * SM_SHARDED_ROUTE_MUL;
+    return (uint32_t)(((uint64_t)mixed << map->shard_bits_) >> 32);
+}
+
+/**
+ * @brief hash of a key, shards share the hasher so any of them gives the same
+ */
+static inline uint64_t sm_sharded_hash(const sm_sharded* map, const void* key)
+{
+    return sm_hash(map->shards_[0], key);
+}
+
+sm_sharded* sm_sharded_construct(const sm_sharded_desc* desc)
+{
+    assert(NULL != desc);
+    uint32_t requested = (0 < desc->shards) ? desc->shards : sm_thread_hardware_concurrency();
+    uint32_t bits = 0;
+    while((0x1U << bits) < requested && (0x1U << bits) < SM_SHARDED_MAX_SHARDS) {
+        ++bits;
+    }
+    uint32_t shards = 0x1U << bits;
+
+    sm_legacy_allocator legacy;
+    sm_allocator allocator = sm_allocator_resolve(&desc->desc, &legacy);
+    size_t alloc_size = offsetof(sm_sharded, shards_) + sizeof(smallmap*) * shards;
+    sm_sharded* map = (sm_sharded*)allocator.alloc(allocator.ctx, alloc_size, SM_ALLOC_ALIGN);
+    if(NULL == map) {
+        return NULL;
+    }
+    memset(map, 0, alloc_size);
+    map->shard_bits_ = bits;
+    map->value_size_ = desc->desc.value_size;
+    map->allocator_ = allocator;
+    map->legacy_ = legacy;
+    sm_allocator_rebind(&map->allocator_, &map->legacy_);
+    for(uint32_t i = 0; i < shards; ++i) {
+        const sm_desc* shard_desc = (NULL != desc->shard_descs) ? &desc->shard_descs[i] : &desc->desc;
+        assert(shard_desc->hasher == desc->desc.hasher);
+        assert((shard_desc->flags & SM_FLAG_STRING) == (desc->desc.flags & SM_FLAG_STRING));
+        assert(shard_desc->value_size == desc->desc.value_size);
+        map->shards_[i] = sm_construct_desc(shard_desc);
+        if(NULL == map->shards_[i]) {
+            sm_sharded_destruct(map);
+            return NULL;
+        }
+    }
+    return map;
+}
+
+void sm_sharded_destruct(sm_sharded* map)
+{
+    if(NULL == map) {
+        return;
+    }
+    uint32_t shards = 0x1U << map->shard_bits_;
+    for(uint32_t i = 0; i < shards; ++i) {
+        sm_destruct(map->shards_[i]);
+    }
+    // The allocator is copied out first, since an adapted one has its context in the wrapper
+    sm_legacy_allocator legacy = map->legacy_;
+    sm_allocator allocator = map->allocator_;
+    sm_allocator_rebind(&allocator, &legacy);
+    size_t alloc_size = offsetof(sm_sharded, shards_) + sizeof(smallmap*) * shards;
+    memset(map, 0, alloc_size);
+    allocator.dealloc(allocator.ctx, map, alloc_size);
+}
+
+uint32_t sm_sharded_shard_count(const sm_sharded* map)
+{
+    assert(NULL != map);
+    return 0x1U << map->shard_bits_;
+}
+
+smallmap* sm_sharded_shard(sm_sharded* map, uint32_t index)
+{
+    assert(NULL != map);
+    assert(index < sm_sharded_shard_count(map));
+    return map->shards_[index];
+}
+
+uint32_t sm_sharded_route(const sm_sharded* map, const void* key)
+{
+    assert(NULL != map);
+    return sm_sharded_route_hash(map, sm_sharded_hash(map, key));
+}
+
+uint64_t sm_sharded_size(const sm_sharded* map)
+{
+    assert(NULL != map);
+    uint64_t size = 0;
+    for(uint32_t i = 0; i < sm_sharded_shard_count(map); ++i) {
+        size += sm_size(map->shards_[i]);
+    }
+    return size;
+}
+
+bool sm_sharded_try_get(const sm_sharded* map, const void* key, void* value)
+{
+    assert(NULL != map);
+    uint64_t hash = sm_sharded_hash(map, key);
+    return sm_try_get_hashed(map->shards_[sm_sharded_route_hash(map, hash)], hash, key, value);
+}
+
+bool sm_sharded_add(sm_sharded* map, const void* key, const void* value)
+{
+    assert(NULL != map);
+    uint64_t hash = sm_sharded_hash(map, key);
+    return sm_add_hashed(map->shards_[sm_sharded_route_hash(map, hash)], hash, key, value);
+}
+
+void sm_sharded_remove(sm_sharded* map, const void* key)
+{
+    assert(NULL != map);
+    uint64_t hash = sm_sharded_hash(map, key);
+    sm_remove_hashed(map->shards_[sm_sharded_route_hash(map, hash)], hash, key);
+}
+
+/**
+ * @struct sm_sharded_job
+ * @brief work of a thread in sm_sharded_build
+ */
+typedef struct sm_sharded_job_t
+{
+    sm_sharded* map;
+    const void* const* keys; //!< input keys
+    const uint8_t* values; //!< input values
+    uint32_t* routes; //!< shard of each key
+    uint64_t* hashes; //!< hash of each key
+    uint32_t* counts; //!< number of keys per shard in each slice, then the next output index
+    const uint32_t* starts; //!< first output index of each shard
+    const void** shard_keys; //!< keys grouped by shard
+    uint64_t* shard_hashes; //!< hashes grouped by shard
+    uint8_t* shard_values; //!< values grouped by shard
+    uint32_t begin; //!< first key of the slice
+    uint32_t end; //!< end of the slice
+    uint32_t index; //!< index of the thread
+    uint32_t threads; //!< number of threads
+    uint32_t added; //!< number of items added by this thread
+} sm_sharded_job;
+
+/**
+ * @brief hash and route keys in the slice, and count them by shard
+ */
+static void sm_sharded_job_route(void* arg)
+{
+    sm_sharded_job* job = (sm_sharded_job*)arg;
+    uint32_t* counts = job->counts + (size_t)job->index * sm_sharded_shard_count(job->map);
+    for(uint32_t i = job->begin; i < job->end; ++i) {
+        uint64_t hash = sm_sharded_hash(job->map, job->keys[i]);
+        uint32_t shard = sm_sharded_route_hash(job->map, hash);
+        job->hashes[i] = hash;
+        job->routes[i] = shard;
+        ++counts[shard];
+    }
+}
+
+/**
+ * @brief copy keys, hashes and values in the slice to their shard's range, keeping the input order
+ */
+static void sm_sharded_job_scatter(void* arg)
+{
+    sm_sharded_job* job = (sm_sharded_job*)arg;
+    uint32_t* next = job->counts + (size_t)job->index * sm_sharded_shard_count(job->map);
+    size_t value_size = job->map->value_size_;
+    for(uint32_t i = job->begin; i < job->end; ++i) {
+        uint32_t dst = next[job->routes[i]]++;
+        job->shard_keys[dst] = job->keys[i];
+        job->shard_hashes[dst] = job->hashes[i];
+        memcpy(job->shard_values + dst * value_size, job->values + i * value_size, value_size);
+    }
+}
+
+/**
+ * @brief build the shards which this thread owns
+ */
+static void sm_sharded_job_build(void* arg)
+{
+    sm_sharded_job* job = (sm_sharded_job*)arg;
+    uint32_t shards = sm_sharded_shard_count(job->map);
+    size_t value_size = job->map->value_size_;
+    for(uint32_t i = job->index; i < shards; i += job->threads) {
+        uint32_t start = job->starts[i];
+        // Keys are hashed once, for routing
+        job->added += sm_build_hashed(
+            job->map->shards_[i],
+            job->shard_hashes + start,
+            job->shard_keys + start,
+            job->shard_values + start * value_size,
+            job->starts[i + 1] - start);
+    }
+}
+
+/**
+ * @brief run a phase on all jobs, the caller runs the first one, and the ones which cannot be started
+ */
+static void sm_sharded_run(sm_sharded_job* jobs, sm_thread* handles, uint32_t threads, sm_thread_proc proc)
+{
+    bool* started = (bool*)(handles + threads);
+    for(uint32_t i = 1; i < threads; ++i) {
+        started[i] = sm_thread_create(&handles[i], proc, &jobs[i]);
+    }
+    proc(&jobs[0]);
+    for(uint32_t i = 1; i < threads; ++i) {
+        if(started[i]) {
+            sm_thread_join(handles[i]);
+        } else {
+            proc(&jobs[i]);
+        }
+    }
+}
+
+uint32_t sm_sharded_build(sm_sharded* map, const void* const* keys, const void* values, uint32_t count, uint32_t threads)
+{
+    assert(NULL != map);
+    assert(0 == count || NULL != keys);
+    assert(0 == count || NULL != values);
+    uint32_t shards = sm_sharded_shard_count(map);
+    if(threads <= 0) {
+        threads = sm_thread_hardware_concurrency();
+    }
+    // Shards are the unit of building
+    threads = (shards < threads) ? shards : threads;
+    threads = (count / SM_SHARDED_MIN_SLICE < threads) ? count / SM_SHARDED_MIN_SLICE : threads;
+    threads = (threads < 1) ? 1 : threads;
+
+    size_t jobs_size = SM_ALIGN(sizeof(sm_sharded_job) * threads);
+    size_t handles_size = SM_ALIGN((sizeof(sm_thread) + sizeof(bool)) * threads);
+    size_t counts_size = SM_ALIGN(sizeof(uint32_t) * shards * threads);
+    size_t starts_size = SM_ALIGN(sizeof(uint32_t) * (shards + 1));
+    size_t routes_size = SM_ALIGN(sizeof(uint32_t) * count);
+    size_t hashes_size = SM_ALIGN(sizeof(uint64_t) * count);
+    size_t keys_size = SM_ALIGN(sizeof(void*) * count);
+    size_t values_size = SM_ALIGN((size_t)map->value_size_ * count);
+    size_t buffer_size = jobs_size + handles_size + counts_size + starts_size + routes_size + 2 * hashes_size + keys_size + values_size;
+    uint8_t* buffer = (uint8_t*)map->allocator_.alloc(map->allocator_.ctx, buffer_size, SM_BUFFER_ALIGN);
+    if(NULL == buffer) {
+        return 0;
+    }
+    sm_sharded_job* jobs = (sm_sharded_job*)buffer;
+    sm_thread* handles = (sm_thread*)(buffer + jobs_size);
+    uint32_t* counts = (uint32_t*)(buffer + jobs_size + handles_size);
+    uint32_t* starts = (uint32_t*)((uint8_t*)counts + counts_size);
+    uint32_t* routes = (uint32_t*)((uint8_t*)starts + starts_size);
+    uint64_t* hashes = (uint64_t*)((uint8_t*)routes + routes_size);
+    uint64_t* shard_hashes = (uint64_t*)((uint8_t*)hashes + hashes_size);
+    const void** shard_keys = (const void**)((uint8_t*)shard_hashes + hashes_size);
+    uint8_t* shard_values = (uint8_t*)shard_keys + keys_size;
+    memset(counts, 0, counts_size);
+
+    uint32_t slice = count / threads;
+    for(uint32_t i = 0; i < threads; ++i) {
+        sm_sharded_job* job = &jobs[i];
+        job->map = map;
+        job->keys = keys;
+        job->values = (const uint8_t*)values;
+        job->routes = routes;
+        job->hashes = hashes;
+        job->counts = counts;
+        job->starts = starts;
+        job->shard_keys = shard_keys;
+        job->shard_hashes = shard_hashes;
+        job->shard_values = shard_values;
+        job->begin = slice * i;
+        job->end = (i + 1 == threads) ? count : slice * (i + 1);
+        job->index = i;
+        job->threads = threads;
+        job->added = 0;
+    }
+    sm_sharded_run(jobs, handles, threads, sm_sharded_job_route);
+
+    // Each shard takes a range in slice order, so the first of duplicated keys is still added first
+    uint32_t offset = 0;
+    for(uint32_t i = 0; i < shards; ++i) {
+        starts[i] = offset;
+        for(uint32_t j = 0; j < threads; ++j) {
+            uint32_t n = counts[(size_t)j * shards + i];
+            counts[(size_t)j * shards + i] = offset;
+            offset += n;
+        }
+    }
+    starts[shards] = offset;
+    sm_sharded_run(jobs, handles, threads, sm_sharded_job_scatter);
+    sm_sharded_run(jobs, handles, threads, sm_sharded_job_build);
+
+    uint32_t added = 0;
+    for(uint32_t i = 0; i < threads; ++i) {
+        added += jobs[i].added;
+    }
+    map->allocator_.dealloc(map->allocator_.ctx, buffer, buffer_size);
+    return added;
+}
+
+bool sm_sharded_for_each(const sm_sharded* map, bool (*fn)(void*, const void*, const void*), void* ctx)
+{
+    assert(NULL != map);
+    assert(NULL != fn);
+    for(uint32_t i = 0; i < sm_sharded_shard_count(map); ++i) {
+        if(!sm_for_each(map->shards_[i], fn, ctx)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool sm_sharded_merge(sm_sharded* map, smallmap* dst)
+{
+    assert(NULL != map);
+    assert(NULL != dst);
+    if(!sm_reserve64(dst, sm_size(dst) + sm_sharded_size(map))) {
+        return false;
+    }
+    for(uint32_t i = 0; i < sm_sharded_shard_count(map); ++i) {
+        if(!sm_merge(dst, map->shards_[i])) {
+            return false;
+        }
+    }
+    return true;
+}
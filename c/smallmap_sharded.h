@@ -0,0 +1,114 @@
+#ifndef INC_SMALLMAP_SHARDED_H_
+#define INC_SMALLMAP_SHARDED_H_
+/**
+ * A map split into independent smallmap shards.
+ *
+ * A key is hashed once, routed to a shard by the high bits of its remixed hash, and the shard looks it up with the same hash.
+ * Each shard has its own buffer, allocator and resizing, so threads which work on distinct shards never share
+ * a cache line or wait for each other's expanding. The wrapper itself is not thread-safe,
+ * sm_sharded_build fills shards in parallel, and callers can work on distinct shards from their own threads.
+ */
+#include "smallmap.h"
+
+struct sm_sharded_t;
+typedef struct sm_sharded_t sm_sharded;
+
+/**
+ * @struct sm_sharded_desc
+ * @brief parameters to construct a sharded map
+ */
+typedef struct sm_sharded_desc_t
+{
+    sm_desc desc; //!< parameters of shards, and the allocator of the wrapper
+    const sm_desc* shard_descs; //!< parameters of each shard to give them their own allocators, NULL means desc for all
+    uint32_t shards; //!< number of shards rounded up to a power of two, 0 means the number of logical processors
+} sm_sharded_desc;
+
+/**
+ * @brief construct a sharded map context
+ * @return NULL if cannot allocate, or a shard cannot be constructed
+ * @param [in] desc ... parameters, shard_descs must have the rounded up number of shards and the same callbacks but allocators
+ */
+sm_sharded* sm_sharded_construct(const sm_sharded_desc* desc);
+
+/**
+ * @brief destruct a sharded map context with its shards
+ */
+void sm_sharded_destruct(sm_sharded* map);
+
+/**
+ * @brief number of shards
+ */
+uint32_t sm_sharded_shard_count(const sm_sharded* map);
+
+/**
+ * @brief a shard, which can be used as a smallmap while the wrapper is not used
+ * @param [in] map ... a map context
+ * @param [in] index ... index of a shard less than sm_sharded_shard_count
+ */
+smallmap* sm_sharded_shard(sm_sharded* map, uint32_t index);
+
+/**
+ * @brief index of the shard for a key
+ * @param [in] map ... a map context
+ * @param [in] key ... a target key
+ */
+uint32_t sm_sharded_route(const sm_sharded* map, const void* key);
+
+/**
+ * @brief number of items in all shards
+ */
+uint64_t sm_sharded_size(const sm_sharded* map);
+
+/**
+ * @brief find an item
+ * @return true if can find
+ * @param [in] map ... a map context
+ * @param [in] key ... a target key
+ * @param [out] value ... copy the value, if found
+ */
+bool sm_sharded_try_get(const sm_sharded* map, const void* key, void* value);
+
+/**
+ * @brief add an item to a map
+ * @return result of adding
+ * @param [in] map ... a map context
+ * @param [in] key ... a target key
+ * @param [in] value ... a value
+ */
+bool sm_sharded_add(sm_sharded* map, const void* key, const void* value);
+
+/**
+ * @brief remove an item from a map
+ * @param [in] map ... a map context
+ * @param [in] key ... a target key
+ */
+void sm_sharded_remove(sm_sharded* map, const void* key);
+
+/**
+ * @brief add many items at once with threads
+ * @details keys are routed and partitioned by shard in parallel, then each thread builds its own shards with sm_build.
+ * A key which is already in the map, or appears earlier in keys, is skipped.
+ * @return number of added items, each shard stops adding at its first failure
+ * @param [in] map ... a map context
+ * @param [in] keys ... keys to add
+ * @param [in] values ... count values packed by value size
+ * @param [in] count ... number of items
+ * @param [in] threads ... number of threads including the caller, 0 means the number of logical processors
+ */
+uint32_t sm_sharded_build(sm_sharded* map, const void* const* keys, const void* values, uint32_t count, uint32_t threads);
+
+/**
+ * @brief call fn for each item of shards in order until it returns false, see sm_for_each
+ * @return false if fn stopped
+ */
+bool sm_sharded_for_each(const sm_sharded* map, bool (*fn)(void*, const void*, const void*), void* ctx);
+
+/**
+ * @brief move all items to a single map, then shards are left empty, see sm_merge
+ * @return false if cannot allocate, shards merged before the failure stay moved
+ * @param [in] map ... a map context
+ * @param [in] dst ... a map to add items to
+ */
+bool sm_sharded_merge(sm_sharded* map, smallmap* dst);
+#endif //INC_SMALLMAP_SHARDED_H_
@@ -0,0 +1,205 @@
+#ifndef INC_SMALLMAP_TYPED_H_
+#define INC_SMALLMAP_TYPED_H_
+/**
+ * Typed maps specialized at compile time.
+ *
+ * SM_DEFINE_MAP(name, key_type, value_type, hash_fn, eq_fn) defines a map type "name" and static inline functions
+ * name_construct, name_destruct, name_find, name_try_get, name_add, name_remove_at and name_remove.
+ * The layout and probing are the same as smallmap's default mode, but strides are constants and hash_fn/eq_fn are called directly.
+ *   uint32_t hash_fn(key_type key);
+ *   bool eq_fn(key_type key0, key_type key1);
+ * Keys and values are copied by assignment and never destructed, use sm_construct for types which own resources.
+ * Define SM_TYPED_ALLOCATE and SM_TYPED_DEALLOCATE before including this header to replace malloc and free.
+ */
+#include "smallmap.h"
+#include "smallmap_ctrl.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef SM_TYPED_ALLOCATE
+#    define SM_TYPED_ALLOCATE(size) malloc(size)
+#endif
+#ifndef SM_TYPED_DEALLOCATE
+#    define SM_TYPED_DEALLOCATE(ptr) free(ptr)
+#endif
+
+#define SM_TYPED_THRESHOLD(capacity) (((capacity) * 7) / 10) //!< the same load factor as smallmap
+
+#define SM_DEFINE_MAP(name, key_type, value_type, hash_fn, eq_fn) \
+    typedef struct name##_t \
+    { \
+        uint64_t size_; \
+        uint64_t deleted_; \
+        uint64_t capacity_; \
+        uint64_t mask_; \
+        uint64_t resize_threshold_; \
+        uint8_t* ctrl_; \
+        key_type* keys_; \
+        value_type* values_; \
+    } name; \
+\
+    static inline uint32_t name##_find_(const name* map, uint64_t hash, key_type key) \
+    { \
+        uint8_t tag = SM_H2(hash); \
+        uint64_t pos = SM_H1(hash) & map->mask_; \
+        for(uint64_t probed = 0; probed < map->capacity_; probed += SM_GROUP_WIDTH) { \
+            const uint8_t* ctrl = &map->ctrl_[pos]; \
+            sm_bitmask empty = sm_group_match_empty(ctrl); \
+            sm_bitmask match = sm_group_match(ctrl, tag); \
+            if(0 != empty) { \
+                match &= (empty & (~empty + 1)) - 1; \
+            } \
+            while(0 != match) { \
+                uint64_t i = (pos + sm_bitmask_lowest(match)) & map->mask_; \
+                if(eq_fn(map->keys_[i], key)) { \
+                    return (uint32_t)i; \
+                } \
+                match &= match - 1; \
+            } \
+            if(0 != empty) { \
+                break; \
+            } \
+            pos = (pos + SM_GROUP_WIDTH) & map->mask_; \
+        } \
+        return SM_INVALID; \
+    } \
+\
+    static inline uint64_t name##_find_free_(const name* map, uint64_t hash) \
+    { \
+        uint64_t pos = SM_H1(hash) & map->mask_; \
+        for(;;) { \
+            sm_bitmask vacant = sm_group_match_free(&map->ctrl_[pos]); \
+            if(0 != vacant) { \
+                return (pos + sm_bitmask_lowest(vacant)) & map->mask_; \
+            } \
+            pos = (pos + SM_GROUP_WIDTH) & map->mask_; \
+        } \
+    } \
+\
+    static inline bool name##_rehash_(name* map, uint64_t next_capacity) \
+    { \
+        if(SM_INVALID <= next_capacity) { \
+            return false; \
+        } \
+        size_t ctrl_size = SM_ALIGN(next_capacity + SM_GROUP_WIDTH); \
+        size_t key_size = SM_ALIGN(next_capacity * sizeof(key_type)); \
+        size_t value_size = SM_ALIGN(next_capacity * sizeof(value_type)); \
+        uint8_t* buffer = (uint8_t*)SM_TYPED_ALLOCATE(ctrl_size + key_size + value_size); \
+        if(NULL == buffer) { \
+            return false; \
+        } \
+        memset(buffer, SM_CTRL_EMPTY, ctrl_size); \
+        uint8_t* prev_ctrl = map->ctrl_; \
+        key_type* prev_keys = map->keys_; \
+        value_type* prev_values = map->values_; \
+        uint64_t prev_capacity = map->capacity_; \
+        map->deleted_ = 0; \
+        map->capacity_ = next_capacity; \
+        map->mask_ = next_capacity - 1; \
+        map->resize_threshold_ = SM_TYPED_THRESHOLD(next_capacity); \
+        map->ctrl_ = buffer; \
+        map->keys_ = (key_type*)(buffer + ctrl_size); \
+        map->values_ = (value_type*)(buffer + ctrl_size + key_size); \
+        for(uint64_t i = 0; i < prev_capacity; ++i) { \
+            if(!SM_IS_FULL(prev_ctrl[i])) { \
+                continue; \
+            } \
+            uint64_t hash = sm_spread32(hash_fn(prev_keys[i])); \
+            uint64_t pos = name##_find_free_(map, hash); \
+            sm_ctrl_set(map->ctrl_, map->capacity_, pos, SM_H2(hash)); \
+            map->keys_[pos] = prev_keys[i]; \
+            map->values_[pos] = prev_values[i]; \
+        } \
+        SM_TYPED_DEALLOCATE(prev_ctrl); \
+        return true; \
+    } \
+\
+    static inline bool name##_expand_(name* map) \
+    { \
+        if(map->capacity_ <= 0) { \
+            return name##_rehash_(map, 16); \
+        } \
+        if(0 < map->deleted_ && map->size_ < (map->resize_threshold_ >> 1)) { \
+            return name##_rehash_(map, map->capacity_); \
+        } \
+        return name##_rehash_(map, map->capacity_ << 1); \
+    } \
+\
+    static inline bool name##_construct(name* map) \
+    { \
+        memset(map, 0, sizeof(name)); \
+        return name##_expand_(map); \
+    } \
+\
+    static inline void name##_destruct(name* map) \
+    { \
+        SM_TYPED_DEALLOCATE(map->ctrl_); \
+        memset(map, 0, sizeof(name)); \
+    } \
+\
+    static inline uint32_t name##_find(const name* map, key_type key) \
+    { \
+        return name##_find_(map, sm_spread32(hash_fn(key)), key); \
+    } \
+\
+    static inline bool name##_try_get(const name* map, key_type key, value_type* value) \
+    { \
+        uint32_t pos = name##_find(map, key); \
+        if(SM_INVALID == pos) { \
+            return false; \
+        } \
+        *value = map->values_[pos]; \
+        return true; \
+    } \
+\
+    static inline bool name##_add(name* map, key_type key, value_type value) \
+    { \
+        uint64_t hash = sm_spread32(hash_fn(key)); \
+        if(SM_INVALID != name##_find_(map, hash, key)) { \
+            return false; \
+        } \
+        if(map->resize_threshold_ <= (map->size_ + map->deleted_) && !name##_expand_(map)) { \
+            return false; \
+        } \
+        uint64_t pos = name##_find_free_(map, hash); \
+        if(SM_CTRL_DELETED == map->ctrl_[pos]) { \
+            --map->deleted_; \
+        } \
+        sm_ctrl_set(map->ctrl_, map->capacity_, pos, SM_H2(hash)); \
+        map->keys_[pos] = key; \
+        map->values_[pos] = value; \
+        ++map->size_; \
+        return true; \
+    } \
+\
+    static inline void name##_remove_at(name* map, uint32_t pos) \
+    { \
+        assert(SM_INVALID != pos); \
+        assert(SM_IS_FULL(map->ctrl_[pos])); \
+        if(SM_CTRL_EMPTY == map->ctrl_[(pos + 1) & map->mask_]) { \
+            sm_ctrl_set(map->ctrl_, map->capacity_, pos, SM_CTRL_EMPTY); \
+            uint64_t prev = (pos - 1) & map->mask_; \
+            while(SM_CTRL_DELETED == map->ctrl_[prev]) { \
+                sm_ctrl_set(map->ctrl_, map->capacity_, prev, SM_CTRL_EMPTY); \
+                --map->deleted_; \
+                prev = (prev - 1) & map->mask_; \
+            } \
+        } else { \
+            sm_ctrl_set(map->ctrl_, map->capacity_, pos, SM_CTRL_DELETED); \
+            ++map->deleted_; \
+        } \
+        --map->size_; \
+    } \
+\
+    static inline void name##_remove(name* map, key_type key) \
+    { \
+        uint32_t pos = name##_find(map, key); \
+        if(SM_INVALID == pos) { \
+            return; \
+        } \
+        name##_remove_at(map, pos); \
+    }
+
+#endif //INC_SMALLMAP_TYPED_H_
@@ -0,0 +1,182 @@
+#include "smallmap.hpp"
+#include <cassert>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace
+{
+    // Counts live objects, to check that rehash and erase destruct what they construct
+    struct counted
+    {
+        static int live_;
+        int value_;
+
+        explicit counted(int value)
+            : value_(value)
+        {
+            ++live_;
+        }
+
+        counted(counted&& other) noexcept
+            : value_(other.value_)
+        {
+            ++live_;
+        }
+
+        counted(const counted&) = delete;
+        counted& operator=(const counted&) = delete;
+
+        ~counted()
+        {
+            --live_;
+        }
+    };
+    int counted::live_ = 0;
+
+    void test_integer()
+    {
+        sm::smallmap<uint32_t, uint32_t> map;
+        for(uint32_t i = 0; i < 1000; ++i) {
+            bool inserted = map.try_emplace(i, i * 2).second;
+            assert(inserted);
+            (void)inserted;
+        }
+        assert(1000 == map.size());
+        assert(!map.try_emplace(10, 0).second);
+        for(uint32_t i = 0; i < 1000; ++i) {
+            auto it = map.find(i);
+            assert(it != map.end());
+            assert(it->second == i * 2);
+            (void)it;
+        }
+        for(uint32_t i = 0; i < 1000; i += 2) {
+            size_t erased = map.erase(i);
+            assert(1 == erased);
+            (void)erased;
+        }
+        size_t count = 0;
+        for(auto item: map) {
+            assert(1 == (item.first & 1));
+            (void)item;
+            ++count;
+        }
+        assert(500 == count);
+        assert(500 == map.size());
+        map[2] = 7;
+        assert(7 == map.find(2)->second);
+        (void)count;
+    }
+
+    void test_string()
+    {
+        using map_type = sm::smallmap<std::string, int, sm::string_hash, std::equal_to<>>;
+        map_type map;
+        for(int i = 0; i < 256; ++i) {
+            map.emplace("key_" + std::to_string(i), i);
+        }
+        std::string_view view = "key_42";
+        auto it = map.find(view);
+        assert(it != map.end() && 42 == it->second);
+        assert(map.contains("key_255"));
+        assert(!map.contains(std::string_view("key_256")));
+        bool inserted = map.try_emplace(std::string_view("key_256"), 256).second;
+        assert(inserted);
+        size_t erased = map.erase(std::string_view("key_0"));
+        assert(1 == erased);
+        // An iterator is not a heterogeneous key, and erasing it gives the next one
+        map_type::iterator next = map.erase(map.find("key_1"));
+        assert(!map.contains("key_1"));
+        assert(next == map.end() || map.contains(next->first));
+        size_t count = 0;
+        for(auto it = map.begin(); it != map.end();) {
+            if(0 == (it->second & 1)) {
+                it = map.erase(it);
+            } else {
+                ++it;
+            }
+            ++count;
+        }
+        assert(255 == count);
+        assert(127 == map.size());
+
+        map_type copy(map);
+        map_type moved(std::move(map));
+        assert(copy.size() == moved.size());
+        assert(map.empty());
+        assert(!moved.contains("key_256"));
+        assert(moved.contains("key_255"));
+        (void)it;
+        (void)inserted;
+        (void)erased;
+        (void)next;
+        (void)count;
+    }
+
+    void test_objects()
+    {
+        {
+            sm::smallmap<int, std::unique_ptr<int>> map;
+            for(int i = 0; i < 100; ++i) {
+                map.try_emplace(i, std::make_unique<int>(i));
+            }
+            assert(99 == *map.find(99)->second);
+
+            sm::smallmap<int, counted> objects;
+            for(int i = 0; i < 100; ++i) {
+                objects.try_emplace(i, i);
+            }
+            assert(100 == counted::live_);
+            objects.erase(3);
+            assert(99 == counted::live_);
+        }
+        assert(0 == counted::live_);
+    }
+
+#ifdef __cpp_exceptions
+    // Throws from its constructor if asked to
+    struct throwing
+    {
+        explicit throwing(bool fail)
+        {
+            if(fail) {
+                throw std::runtime_error("throwing");
+            }
+        }
+    };
+
+    // A value which throws leaves neither the item nor its key
+    void test_exceptions()
+    {
+        sm::smallmap<std::shared_ptr<int>, throwing> map;
+        std::shared_ptr<int> key = std::make_shared<int>(1);
+        bool thrown = false;
+        try {
+            map.try_emplace(key, true);
+        } catch(const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(1 == key.use_count());
+        assert(map.empty() && map.end() == map.find(key));
+        bool inserted = map.try_emplace(key, false).second;
+        assert(inserted);
+        assert(2 == key.use_count());
+        (void)thrown;
+        (void)inserted;
+    }
+#endif
+} // namespace
+
+int main(void)
+{
+    test_integer();
+    test_string();
+    test_objects();
+#ifdef __cpp_exceptions
+    test_exceptions();
+#endif
+    return 0;
+}
@@ -0,0 +1,674 @@
+#ifndef INC_SMALLMAP_HPP_
+#define INC_SMALLMAP_HPP_
+/**
+ * C++ front-end of smallmap.
+ *
+ * The table design is the same as the C map's default mode, control bytes with group matching and tombstones,
+ * but keys and values are real C++ objects which are constructed in place and moved on rehash.
+ */
+#include "smallmap_ctrl.h"
+#include "tshash.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace sm
+{
+    /**
+     * @brief types which can be moved by memcpy and then forgotten, specialize to opt in
+     */
+    template<class T>
+    struct is_trivially_relocatable: std::is_trivially_copyable<T>
+    {
+    };
+
+    template<class T, class = void>
+    struct has_is_transparent: std::false_type
+    {
+    };
+
+    template<class T>
+    struct has_is_transparent<T, std::void_t<typename T::is_transparent>>: std::true_type
+    {
+    };
+
+    /**
+     * @brief a transparent hasher for string-like keys, std::string_view and const char* can find std::string keys
+     */
+    struct string_hash
+    {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view str) const noexcept
+        {
+            return static_cast<size_t>(tshash64(str.size(), str.data(), TSHASH_DEFUALT_SEED));
+        }
+    };
+
+    template<class K, class V, class Hash = std::hash<K>, class Eq = std::equal_to<K>, class Alloc = std::allocator<std::pair<const K, V>>>
+    class smallmap
+    {
+        using buffer_type = std::max_align_t;
+        using allocator_type = typename std::allocator_traits<Alloc>::template rebind_alloc<buffer_type>;
+        using allocator_traits = std::allocator_traits<allocator_type>;
+
+        static_assert(alignof(K) <= alignof(buffer_type) && alignof(V) <= alignof(buffer_type), "over-aligned types are not supported");
+        // Items are relocated one by one while rehashing, a throwing move could not be undone
+        static_assert(is_trivially_relocatable<K>::value || std::is_nothrow_move_constructible_v<K>, "keys must be nothrow move constructible");
+        static_assert(is_trivially_relocatable<V>::value || std::is_nothrow_move_constructible_v<V>, "values must be nothrow move constructible");
+
+    public:
+        using key_type = K;
+        using mapped_type = V;
+        using size_type = size_t;
+        using hasher = Hash;
+        using key_equal = Eq;
+        using reference = std::pair<const K&, V&>;
+        using const_reference = std::pair<const K&, const V&>;
+
+        template<bool Const>
+        class iterator_base
+        {
+            using map_type = std::conditional_t<Const, const smallmap, smallmap>;
+            using reference_type = std::conditional_t<Const, const_reference, reference>;
+
+            struct arrow_proxy
+            {
+                reference_type ref_;
+                const reference_type* operator->() const
+                {
+                    return &ref_;
+                }
+            };
+
+        public:
+            iterator_base() = default;
+
+            iterator_base(map_type* map, size_type pos)
+                : map_(map)
+                , pos_(pos)
+            {
+                skip();
+            }
+
+            template<bool C = Const, typename = std::enable_if_t<C>>
+            iterator_base(const iterator_base<false>& other)
+                : map_(other.map_)
+                , pos_(other.pos_)
+            {
+            }
+
+            reference_type operator*() const
+            {
+                return {map_->keys_[pos_], map_->values_[pos_]};
+            }
+
+            arrow_proxy operator->() const
+            {
+                return {**this};
+            }
+
+            iterator_base& operator++()
+            {
+                ++pos_;
+                skip();
+                return *this;
+            }
+
+            iterator_base operator++(int)
+            {
+                iterator_base result = *this;
+                ++*this;
+                return result;
+            }
+
+            size_type position() const
+            {
+                return pos_;
+            }
+
+            friend bool operator==(const iterator_base& x0, const iterator_base& x1)
+            {
+                return x0.pos_ == x1.pos_;
+            }
+
+            friend bool operator!=(const iterator_base& x0, const iterator_base& x1)
+            {
+                return x0.pos_ != x1.pos_;
+            }
+
+        private:
+            friend class smallmap;
+            template<bool>
+            friend class iterator_base;
+
+            void skip()
+            {
+                while(pos_ < map_->capacity_ && !SM_IS_FULL(map_->ctrl_[pos_])) {
+                    ++pos_;
+                }
+            }
+
+            map_type* map_ = nullptr;
+            size_type pos_ = 0;
+        };
+        using iterator = iterator_base<false>;
+        using const_iterator = iterator_base<true>;
+
+    private:
+        // Iterators are excluded, so that erase(iterator) is not taken as a heterogeneous key
+        template<class Q>
+        using enable_transparent = std::enable_if_t<
+            has_is_transparent<Hash>::value && has_is_transparent<Eq>::value && !std::is_same_v<std::decay_t<Q>, K>
+                && !std::is_same_v<std::decay_t<Q>, iterator> && !std::is_same_v<std::decay_t<Q>, const_iterator>,
+            int>;
+
+    public:
+
+        explicit smallmap(const Hash& hash = Hash(), const Eq& eq = Eq(), const Alloc& alloc = Alloc())
+            : hash_(hash)
+            , eq_(eq)
+            , allocator_(alloc)
+        {
+        }
+
+        smallmap(const smallmap& other)
+            : hash_(other.hash_)
+            , eq_(other.eq_)
+            , allocator_(allocator_traits::select_on_container_copy_construction(other.allocator_))
+        {
+            reserve(other.size_);
+            for(const_reference item: other) {
+                try_emplace(item.first, item.second);
+            }
+        }
+
+        smallmap(smallmap&& other) noexcept
+            : hash_(std::move(other.hash_))
+            , eq_(std::move(other.eq_))
+            , allocator_(std::move(other.allocator_))
+        {
+            steal(other);
+        }
+
+        ~smallmap()
+        {
+            release();
+        }
+
+        smallmap& operator=(const smallmap& other)
+        {
+            if(this != &other) {
+                smallmap tmp(other);
+                swap(tmp);
+            }
+            return *this;
+        }
+
+        smallmap& operator=(smallmap&& other) noexcept
+        {
+            if(this != &other) {
+                release();
+                hash_ = std::move(other.hash_);
+                eq_ = std::move(other.eq_);
+                allocator_ = std::move(other.allocator_);
+                steal(other);
+            }
+            return *this;
+        }
+
+        void swap(smallmap& other) noexcept
+        {
+            using std::swap;
+            swap(hash_, other.hash_);
+            swap(eq_, other.eq_);
+            swap(allocator_, other.allocator_);
+            swap(size_, other.size_);
+            swap(deleted_, other.deleted_);
+            swap(capacity_, other.capacity_);
+            swap(mask_, other.mask_);
+            swap(buffer_, other.buffer_);
+            swap(buffer_count_, other.buffer_count_);
+            swap(ctrl_, other.ctrl_);
+            swap(keys_, other.keys_);
+            swap(values_, other.values_);
+        }
+
+        size_type size() const
+        {
+            return size_;
+        }
+
+        bool empty() const
+        {
+            return size_ <= 0;
+        }
+
+        size_type capacity() const
+        {
+            return capacity_;
+        }
+
+        iterator begin()
+        {
+            return iterator(this, 0);
+        }
+
+        iterator end()
+        {
+            return iterator(this, capacity_);
+        }
+
+        const_iterator begin() const
+        {
+            return const_iterator(this, 0);
+        }
+
+        const_iterator end() const
+        {
+            return const_iterator(this, capacity_);
+        }
+
+        /**
+         * @brief make room for the number of items without rehashing
+         */
+        bool reserve(size_type size)
+        {
+            size_type capacity = (capacity_ <= 0) ? 16 : capacity_;
+            while(threshold(capacity) <= size) {
+                capacity <<= 1;
+            }
+            return capacity_ == capacity || rehash(capacity);
+        }
+
+        void clear()
+        {
+            destroy_items();
+            if(nullptr != ctrl_) {
+                std::memset(ctrl_, SM_CTRL_EMPTY, capacity_ + SM_GROUP_WIDTH);
+            }
+            size_ = 0;
+            deleted_ = 0;
+        }
+
+        iterator find(const K& key)
+        {
+            return iterator(this, find_(hash_key(key), key));
+        }
+
+        const_iterator find(const K& key) const
+        {
+            return const_iterator(this, find_(hash_key(key), key));
+        }
+
+        template<class Q, typename = enable_transparent<Q>>
+        iterator find(const Q& key)
+        {
+            return iterator(this, find_(hash_key(key), key));
+        }
+
+        template<class Q, typename = enable_transparent<Q>>
+        const_iterator find(const Q& key) const
+        {
+            return const_iterator(this, find_(hash_key(key), key));
+        }
+
+        bool contains(const K& key) const
+        {
+            return capacity_ != find_(hash_key(key), key);
+        }
+
+        template<class Q, typename = enable_transparent<Q>>
+        bool contains(const Q& key) const
+        {
+            return capacity_ != find_(hash_key(key), key);
+        }
+
+        /**
+         * @brief construct a value in place if the key does not exist, nothing is constructed if it exists
+         */
+        template<class... Args>
+        std::pair<iterator, bool> try_emplace(const K& key, Args&&... args)
+        {
+            return try_emplace_(key, std::forward<Args>(args)...);
+        }
+
+        template<class... Args>
+        std::pair<iterator, bool> try_emplace(K&& key, Args&&... args)
+        {
+            return try_emplace_(std::move(key), std::forward<Args>(args)...);
+        }
+
+        /**
+         * @brief heterogeneous try_emplace, the key is constructed from the argument only when inserted
+         */
+        template<class Q, class... Args, typename = enable_transparent<Q>>
+        std::pair<iterator, bool> try_emplace(Q&& key, Args&&... args)
+        {
+            return try_emplace_(std::forward<Q>(key), std::forward<Args>(args)...);
+        }
+
+        /**
+         * @brief construct a key from the first argument, and a value from the rest, if the key does not exist
+         */
+        template<class KArg, class... Args>
+        std::pair<iterator, bool> emplace(KArg&& key, Args&&... args)
+        {
+            if constexpr(std::is_same_v<std::decay_t<KArg>, K>) {
+                return try_emplace_(std::forward<KArg>(key), std::forward<Args>(args)...);
+            } else {
+                K tmp(std::forward<KArg>(key));
+                return try_emplace_(std::move(tmp), std::forward<Args>(args)...);
+            }
+        }
+
+        V& operator[](const K& key)
+        {
+            return (*try_emplace_(key).first).second;
+        }
+
+        V& operator[](K&& key)
+        {
+            return (*try_emplace_(std::move(key)).first).second;
+        }
+
+        /**
+         * @brief erase the item at an iterator, other items do not move
+         * @return the iterator next to the erased item
+         */
+        iterator erase(const_iterator it)
+        {
+            erase_at(it.pos_);
+            return iterator(this, it.pos_ + 1);
+        }
+
+        iterator erase(iterator it)
+        {
+            return erase(const_iterator(it));
+        }
+
+        size_type erase(const K& key)
+        {
+            return erase_(hash_key(key), key);
+        }
+
+        template<class Q, typename = enable_transparent<Q>>
+        size_type erase(const Q& key)
+        {
+            return erase_(hash_key(key), key);
+        }
+
+    private:
+        /**
+         * @brief destroy a constructed key unless dismissed, which works without exceptions enabled
+         */
+        struct key_guard
+        {
+            K* key_;
+
+            ~key_guard()
+            {
+                if(nullptr != key_) {
+                    key_->~K();
+                }
+            }
+        };
+
+        static size_type threshold(size_type capacity)
+        {
+            return (capacity * 7) / 10;
+        }
+
+        /**
+         * @brief spread the hash, because std::hash of integers is the identity
+         */
+        template<class Q>
+        size_type hash_key(const Q& key) const
+        {
+            uint64_t x = static_cast<uint64_t>(hash_(key)) * 0x9E3779B97F4A7C15ULL;
+            return static_cast<size_type>(x ^ (x >> 32));
+        }
+
+        template<class Q>
+        size_type find_(size_type hash, const Q& key) const
+        {
+            if(size_ <= 0) {
+                return capacity_;
+            }
+            uint8_t tag = SM_H2(hash);
+            size_type pos = SM_H1(hash) & mask_;
+            for(size_type probed = 0; probed < capacity_; probed += SM_GROUP_WIDTH) {
+                const uint8_t* ctrl = &ctrl_[pos];
+                sm_bitmask empty = sm_group_match_empty(ctrl);
+                sm_bitmask match = sm_group_match(ctrl, tag);
+                if(0 != empty) {
+                    match &= (empty & (~empty + 1)) - 1;
+                }
+                while(0 != match) {
+                    size_type i = (pos + sm_bitmask_lowest(match)) & mask_;
+                    if(eq_(keys_[i], key)) {
+                        return i;
+                    }
+                    match &= match - 1;
+                }
+                if(0 != empty) {
+                    break;
+                }
+                pos = (pos + SM_GROUP_WIDTH) & mask_;
+            }
+            return capacity_;
+        }
+
+        static size_type find_free(const uint8_t* ctrl, size_type mask, size_type hash)
+        {
+            size_type pos = SM_H1(hash) & mask;
+            for(;;) {
+                sm_bitmask vacant = sm_group_match_free(&ctrl[pos]);
+                if(0 != vacant) {
+                    return (pos + sm_bitmask_lowest(vacant)) & mask;
+                }
+                pos = (pos + SM_GROUP_WIDTH) & mask;
+            }
+        }
+
+        size_type find_free(size_type hash) const
+        {
+            return find_free(ctrl_, mask_, hash);
+        }
+
+        template<class Q, class... Args>
+        std::pair<iterator, bool> try_emplace_(Q&& key, Args&&... args)
+        {
+            size_type hash = hash_key(key);
+            size_type pos = find_(hash, key);
+            if(pos != capacity_) {
+                return {iterator(this, pos), false};
+            }
+            if(threshold(capacity_) <= (size_ + deleted_) && !expand()) {
+                return {end(), false};
+            }
+            pos = find_free(hash);
+            ::new(static_cast<void*>(&keys_[pos])) K(std::forward<Q>(key));
+            {
+                // The slot is still free until its control byte is set, so a throwing value must not leave the key behind
+                key_guard guard{&keys_[pos]};
+                ::new(static_cast<void*>(&values_[pos])) V(std::forward<Args>(args)...);
+                guard.key_ = nullptr;
+            }
+            if(SM_CTRL_DELETED == ctrl_[pos]) {
+                --deleted_;
+            }
+            sm_ctrl_set(ctrl_, capacity_, pos, SM_H2(hash));
+            ++size_;
+            return {iterator(this, pos), true};
+        }
+
+        template<class Q>
+        size_type erase_(size_type hash, const Q& key)
+        {
+            size_type pos = find_(hash, key);
+            if(pos == capacity_) {
+                return 0;
+            }
+            erase_at(pos);
+            return 1;
+        }
+
+        void erase_at(size_type pos)
+        {
+            if(SM_CTRL_EMPTY == ctrl_[(pos + 1) & mask_]) {
+                sm_ctrl_set(ctrl_, capacity_, pos, SM_CTRL_EMPTY);
+                size_type prev = (pos - 1) & mask_;
+                while(SM_CTRL_DELETED == ctrl_[prev]) {
+                    sm_ctrl_set(ctrl_, capacity_, prev, SM_CTRL_EMPTY);
+                    --deleted_;
+                    prev = (prev - 1) & mask_;
+                }
+            } else {
+                sm_ctrl_set(ctrl_, capacity_, pos, SM_CTRL_DELETED);
+                ++deleted_;
+            }
+            keys_[pos].~K();
+            values_[pos].~V();
+            --size_;
+        }
+
+        bool expand()
+        {
+            if(capacity_ <= 0) {
+                return rehash(16);
+            }
+            if(0 < deleted_ && size_ < (threshold(capacity_) >> 1)) {
+                return rehash(capacity_);
+            }
+            return rehash(capacity_ << 1);
+        }
+
+        /**
+         * @brief relocate an item, by memcpy if a type is trivially relocatable, otherwise by its nothrow move
+         */
+        static void relocate(K* dst_key, V* dst_value, K* src_key, V* src_value) noexcept
+        {
+            if constexpr(is_trivially_relocatable<K>::value) {
+                std::memcpy(static_cast<void*>(dst_key), static_cast<const void*>(src_key), sizeof(K));
+            } else {
+                ::new(static_cast<void*>(dst_key)) K(std::move(*src_key));
+                src_key->~K();
+            }
+            if constexpr(is_trivially_relocatable<V>::value) {
+                std::memcpy(static_cast<void*>(dst_value), static_cast<const void*>(src_value), sizeof(V));
+            } else {
+                ::new(static_cast<void*>(dst_value)) V(std::move(*src_value));
+                src_value->~V();
+            }
+        }
+
+        /**
+         * @brief move all items to a new buffer, which replaces the current one once it is filled
+         * @details allocation is the only step which can throw, the hasher of stored keys must not
+         */
+        bool rehash(size_type next_capacity)
+        {
+            size_type ctrl_size = SM_ALIGN(next_capacity + SM_GROUP_WIDTH);
+            size_type key_size = SM_ALIGN(next_capacity * sizeof(K));
+            size_type value_size = SM_ALIGN(next_capacity * sizeof(V));
+            size_type total_size = ctrl_size + key_size + value_size;
+            size_type count = (total_size + sizeof(buffer_type) - 1) / sizeof(buffer_type);
+            buffer_type* buffer = allocator_traits::allocate(allocator_, count);
+            uint8_t* ctrl = reinterpret_cast<uint8_t*>(buffer);
+            std::memset(ctrl, SM_CTRL_EMPTY, ctrl_size);
+            K* keys = reinterpret_cast<K*>(ctrl + ctrl_size);
+            V* values = reinterpret_cast<V*>(ctrl + ctrl_size + key_size);
+            size_type mask = next_capacity - 1;
+
+            for(size_type i = 0; i < capacity_; ++i) {
+                if(!SM_IS_FULL(ctrl_[i])) {
+                    continue;
+                }
+                size_type hash = hash_key(keys_[i]);
+                size_type pos = find_free(ctrl, mask, hash);
+                sm_ctrl_set(ctrl, next_capacity, pos, SM_H2(hash));
+                relocate(&keys[pos], &values[pos], &keys_[i], &values_[i]);
+            }
+            if(nullptr != buffer_) {
+                allocator_traits::deallocate(allocator_, buffer_, buffer_count_);
+            }
+            deleted_ = 0;
+            capacity_ = next_capacity;
+            mask_ = mask;
+            buffer_ = buffer;
+            buffer_count_ = count;
+            ctrl_ = ctrl;
+            keys_ = keys;
+            values_ = values;
+            return true;
+        }
+
+        void destroy_items()
+        {
+            if constexpr(!std::is_trivially_destructible_v<K> || !std::is_trivially_destructible_v<V>) {
+                for(size_type i = 0; i < capacity_; ++i) {
+                    if(!SM_IS_FULL(ctrl_[i])) {
+                        continue;
+                    }
+                    keys_[i].~K();
+                    values_[i].~V();
+                }
+            }
+        }
+
+        void release()
+        {
+            destroy_items();
+            if(nullptr != buffer_) {
+                allocator_traits::deallocate(allocator_, buffer_, buffer_count_);
+            }
+            size_ = deleted_ = capacity_ = mask_ = 0;
+            buffer_ = nullptr;
+            buffer_count_ = 0;
+            ctrl_ = nullptr;
+            keys_ = nullptr;
+            values_ = nullptr;
+        }
+
+        void steal(smallmap& other)
+        {
+            size_ = other.size_;
+            deleted_ = other.deleted_;
+            capacity_ = other.capacity_;
+            mask_ = other.mask_;
+            buffer_ = other.buffer_;
+            buffer_count_ = other.buffer_count_;
+            ctrl_ = other.ctrl_;
+            keys_ = other.keys_;
+            values_ = other.values_;
+            other.size_ = other.deleted_ = other.capacity_ = other.mask_ = 0;
+            other.buffer_ = nullptr;
+            other.buffer_count_ = 0;
+            other.ctrl_ = nullptr;
+            other.keys_ = nullptr;
+            other.values_ = nullptr;
+        }
+
+        Hash hash_;
+        Eq eq_;
+        allocator_type allocator_;
+        size_type size_ = 0; //!< number of items
+        size_type deleted_ = 0; //!< number of tombstones
+        size_type capacity_ = 0; //!< number of slots, zero until the first insertion
+        size_type mask_ = 0; //!< mask for using instead of division
+        buffer_type* buffer_ = nullptr; //!< one allocation for control bytes, keys and values
+        size_type buffer_count_ = 0; //!< number of buffer_type in the buffer
+        uint8_t* ctrl_ = nullptr; //!< control bytes, the first SM_GROUP_WIDTH bytes are cloned after the end
+        K* keys_ = nullptr; //!< buffer for keys
+        V* values_ = nullptr; //!< buffer for values
+    };
+} // namespace sm
+#endif //INC_SMALLMAP_HPP_
@@ -187,51 +187,161 @@ TSHASH_STATIC tshash_u64 tshash_mum(tshash_u64 x0, tshash_u64 x1)
 TSHASH_NAMESPACE_END
 #endif
 
+TSHASH_NAMESPACE_BEGIN
+/**
+ @brief The whole hash of data up to 16 bytes, the seed is already mixed with Seeds[0].
+ */
+inline TSHASH_STATIC tshash_u64 tshash_short(size_t size, const tshash_u8* key, tshash_u64 seed)
+{
+    tshash_u64 a,b;
+    if(4<=size){
+        size_t remain = (size>>3)<<2;
+        a = (tshash_load32(key)<<32) | tshash_load32(key+remain);
+        b = (tshash_load32(key+size-4)<<32) | tshash_load32(key+size-4-remain);
+    }else if(0<size){
+        a = tshash_load12(key, size);
+        b = 0;
+    }else{
+        a = b = 0;
+    }
+    return tshash_mum(Seeds[4]^size, tshash_mum(a^Seeds[1], b^seed));
+}
+TSHASH_NAMESPACE_END
+
 tshash_u64 tshash64(size_t size, const void* const data, tshash_u64 seed)
 {
     assert((0<size && TSHASH_NULL != data) || (size<=0));
     const tshash_u8* key = (const uint8_t*)data;
     seed ^= Seeds[0];
-    tshash_u64 a,b;
     if(size<=16){
-        if(4<=size){
-            size_t remain = (size>>3)<<2;
-            a = (tshash_load32(key)<<32) | tshash_load32(key+remain);
-            b = (tshash_load32(key+size-4)<<32) | tshash_load32(key+size-4-remain);
-        }else if(0<size){
-            a = tshash_load12(key, size);
-            b = 0;
-        }else{
-            a = b = 0;
-        }
-    }else{
-        uint64_t l = size;
-        if(48<l){
-            tshash_u64 seed0 = seed;
-            tshash_u64 seed1 = seed;
-            do{
-                seed = tshash_mum(tshash_load64(key)^Seeds[1], tshash_load64(key+8)^seed);
-                seed0 = tshash_mum(tshash_load64(key+16)^Seeds[2], tshash_load64(key+24)^seed0);
-                seed1 = tshash_mum(tshash_load64(key+32)^Seeds[3], tshash_load64(key+40)^seed1);
-                key += 48;
-                l -= 48;
-            }while(48<l);
-            seed ^= seed0^seed1;
-        }
-        while(16<l){
+        return tshash_short(size, key, seed);
+    }
+    uint64_t l = size;
+    if(48<l){
+        tshash_u64 seed0 = seed;
+        tshash_u64 seed1 = seed;
+        do{
             seed = tshash_mum(tshash_load64(key)^Seeds[1], tshash_load64(key+8)^seed);
-            key += 16;
-            l -= 16;
-        }
-        a = tshash_load64(key+l-16);
-        b = tshash_load64(key+l-8);
+            seed0 = tshash_mum(tshash_load64(key+16)^Seeds[2], tshash_load64(key+24)^seed0);
+            seed1 = tshash_mum(tshash_load64(key+32)^Seeds[3], tshash_load64(key+40)^seed1);
+            key += 48;
+            l -= 48;
+        }while(48<l);
+        seed ^= seed0^seed1;
     }
+    while(16<l){
+        seed = tshash_mum(tshash_load64(key)^Seeds[1], tshash_load64(key+8)^seed);
+        key += 16;
+        l -= 16;
+    }
+    tshash_u64 a = tshash_load64(key+l-16);
+    tshash_u64 b = tshash_load64(key+l-8);
     return tshash_mum(Seeds[4]^size, tshash_mum(a^Seeds[1], b^seed));
 }
 
+void tshash64_batch(size_t count, const size_t* sizes, const void* const* data, tshash_u64* hashes, tshash_u64 seed)
+{
+    assert(count<=0 || (TSHASH_NULL != sizes && TSHASH_NULL != data && TSHASH_NULL != hashes));
+    tshash_u64 mixed = seed^Seeds[0];
+    for(size_t i=0; i<count; ++i){
+        size_t size = sizes[i];
+        assert((0<size && TSHASH_NULL != data[i]) || (size<=0));
+        // Short keys are inlined, so that the multiplies of neighboring keys overlap
+        hashes[i] = (size<=16)? tshash_short(size, (const tshash_u8*)data[i], mixed) : tshash64(size, data[i], seed);
+    }
+}
+
 tshash_u32 tshash32(size_t size, const void* const data, tshash_u64 seed)
 {
     tshash_u64 hash = tshash64(size, data, seed);
     return (tshash_u32)((hash>>32ULL) ^ (hash&0xFFFFFFFFULL));
 }
+
+TSHASH_NAMESPACE_BEGIN
+/**
+ @brief Process a 48-byte block of tshash64's long loop.
+ */
+inline TSHASH_STATIC void tshash_block(tshash_state* state, const tshash_u8* key)
+{
+    state->seed = tshash_mum(tshash_load64(key)^Seeds[1], tshash_load64(key+8)^state->seed);
+    state->seed0 = tshash_mum(tshash_load64(key+16)^Seeds[2], tshash_load64(key+24)^state->seed0);
+    state->seed1 = tshash_mum(tshash_load64(key+32)^Seeds[3], tshash_load64(key+40)^state->seed1);
+}
+TSHASH_NAMESPACE_END
+
+void tshash_init(tshash_state* state, tshash_u64 seed)
+{
+    assert(TSHASH_NULL != state);
+    state->seed = seed^Seeds[0];
+    state->seed0 = state->seed;
+    state->seed1 = state->seed;
+    state->size = 0;
+    state->length = 0;
+}
+
+void tshash_update(tshash_state* state, size_t size, const void* const data)
+{
+    assert(TSHASH_NULL != state);
+    assert((0<size && TSHASH_NULL != data) || (size<=0));
+    const tshash_u8* key = (const tshash_u8*)data;
+    if(size<=0){
+        return;
+    }
+    state->size += size;
+    // A block is processed only when more data follows it, as tshash64 leaves the last 1 to 48 bytes to its tail
+    if(0<state->length){
+        size_t fill = 48-state->length;
+        fill = (size<fill)? size : fill;
+        memcpy(state->buffer+16+state->length, key, fill);
+        state->length += (tshash_u32)fill;
+        key += fill;
+        size -= fill;
+        if(size<=0){
+            return;
+        }
+        tshash_block(state, state->buffer+16);
+        memcpy(state->buffer, state->buffer+48, 16);
+        state->length = 0;
+    }
+    if(48<size){
+        do{
+            tshash_block(state, key);
+            key += 48;
+            size -= 48;
+        }while(48<size);
+        memcpy(state->buffer, key-16, 16);
+    }
+    memcpy(state->buffer+16, key, size);
+    state->length = (tshash_u32)size;
+}
+
+tshash_u64 tshash64_final(const tshash_state* state)
+{
+    assert(TSHASH_NULL != state);
+    const tshash_u8* key = state->buffer+16;
+    tshash_u64 size = state->size;
+    tshash_u64 seed = state->seed;
+    if(size<=16){
+        return tshash_short((size_t)size, key, seed);
+    }
+    if(48<size){
+        seed ^= state->seed0^state->seed1;
+    }
+    tshash_u64 l = state->length;
+    while(16<l){
+        seed = tshash_mum(tshash_load64(key)^Seeds[1], tshash_load64(key+8)^seed);
+        key += 16;
+        l -= 16;
+    }
+    // The tail reaches back into the kept bytes of processed data
+    tshash_u64 a = tshash_load64(key+l-16);
+    tshash_u64 b = tshash_load64(key+l-8);
+    return tshash_mum(Seeds[4]^size, tshash_mum(a^Seeds[1], b^seed));
+}
+
+tshash_u32 tshash32_final(const tshash_state* state)
+{
+    tshash_u64 hash = tshash64_final(state);
+    return (tshash_u32)((hash>>32ULL) ^ (hash&0xFFFFFFFFULL));
+}
 TSHASH_EXTERN_C_END
@@ -50,6 +50,19 @@ typedef uint64_t tshash_u64;
 #define TSHASH_DEFUALT_SEED (0xD4A3D22E3C651BD1ULL)
 #endif
 
+/**
+ @brief A state to calculate the hash of data which is given in fragments.
+ */
+typedef struct tshash_state_t
+{
+    tshash_u64 seed;
+    tshash_u64 seed0;
+    tshash_u64 seed1;
+    tshash_u64 size; //!< The total size of given data.
+    tshash_u32 length; //!< The size of data which is not processed yet.
+    tshash_u8 buffer[64]; //!< The last 16 bytes of processed data, then up to 48 bytes not processed yet.
+} tshash_state;
+
 TSHASH_EXTERN_C
 /**
  @brief Calculate the hash of data.
@@ -59,6 +72,17 @@ TSHASH_EXTERN_C
  */
 tshash_u64 tshash64(size_t size, const void* const data, tshash_u64 seed);
 
+/**
+ @brief Calculate the hashes of many data at once, the same as calling tshash64 for each.
+ @details Keys up to 16 bytes are hashed inline, so that the work of neighboring keys overlaps.
+ @param [in] count ... The number of data.
+ @param [in] sizes ... The size of each data in bytes.
+ @param [in] data ... Each data for hashing.
+ @param [out] hashes ... The hash of each data.
+ @param [in] seed ... A seed, see tshash64.
+ */
+void tshash64_batch(size_t count, const size_t* sizes, const void* const* data, tshash_u64* hashes, tshash_u64 seed);
+
 /**
  @brief Calculate the hash of data.
  @param [in] size ... The size of data in bytes.
@@ -66,6 +90,31 @@ tshash_u64 tshash64(size_t size, const void* const data, tshash_u64 seed);
  @param [in] seed ... A seed to get a variation of the hash function. Recommended to use the default, because this function has some known bad seeds.
  */
 tshash_u32 tshash32(size_t size, const void* const data, tshash_u64 seed);
+
+/**
+ @brief Start to calculate a hash in fragments.
+ @param [out] state ... A state.
+ @param [in] seed ... A seed, see tshash64.
+ */
+void tshash_init(tshash_state* state, tshash_u64 seed);
+
+/**
+ @brief Add a fragment of data.
+ @param [in,out] state ... A state started by tshash_init.
+ @param [in] size ... The size of the fragment in bytes.
+ @param [in] data ... The fragment. If the size is zero, the data can be null.
+ */
+void tshash_update(tshash_state* state, size_t size, const void* const data);
+
+/**
+ @brief The hash of all fragments, the same as tshash64 of them concatenated. The state is not changed, more fragments can be added.
+ */
+tshash_u64 tshash64_final(const tshash_state* state);
+
+/**
+ @brief The hash of all fragments, the same as tshash32 of them concatenated.
+ */
+tshash_u32 tshash32_final(const tshash_state* state);
 TSHASH_EXTERN_C_END
 #endif //INC_TSHASH_H_
 